@@ -0,0 +1,112 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#define _GNU_SOURCE // needed for RTLD_DEFAULT
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Shared harness of the benchmarks.
+ * Every benchmark (except stress) is run as `name THREADS OPS`: it starts THREADS workers that each do OPS
+ * operations, all at once, and prints one line of JSON with the average time per operation.
+ */
+
+typedef struct {
+    int index; // 0 .. threads - 1
+    int threads;
+    long ops;
+    void *shared;
+} BenchThread;
+
+static inline uint64_t bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// whether we're running under libidle
+static inline bool bench_preloaded()
+{
+    return dlsym(RTLD_DEFAULT, "libidle_enable_forced_idle") != NULL;
+}
+
+static inline void bench_args(int argc, char **argv, int *threads, long *ops)
+{
+    if (argc != 3 || (*threads = atoi(argv[1])) < 1 || (*ops = atol(argv[2])) < 1)
+    {
+        fprintf(stderr, "usage: %s THREADS OPS\n", argv[0]);
+        exit(2);
+    }
+}
+
+static pthread_barrier_t bench_start;
+
+typedef struct {
+    void *(*worker)(BenchThread *);
+    BenchThread thread;
+    // measured by the thread itself, since it may be done before the main thread gets to run
+    uint64_t start_ns, end_ns;
+} BenchStart;
+
+static inline void *bench_thread(void *arg)
+{
+    BenchStart *start = arg;
+    pthread_barrier_wait(&bench_start);
+    start->start_ns = bench_now_ns();
+    void *ret = start->worker(&start->thread);
+    start->end_ns = bench_now_ns();
+    return ret;
+}
+
+/**
+ * Run worker in `threads` threads and return the time in ns that passed from the first one
+ * starting until the last one finished.
+ */
+static inline uint64_t bench_run(int threads, long ops, void *(*worker)(BenchThread *), void *shared)
+{
+    BenchStart *starts = calloc(threads, sizeof(BenchStart));
+    pthread_t *ids = calloc(threads, sizeof(pthread_t));
+
+    pthread_barrier_init(&bench_start, NULL, threads + 1);
+    for (int i = 0; i < threads; i++)
+    {
+        starts[i] = (BenchStart) {
+            .worker = worker,
+            .thread = { .index = i, .threads = threads, .ops = ops, .shared = shared },
+        };
+        if (pthread_create(&ids[i], NULL, bench_thread, &starts[i]) != 0)
+        {
+            fprintf(stderr, "cannot create thread %d\n", i);
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&bench_start);
+    uint64_t start = UINT64_MAX, end = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(ids[i], NULL);
+        if (starts[i].start_ns < start) start = starts[i].start_ns;
+        if (starts[i].end_ns > end) end = starts[i].end_ns;
+    }
+    pthread_barrier_destroy(&bench_start);
+
+    free(ids);
+    free(starts);
+    return end - start;
+}
+
+// print the result of a bench_run, divided by threads * ops
+static inline void bench_report(const char *name, int threads, long ops, uint64_t elapsed)
+{
+    printf("{\"bench\": \"%s\", \"libidle\": %s, \"threads\": %d, \"ops\": %ld, \"ns_per_op\": %.1f}\n",
+        name, bench_preloaded() ? "true" : "false", threads, ops, (double) elapsed / ((double) threads * ops));
+}
+
+#endif
@@ -0,0 +1,21 @@
+#!/usr/bin/env bash
+# Runs every benchmark with and without libidle, for 1 to MAX_THREADS threads (default 256).
+# Prints one JSON object per line to stdout; compare the "libidle": true and false lines.
+set -euo pipefail
+cd "$(dirname "$0")"
+
+IDLE_SO="$(pwd)/../src/libidle.so"
+MAX_THREADS="${MAX_THREADS:-256}"
+# ops per thread; pthread_create is much slower than the rest
+declare -A OPS=([sem_pingpong]=20000 [cond_handoff]=20000 [transitions]=20000 [create_join]=500)
+
+make -s >&2
+make -s -C ../src libidle.so >&2
+export LIBIDLE_STATEFILE=build/.libidle_state
+
+for bench in sem_pingpong cond_handoff transitions create_join; do
+  for ((threads = 1; threads <= MAX_THREADS; threads *= 2)); do
+    build/$bench $threads ${OPS[$bench]}
+    LD_PRELOAD=${LD_PRELOAD:+${LD_PRELOAD}:}${IDLE_SO} build/$bench $threads ${OPS[$bench]}
+  done
+done
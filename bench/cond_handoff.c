@@ -0,0 +1,55 @@
+#include "bench.h"
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    long turn; // even: the first thread of the pair may go; odd: the second
+} Pair;
+
+/*
+ * Bench: threads pair up and take turns, handing over with pthread_cond_signal and pthread_cond_wait.
+ * One op is one turn. A thread without a partner signals and doesn't wait.
+ */
+static void *handoff(BenchThread *thread)
+{
+    Pair *pair = &((Pair *) thread->shared)[thread->index / 2];
+    bool alone = thread->index % 2 == 0 && thread->index + 1 == thread->threads;
+    int side = thread->index % 2;
+
+    pthread_mutex_lock(&pair->mutex);
+    for (long i = 0; i < thread->ops; i++)
+    {
+        while (!alone && pair->turn % 2 != side)
+        {
+            pthread_cond_wait(&pair->cond, &pair->mutex);
+        }
+        pair->turn++;
+        pthread_cond_signal(&pair->cond);
+    }
+    pthread_mutex_unlock(&pair->mutex);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int threads;
+    long ops;
+    bench_args(argc, argv, &threads, &ops);
+
+    int pairs = (threads + 1) / 2;
+    Pair *shared = calloc(pairs, sizeof(Pair));
+    for (int i = 0; i < pairs; i++)
+    {
+        pthread_mutex_init(&shared[i].mutex, NULL);
+        pthread_cond_init(&shared[i].cond, NULL);
+    }
+
+    bench_report("cond_handoff", threads, ops, bench_run(threads, ops, handoff, shared));
+
+    for (int i = 0; i < pairs; i++)
+    {
+        pthread_cond_destroy(&shared[i].cond);
+        pthread_mutex_destroy(&shared[i].mutex);
+    }
+    free(shared);
+}
@@ -0,0 +1,34 @@
+#include "bench.h"
+
+static void *nothing(void *arg)
+{
+    return arg;
+}
+
+/*
+ * Bench: every thread repeatedly creates a thread that returns right away, and joins it.
+ * One op is one pthread_create and one pthread_join.
+ */
+static void *create_join(BenchThread *thread)
+{
+    for (long i = 0; i < thread->ops; i++)
+    {
+        pthread_t child;
+        if (pthread_create(&child, NULL, nothing, NULL) != 0)
+        {
+            fprintf(stderr, "create_join: cannot create thread\n");
+            exit(1);
+        }
+        pthread_join(child, NULL);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int threads;
+    long ops;
+    bench_args(argc, argv, &threads, &ops);
+
+    bench_report("create_join", threads, ops, bench_run(threads, ops, create_join, NULL));
+}
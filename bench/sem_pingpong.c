@@ -0,0 +1,51 @@
+#include <semaphore.h>
+
+#include "bench.h"
+
+/*
+ * Bench: threads pair up and bounce a token between them with sem_post and sem_wait.
+ * One op is one post and one wait. A thread without a partner posts to itself,
+ * which measures the uncontended path.
+ */
+static void *pingpong(BenchThread *thread)
+{
+    sem_t *sems = thread->shared;
+    sem_t *ping = &sems[thread->index / 2 * 2], *pong = ping + 1;
+    bool alone = thread->index % 2 == 0 && thread->index + 1 == thread->threads;
+
+    for (long i = 0; i < thread->ops; i++)
+    {
+        if (alone)
+        {
+            sem_post(ping);
+            sem_wait(ping);
+        }
+        else if (thread->index % 2 == 0)
+        {
+            sem_post(ping);
+            sem_wait(pong);
+        }
+        else
+        {
+            sem_wait(ping);
+            sem_post(pong);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int threads;
+    long ops;
+    bench_args(argc, argv, &threads, &ops);
+
+    // two per pair, plus a spare pair for the odd thread out
+    sem_t *sems = calloc(threads + 1, sizeof(sem_t));
+    for (int i = 0; i < threads + 1; i++) sem_init(&sems[i], 0, 0);
+
+    bench_report("sem_pingpong", threads, ops, bench_run(threads, ops, pingpong, sems));
+
+    for (int i = 0; i < threads + 1; i++) sem_destroy(&sems[i]);
+    free(sems);
+}
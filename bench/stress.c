@@ -0,0 +1,145 @@
+#include <semaphore.h>
+
+#include "bench.h"
+
+/*
+ * Stress: build up large registries of live semaphores and conditions, then run phases in which
+ * every thread churns through its share of them. Reports the throughput and the latency
+ * distribution of each phase, so registry changes can be compared at realistic data sizes.
+ *
+ * Phases:
+ * - sem_churn: sem_destroy and sem_init one of our semaphores
+ * - cond_churn: pthread_cond_destroy and pthread_cond_init one of our conditions
+ * - sem_lookup: sem_post and sem_wait on a random one of our semaphores
+ * - transitions: enter and leave forced idle (an idle/busy transition when we happen to be last)
+ */
+
+typedef struct {
+    sem_t *sems;
+    int sems_len;
+    pthread_cond_t *conds;
+    int conds_len;
+    // latency of every op, ops per thread
+    uint32_t *latencies;
+} Stress;
+
+static void (*enable_forced_idle)();
+static void (*disable_forced_idle)();
+
+// xorshift; good enough to spread lookups
+static uint32_t next_random(uint32_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// the semaphores and conditions of a thread are those whose index is congruent to it
+static int own_index(BenchThread *thread, int len, uint32_t random)
+{
+    int own = len / thread->threads;
+    return (int) (random % own) * thread->threads + thread->index;
+}
+
+#define PHASE(name, op) \
+static void *name(BenchThread *thread) \
+{ \
+    Stress *stress = thread->shared; \
+    uint32_t *latencies = &stress->latencies[thread->index * thread->ops]; \
+    uint32_t random __attribute__ ((unused)) = thread->index + 1; \
+    for (long i = 0; i < thread->ops; i++) \
+    { \
+        uint64_t start = bench_now_ns(); \
+        op; \
+        latencies[i] = bench_now_ns() - start; \
+    } \
+    return NULL; \
+}
+
+PHASE(sem_churn, {
+    sem_t *sem = &stress->sems[own_index(thread, stress->sems_len, next_random(&random))];
+    sem_destroy(sem);
+    sem_init(sem, 0, 0);
+})
+
+PHASE(cond_churn, {
+    pthread_cond_t *cond = &stress->conds[own_index(thread, stress->conds_len, next_random(&random))];
+    pthread_cond_destroy(cond);
+    pthread_cond_init(cond, NULL);
+})
+
+PHASE(sem_lookup, {
+    sem_t *sem = &stress->sems[own_index(thread, stress->sems_len, next_random(&random))];
+    sem_post(sem);
+    sem_wait(sem);
+})
+
+PHASE(transitions, {
+    if (enable_forced_idle) enable_forced_idle();
+    if (disable_forced_idle) disable_forced_idle();
+})
+
+static int compare_latencies(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void run_phase(const char *name, void *(*phase)(BenchThread *), Stress *stress, int threads, long ops)
+{
+    uint64_t elapsed = bench_run(threads, ops, phase, stress);
+
+    size_t len = (size_t) threads * ops;
+    qsort(stress->latencies, len, sizeof(uint32_t), compare_latencies);
+    printf("{\"bench\": \"stress\", \"phase\": \"%s\", \"libidle\": %s, \"threads\": %d, "
+        "\"sems\": %d, \"conds\": %d, \"ops\": %ld, \"ops_per_sec\": %.0f, "
+        "\"p50_ns\": %u, \"p99_ns\": %u, \"p999_ns\": %u, \"max_ns\": %u}\n",
+        name, bench_preloaded() ? "true" : "false", threads, stress->sems_len, stress->conds_len, ops,
+        len / (elapsed / 1e9),
+        stress->latencies[len / 2], stress->latencies[len * 99 / 100], stress->latencies[len * 999 / 1000],
+        stress->latencies[len - 1]);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 5)
+    {
+        fprintf(stderr, "usage: %s THREADS SEMS CONDS OPS\n", argv[0]);
+        return 2;
+    }
+    int threads = atoi(argv[1]);
+    Stress stress = { .sems_len = atoi(argv[2]), .conds_len = atoi(argv[3]) };
+    long ops = atol(argv[4]);
+    if (threads < 1 || stress.sems_len < threads || stress.conds_len < threads || ops < 1)
+    {
+        fprintf(stderr, "%s: need at least one semaphore and condition per thread\n", argv[0]);
+        return 2;
+    }
+    enable_forced_idle = dlsym(RTLD_DEFAULT, "libidle_enable_forced_idle");
+    disable_forced_idle = dlsym(RTLD_DEFAULT, "libidle_disable_forced_idle");
+
+    stress.sems = calloc(stress.sems_len, sizeof(sem_t));
+    stress.conds = calloc(stress.conds_len, sizeof(pthread_cond_t));
+    stress.latencies = calloc((size_t) threads * ops, sizeof(uint32_t));
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < stress.sems_len; i++) sem_init(&stress.sems[i], 0, 0);
+    for (int i = 0; i < stress.conds_len; i++) pthread_cond_init(&stress.conds[i], NULL);
+    bench_report("stress_setup", 1, stress.sems_len + stress.conds_len, bench_now_ns() - start);
+
+    run_phase("sem_churn", sem_churn, &stress, threads, ops);
+    run_phase("cond_churn", cond_churn, &stress, threads, ops);
+    run_phase("sem_lookup", sem_lookup, &stress, threads, ops);
+    // keep the main thread out of the count, so only the workers decide when we go idle
+    if (enable_forced_idle) enable_forced_idle();
+    run_phase("transitions", transitions, &stress, threads, ops);
+    if (disable_forced_idle) disable_forced_idle();
+
+    for (int i = 0; i < stress.conds_len; i++) pthread_cond_destroy(&stress.conds[i]);
+    for (int i = 0; i < stress.sems_len; i++) sem_destroy(&stress.sems[i]);
+    free(stress.latencies);
+    free(stress.conds);
+    free(stress.sems);
+}
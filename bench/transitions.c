@@ -0,0 +1,36 @@
+#include "bench.h"
+
+/*
+ * Bench: every thread repeatedly enters and leaves forced idle.
+ * With one thread, every op is a transition to idle and back to busy.
+ * With more, the process only goes idle when all threads happen to be idle at once,
+ * so this measures how the transition path holds up under contention.
+ * Without libidle, the calls are missing and this only measures the loop.
+ */
+static void (*enable_forced_idle)();
+static void (*disable_forced_idle)();
+
+static void *toggle(BenchThread *thread)
+{
+    for (long i = 0; i < thread->ops; i++)
+    {
+        if (enable_forced_idle) enable_forced_idle();
+        if (disable_forced_idle) disable_forced_idle();
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int threads;
+    long ops;
+    bench_args(argc, argv, &threads, &ops);
+
+    enable_forced_idle = dlsym(RTLD_DEFAULT, "libidle_enable_forced_idle");
+    disable_forced_idle = dlsym(RTLD_DEFAULT, "libidle_disable_forced_idle");
+
+    // keep the main thread out of the count, so only the workers decide when we go idle
+    if (enable_forced_idle) enable_forced_idle();
+    bench_report("transitions", threads, ops, bench_run(threads, ops, toggle, NULL));
+    if (disable_forced_idle) disable_forced_idle();
+}
@@ -1,47 +1,294 @@
 #define _GNU_SOURCE // needed for RTLD_NEXT
 
 #include <assert.h>
+#include <dirent.h>
 #include <dlfcn.h>
 #include <errno.h>
 #include <execinfo.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "libidle.h"
+
 #define NON_NULL(S) do { if (!S) { fprintf(stderr, "couldn't load symbol: " #S "\n"); abort(); } } while (false)
 
 /**
- * Arrays consist of name_ptr and name_len.
+ * Arrays consist of name_ptr, name_len and name_cap.
  * Increase the length of this array by 1 and yield the new value.
+ * The capacity grows geometrically, so pushing is amortized O(1).
+ */
+#define PUSH(array) (*((void) (array ## _len < array ## _cap || GROW(array)), &array ## _ptr[array ## _len++]))
+
+/// Decrease the length of this array by 1. The capacity is kept for the next PUSH.
+#define DROP(array) (array ## _len--)
+
+#define GROW(array) (array ## _cap = array ## _cap ? array ## _cap * 2 : 4,\
+    (array ## _ptr = realloc(array ## _ptr, sizeof(*array ## _ptr) * array ## _cap)) != NULL)
+
+/**
+ * Slab allocator for records that need stable addresses.
+ * Records are carved out of chunks that are allocated once and never freed, so a freed
+ * record stays readable (and can't be mistaken for a record of another type).
+ * Every record type has its own slab, and names a pointer member that holds the link
+ * to the next free record while it is free. A new record is zeroed.
+ * Not thread-safe; callers lock the state mutex.
+ */
+typedef struct {
+    size_t size;
+    size_t align;
+    size_t link_offset;
+    void *free;
+} Slab;
+
+#define SLAB_INIT(type, link_member) { \
+    .size = sizeof(type), .align = _Alignof(type), .link_offset = offsetof(type, link_member) }
+
+#define SLAB_CHUNK 64
+
+#define SLAB_LINK(slab, record) (*(void **) ((char *) (record) + (slab)->link_offset))
+
+static void *slab_alloc(Slab *slab)
+{
+    if (!slab->free)
+    {
+        // sizeof is always a multiple of _Alignof, as aligned_alloc requires.
+        size_t align = slab->align < sizeof(void *) ? sizeof(void *) : slab->align;
+        char *chunk = aligned_alloc(align, slab->size * SLAB_CHUNK);
+        for (int i = 0; i < SLAB_CHUNK; i++)
+        {
+            SLAB_LINK(slab, chunk + i * slab->size) = (i + 1 < SLAB_CHUNK) ? chunk + (i + 1) * slab->size : NULL;
+        }
+        slab->free = chunk;
+    }
+    void *record = slab->free;
+    slab->free = SLAB_LINK(slab, record);
+    memset(record, 0, slab->size);
+    return record;
+}
+
+static void slab_free(Slab *slab, void *record)
+{
+    SLAB_LINK(slab, record) = slab->free;
+    slab->free = record;
+}
+
+/**
+ * Open-addressing hash table that indexes records by the address of the object they describe.
+ * The records themselves are allocated separately, so their address is stable across resizes.
+ * The first member of every record must be the key pointer.
+ *
+ * Collisions are resolved by linear probing. Removal uses backward-shift deletion,
+ * so there are no tombstones and lookups never degrade with churn.
+ *
+ * Lookups take no lock. Modifications must be serialized by the caller.
+ * To make this safe, memory that a reader may still be looking at is never freed:
+ * tables that were outgrown are abandoned (together they are never larger than the
+ * current table), and records must come from a Slab, which never frees memory either.
+ * A record's key is cleared when it's removed and set again right before it's inserted,
+ * so if a reader finds its key in a record, it's the record currently registered for that key.
+ * A lookup racing with a removal can miss an entry that is being moved back;
+ * so a miss must be confirmed with the lock held.
+ */
+typedef struct {
+    size_t mask; // number of slots - 1; the number of slots is always a power of two
+    _Atomic(void *) slots[];
+} PtrMapTable;
+
+typedef struct {
+    size_t len; // number of occupied slots
+    _Atomic(PtrMapTable *) table;
+} PtrMap;
+
+#define PTRMAP_INITIAL_SLOTS 16
+
+#define RECORD_KEY(record) __atomic_load_n((void **) (record), __ATOMIC_ACQUIRE)
+
+static size_t ptrmap_hash(const void *key)
+{
+    // murmur3 finalizer: object addresses are aligned and clustered, so mix all bits down
+    uint64_t h = (uintptr_t) key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static void *ptrmap_find(PtrMap *map, const void *key)
+{
+    PtrMapTable *table = atomic_load_explicit(&map->table, memory_order_acquire);
+    if (!table) return NULL;
+    for (size_t i = ptrmap_hash(key) & table->mask; ; i = (i + 1) & table->mask)
+    {
+        void *record = atomic_load_explicit(&table->slots[i], memory_order_acquire);
+        if (!record) return NULL;
+        if (RECORD_KEY(record) == key) return record;
+    }
+}
+
+static void ptrmap_place(PtrMapTable *table, void *record)
+{
+    size_t i = ptrmap_hash(RECORD_KEY(record)) & table->mask;
+    while (atomic_load_explicit(&table->slots[i], memory_order_relaxed)) i = (i + 1) & table->mask;
+    atomic_store_explicit(&table->slots[i], record, memory_order_release);
+}
+
+/**
+ * Set the key of the record and insert it.
+ * All other fields of the record must be initialized at this point.
+ */
+static void ptrmap_insert(PtrMap *map, void *record, void *key)
+{
+    PtrMapTable *table = atomic_load_explicit(&map->table, memory_order_relaxed);
+    // keep the load factor below 3/4
+    if (!table || (map->len + 1) * 4 > (table->mask + 1) * 3)
+    {
+        size_t old_slots = table ? table->mask + 1 : 0;
+        size_t new_slots = old_slots ? old_slots * 2 : PTRMAP_INITIAL_SLOTS;
+        PtrMapTable *new_table = calloc(1, sizeof(PtrMapTable) + new_slots * sizeof(void*));
+
+        new_table->mask = new_slots - 1;
+        for (size_t i = 0; i < old_slots; i++)
+        {
+            void *old_record = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+            if (old_record) ptrmap_place(new_table, old_record);
+        }
+        // the old table is abandoned, not freed: readers may still be probing it.
+        atomic_store_explicit(&map->table, new_table, memory_order_release);
+        table = new_table;
+    }
+    __atomic_store_n((void **) record, key, __ATOMIC_RELEASE);
+    ptrmap_place(table, record);
+    map->len++;
+}
+
+/**
+ * Remove the record for this key, clear its key and return it, or NULL if there is none.
+ * The record can be returned to its slab afterwards.
  */
-#define PUSH(array) array ## _ptr = realloc(array ## _ptr, sizeof(*array ## _ptr) * ++array ## _len);\
-    array ## _ptr[array ## _len - 1]
+static void *ptrmap_remove(PtrMap *map, const void *key)
+{
+    PtrMapTable *table = atomic_load_explicit(&map->table, memory_order_relaxed);
+    if (!table) return NULL;
+    size_t i = ptrmap_hash(key) & table->mask;
+    void *record;
+    while ((record = atomic_load_explicit(&table->slots[i], memory_order_relaxed)) && RECORD_KEY(record) != key)
+    {
+        i = (i + 1) & table->mask;
+    }
+    if (!record) return NULL;
 
-/// Decrease the length of this array by 1.
-#define DROP(array) array ## _ptr = realloc(array ## _ptr, sizeof(*array ## _ptr) * --array ## _len)
+    // shift back every following entry of the probe run that would otherwise become unreachable
+    size_t hole = i;
+    void *entry;
+    for (size_t j = (i + 1) & table->mask; (entry = atomic_load_explicit(&table->slots[j], memory_order_relaxed)); j = (j + 1) & table->mask)
+    {
+        size_t home = ptrmap_hash(RECORD_KEY(entry)) & table->mask;
+        // can the entry at j live in the hole? only if its home is not cyclically in (hole, j].
+        if (((j - home) & table->mask) >= ((j - hole) & table->mask))
+        {
+            // the entry is briefly in both slots: readers never miss it because of the copy...
+            atomic_store_explicit(&table->slots[hole], entry, memory_order_release);
+            hole = j;
+        }
+    }
+    // ...but they may miss it because of the hole appearing behind them, at its old position.
+    atomic_store_explicit(&table->slots[hole], NULL, memory_order_release);
+    map->len--;
+    __atomic_store_n((void **) record, NULL, __ATOMIC_RELEASE);
+    return record;
+}
 
 static int (*next_accept)(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 static int (*next_pthread_cond_destroy)(pthread_cond_t *cond);
 static int (*next_pthread_cond_init)(pthread_cond_t *restrict cond, const pthread_condattr_t *restrict attr);
+static int (*next_pthread_detach)(pthread_t thread);
 static int (*next_pthread_create)(pthread_t *thread, const pthread_attr_t *attr,
         void *(*start_routine)(void*), void *arg);
 static int (*next_pthread_join)(pthread_t thread, void **retval);
 static int (*next_sem_destroy)(sem_t *sem);
 static int (*next_sem_init)(sem_t *sem, int pshared, unsigned int value);
 static sem_t *(*next_sem_open)(const char *name, int oflag, ...);
+static int (*next_sem_clockwait)(sem_t *sem, clockid_t clockid, const struct timespec *abstime);
 static int (*next_sem_post)(sem_t *sem);
 static int (*next_sem_timedwait)(sem_t *sem, const struct timespec *abs_timeout);
 static int (*next_sem_wait)(sem_t *sem);
 static int (*next_pthread_setname_np)(pthread_t thread, const char *name);
+static int (*next_clock_nanosleep)(clockid_t clockid, int flags, const struct timespec *request,
+    struct timespec *remain);
+static int (*next_close)(int fd);
+static int (*next_dup2)(int oldfd, int newfd);
+static int (*next_dup3)(int oldfd, int newfd, int flags);
+static int (*next_epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event);
+static int (*next_epoll_pwait)(int epfd, struct epoll_event *events, int maxevents, int timeout,
+        const sigset_t *sigmask);
+static int (*next_epoll_wait)(int epfd, struct epoll_event *events, int maxevents, int timeout);
+static int (*next_nanosleep)(const struct timespec *req, struct timespec *rem);
+static int (*next_eventfd)(unsigned int initval, int flags);
+static int (*next_pipe)(int pipefd[2]);
+static int (*next_pipe2)(int pipefd[2], int flags);
+static int (*next_poll)(struct pollfd *fds, nfds_t nfds, int timeout);
+static int (*next_ppoll)(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout_ts,
+        const sigset_t *sigmask);
+static int (*next_pselect)(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+        const struct timespec *timeout, const sigset_t *sigmask);
+static ssize_t (*next_read)(int fd, void *buf, size_t count);
+static ssize_t (*next_readv)(int fd, const struct iovec *iov, int iovcnt);
+static ssize_t (*next_recv)(int sockfd, void *buf, size_t len, int flags);
+static ssize_t (*next_recvfrom)(int sockfd, void *buf, size_t len, int flags,
+        struct sockaddr *src_addr, socklen_t *addrlen);
+static ssize_t (*next_recvmsg)(int sockfd, struct msghdr *msg, int flags);
+static int (*next_select)(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout);
+static ssize_t (*next_send)(int sockfd, const void *buf, size_t len, int flags);
+static ssize_t (*next_sendmsg)(int sockfd, const struct msghdr *msg, int flags);
+static ssize_t (*next_sendto)(int sockfd, const void *buf, size_t len, int flags,
+        const struct sockaddr *dest_addr, socklen_t addrlen);
+static int (*next_socketpair)(int domain, int type, int protocol, int sv[2]);
+static long (*next_syscall)(long number, ...);
+static ssize_t (*next_write)(int fd, const void *buf, size_t count);
+static ssize_t (*next_writev)(int fd, const struct iovec *iov, int iovcnt);
+static int (*next_execv)(const char *path, char *const argv[]);
+static int (*next_execve)(const char *path, char *const argv[], char *const envp[]);
+static int (*next_execvp)(const char *file, char *const argv[]);
+static int (*next_execvpe)(const char *file, char *const argv[], char *const envp[]);
+static pid_t (*next_fork)();
+static pid_t (*next_wait4)(pid_t pid, int *wstatus, int options, struct rusage *rusage);
+static int (*next_waitid)(idtype_t idtype, id_t id, siginfo_t *infop, int options);
+static pid_t (*next_waitpid)(pid_t pid, int *wstatus, int options);
+
+/**
+ * Statistics of a semaphore or condition (see LibidlePrimitiveStats).
+ * Bumped with SHARED_STAT_ADD by whichever thread posts or waits.
+ */
+typedef struct {
+    uint64_t posts, waits, broadcasts, contended;
+} PrimitiveStats;
 
 /**
  * Records the number of pending wakeups on a semaphore
@@ -50,11 +297,31 @@ static int (*next_pthread_setname_np)(pthread_t thread, const char *name);
  * as idle if it has no pending wakeups.
  */
 typedef struct {
-    sem_t *sem; // semaphore is guaranteed/required to have a stable address.
+    sem_t *sem; // semaphore is guaranteed/required to have a stable address. key in state.sem_info.
     bool named_semaphore; // doesn't count as blocked because it gets external wakeups
-    int pending_wakeups;
+    /**
+     * The number of pending wakeups in the low 32 bits, and the number of blocked waiters
+     * (threads that are counted as active exactly while there are pending wakeups,
+     * see ACCOUNTED_SEMAPHORE) in the high 32 bits.
+     * Both are updated in a single compare-and-swap, so whoever changes them knows
+     * exactly how many threads went active or idle as a result.
+     */
+    _Atomic uint64_t counts;
+    // for a pshared semaphore in a domain (LIBIDLE_DOMAIN): counts live in the domain page instead
+    struct DomainSemaphore *shared;
+    // sem_post and sem_wait calls; only for semaphores in state.sem_info
+    PrimitiveStats stats;
+    // link in the slab's free list
+    void *next_free;
 } SemaphoreInfo;
 
+typedef struct {
+    int32_t pending_wakeups;
+    int32_t blocked_waiters;
+} SemaphoreCounts;
+
+_Static_assert(offsetof(SemaphoreInfo, sem) == 0, "PtrMap key must be the first member");
+
 /**
  * Condition variables are basically impossible to support.
  *
@@ -68,34 +335,211 @@ typedef struct {
  * Because of this, we reimplement condition variables on top of semaphores, who are nice
  * and predictable, and for whom we already have handling anyways.
  *
- * This works like so: every condition variable initializes two semaphores, which we'll
- * call "IN" and "OUT". When a thread goes to sleep on a condition variable, it increments
- * the number of waiting threads, and `sem_wait`s on OUT.
+ * This works like so: every condition variable has a "frame" with a token counter, which we'll
+ * call "IN". It works like a semaphore, but can release any number of tokens in one step. When a thread goes to sleep on a condition variable, it increments
+ * the number of waiting threads, and `sem_wait`s on IN.
  * When a thread tries to signal on the condition variable, it is always treated as a
  * broadcast. This is safe, because as said above, condition waiting threads may wake
  * up for basically any reason they want anyways.
  *
- * So when we `pthread_cond_broadcast`, we first copy out IN and OUT and reinitialize them
- * with fresh semaphores.
+ * So when we `pthread_cond_broadcast`, we first take out the frame and replace it
+ * with a fresh one.
  * This is so that future waits will only be woken up by future signals.
- * Then we post waiting_threads tokens on OUT and await waiting_threads tokens on IN.
- * This is so that all threads that are currently using the OUT semaphore to sleep
- * finish touching it.
- * Finally, we can now free the two semaphores and return.
+ * Then we set the frame's reference count to waiting_threads and post waiting_threads
+ * tokens on IN, and return. Every woken thread drops a reference once it's done with IN;
+ * the last one returns the frame to a pool, with its semaphore still registered.
+ * The tokens count as pending wakeups until they're consumed, so we stay busy
+ * until every woken thread has been accounted for.
+ * A broadcast with nobody sleeping doesn't need a new frame at all.
+ *
+ * Note that timeouts introduce a hole in this design, which is patched by "signaled".
  *
- * Note that timeouts introduce a hole in this design, which is patched by "bool *signaled".
+ * With LIBIDLE_COND_SIGNAL_ONE, `pthread_cond_signal` posts a single token instead, on the oldest
+ * frame that has more sleepers than tokens. Threads woken that way leave the frame like timed-out
+ * threads do, by decrementing its number of sleepers (and tokens).
+ * A token must only go to a thread that was already sleeping when it was posted, so if it's posted
+ * on the current frame, the frame is closed to new sleepers: a fresh frame becomes current.
+ * So a condition has a list of frames, oldest first. Closed frames leave the list once their last
+ * sleeper has left, or when a broadcast takes out all of them.
  */
-typedef struct {
-    pthread_cond_t *cond;
-    // TODO one struct for all three (ConditionEventInfo?)
-    // malloced because it needs to be stable across reallocs
-    sem_t *in, *out;
-    // set to true once the condition has been signaled, to allow us to collect and post late
-    bool *signaled;
+typedef struct ConditionFrame {
+    // futex word: the number of tokens available
+    _Atomic uint32_t in;
+    // pending wakeups on IN; not in state.sem_info, since we never need to look it up
+    SemaphoreInfo sem_info;
+    /**
+     * Set once a broadcast has taken the frame out, to tell timed-out sleepers to collect their token.
+     * Written under the condition mutex, but woken sleepers may read it without.
+     */
+    bool signaled;
+    // threads that are still going to consume a token from IN, once the frame is signaled
+    _Atomic int refs;
+    // threads sleeping on this frame that haven't left it yet
     int sleeping_threads;
+    // tokens posted by pthread_cond_signal (LIBIDLE_COND_SIGNAL_ONE) for those threads
+    int tokens;
+    // the next newer frame of the condition, or the next free frame in the slab
+    struct ConditionFrame *next;
+} ConditionFrame;
+
+typedef struct {
+    pthread_cond_t *cond; // key in state.cond_info
+    // locks the frames until they're signaled, and the frame list
+    pthread_mutex_t mutex;
+    // heap-allocated because they must outlive being taken out by a broadcast
+    ConditionFrame *oldest_frame, *frame;
+    /**
+     * The number of threads sleeping on any frame of the list.
+     * Incremented with the mutex held, before the sleeper releases the user mutex.
+     * So a broadcaster that holds the user mutex, or changed the predicate under it,
+     * will see the increment even without taking our mutex.
+     */
+    _Atomic int sleeping_threads;
     clockid_t clock;
+    PrimitiveStats stats;
+    // link in the slab's free list
+    void *next_free;
 } ConditionInfo;
 
+_Static_assert(offsetof(ConditionInfo, cond) == 0, "PtrMap key must be the first member");
+
+/**
+ * A channel is a pipe, eventfd or socketpair direction created in this process.
+ * Data written into it is a pending wakeup for whoever reads it, just like a semaphore post:
+ * we count units (bytes, or the counter value for an eventfd) that were written but not read yet.
+ * As with semaphores, the count is raised before the write, so the data is never on the way unseen.
+ *
+ * A thread blocked in read or poll-like calls is a blocked waiter of every channel it waits on
+ * (see ACCOUNTED_CHANNELS), so it's active exactly when one of them has pending units.
+ * Data from outside the process isn't counted: a thread waiting on it is idle.
+ */
+typedef struct ChannelInfo {
+    // pending units and blocked waiters; not in state.sem_info, since we look it up by fd
+    SemaphoreInfo sem_info;
+    // eventfd: reads and writes transfer an 8-byte counter value rather than bytes
+    bool counter;
+    // fds and waiting threads that refer to the channel; under the state mutex
+    int refs;
+    // link in the slab's free list
+    struct ChannelInfo *next_free;
+} ChannelInfo;
+
+// a channel watched by EPOLLIN on an epoll fd
+typedef struct {
+    int fd;
+    ChannelInfo *channel;
+} EpollWatch;
+
+// fds are keyed in state.fd_info by fd + 1, since the key must not be NULL
+#define FD_KEY(fd) ((void *) (intptr_t) ((fd) + 1))
+
+/**
+ * Registered file descriptors: both ends of our channels, and epoll fds that watch them.
+ * Other file descriptors are not registered; waiting on them is plain idleness, like accept.
+ * Records are replaced when an fd is closed (or dup2'd over). Duplicates of an fd aren't tracked.
+ */
+typedef struct {
+    void *key; // FD_KEY(fd); key in state.fd_info
+    // the channel that reads on this fd consume from, and the one that writes feed
+    ChannelInfo *in, *out;
+    // for an epoll fd: the channels registered for reading
+    EpollWatch *watches_ptr;
+    size_t watches_len, watches_cap;
+    // link in the slab's free list
+    void *next_free;
+} FdInfo;
+
+_Static_assert(offsetof(FdInfo, key) == 0, "PtrMap key must be the first member");
+
+/**
+ * What a blocking read on an fd can do, as far as it matters to us: see state.fd_kinds.
+ * Only fds below FD_KINDS are remembered; reads on higher ones are always checked.
+ */
+enum FdKind {
+    FD_KIND_UNKNOWN,
+    // a regular file, directory or block device: reading never waits for anyone
+    FD_KIND_READY,
+    // a socket, FIFO or character device: reading may wait for data
+    FD_KIND_MAY_BLOCK,
+};
+
+#define FD_KINDS 4096
+
+/**
+ * A futex word that threads wait on with the raw futex syscall (LIBIDLE_FUTEX), tracked like a semaphore:
+ * FUTEX_WAKE counts a pending wakeup for every waiter it's going to wake, and a woken waiter consumes one.
+ * Records are never removed, since nothing tells us when a futex word goes away.
+ */
+typedef struct {
+    uint32_t *uaddr; // key in state.futex_info
+    // pending wakeups and blocked waiters; not in state.sem_info
+    SemaphoreInfo sem_info;
+    /**
+     * Waiters that have counted a pending wakeup for themselves, to stay active
+     * until they've seen that the word still holds the value they wait for.
+     * Counted before the wakeup is added, and uncounted after it is taken back.
+     */
+    _Atomic int arming;
+    // link in the slab's free list
+    void *next_free;
+} FutexInfo;
+
+_Static_assert(offsetof(FutexInfo, uaddr) == 0, "PtrMap key must be the first member");
+
+/**
+ * LIBIDLE_DOMAIN: a process tree that is idle only when every member is.
+ * The root (the process that set LIBIDLE_DOMAIN, not inheriting LIBIDLE_DOMAIN_PAGE) creates the
+ * domain page, and is the only member that publishes: the statefile, shm page and socket are its own.
+ * Every member counts busy while its active_threads is above zero, and the root publishes
+ * from the sum of all members. Everything in the page is updated lock-free, since members may die anywhere.
+ */
+#define DOMAIN_MAGIC 0x6c646f6d // "ldom"
+#define DOMAIN_VERSION 2
+#define DOMAIN_MEMBERS 256
+#define DOMAIN_SEMAPHORES 1024
+// pid of a slot that fork has reserved for a child that doesn't know its pid yet
+#define DOMAIN_RESERVED -1
+
+typedef struct {
+    // 0 if free
+    _Atomic pid_t pid;
+    // counted in DomainPage.active
+    _Atomic bool busy;
+} DomainMember;
+
+/**
+ * Counts of a pshared semaphore, as in SemaphoreInfo, shared by every member that uses it.
+ * Keyed by address: the semaphore must be at the same address in every member, as after fork.
+ */
+typedef struct DomainSemaphore {
+    // 0 if free
+    _Atomic uintptr_t key;
+    _Atomic uint64_t counts;
+} DomainSemaphore;
+
+// who a root is, beyond its pid, which another pid namespace or a later process can have too
+typedef struct {
+    char boot_id[40]; // /proc/sys/kernel/random/boot_id
+    uint64_t pid_ns; // inode of /proc/self/ns/pid
+    uint64_t start_time; // clock ticks after boot, as in /proc/<pid>/stat
+} DomainRootId;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    _Atomic pid_t root;
+    // written before magic, and left alone after exec, which doesn't change it
+    DomainRootId root_id;
+    // busy members, plus threads that are active because of the pending wakeups of a shared semaphore
+    _Atomic int active;
+    // futex word: bumped whenever active crosses zero, which wakes the root's watcher
+    _Atomic uint32_t seq;
+    // number of times active went above zero, so the root doesn't miss a busy period between two looks
+    _Atomic uint32_t busy_periods;
+    DomainMember members[DOMAIN_MEMBERS];
+    DomainSemaphore semaphores[DOMAIN_SEMAPHORES];
+} DomainPage;
+
 /**
  * Because we want to support composition, the outermost override "counts".
  * Hence, instead of flags, we use a stack of `enum ForcedState`.
@@ -120,981 +564,4421 @@ enum ForcedState {
     IDLE,
 };
 
+/**
+ * How a thread currently contributes to state.active_threads.
+ * Rather than counting active threads on every state change, we keep a running count
+ * and move each thread between these classes as its state changes.
+ */
+enum ThreadAccounting {
+    // counted as one active thread
+    ACCOUNTED_ACTIVE,
+    // not counted
+    ACCOUNTED_IDLE,
+    /**
+     * Sleeping on a semaphore: counted in the semaphore's blocked_waiters.
+     * All blocked waiters of a semaphore are active while it has pending wakeups,
+     * so when pending_wakeups crosses zero, active_threads changes by blocked_waiters.
+     */
+    ACCOUNTED_SEMAPHORE,
+    /**
+     * Waiting on file descriptors: counted in the blocked_waiters of every channel in
+     * waiting_channels. That makes the thread count once for every channel with pending units,
+     * which is more than once at times, but it's zero exactly when the thread is idle.
+     */
+    ACCOUNTED_CHANNELS,
+};
+
+// forced states that fit in ThreadInfo; deeper nesting spills to the heap
+#define FORCED_STATE_INLINE 4
+
+#define TRACE_RING_EVENTS 4096
+
+// LIBIDLE_SAMPLE: frames per stack, and stacks kept (the newest overwrite the oldest)
+#define SAMPLE_FRAMES 32
+#define SAMPLE_RING 4096
+
+/**
+ * The stack of a thread that was keeping us busy, taken in the thread itself by libidle_sample_handler.
+ * seq is set last, to the number of the sample + 1, so that a sample that is still being written
+ * (or was overwritten by a later one) can be told apart when the samples are written out.
+ */
 typedef struct {
+    _Atomic uint64_t seq;
+    uint64_t timestamp; // kernel CLOCK_MONOTONIC ns
+    uint64_t serial; // times_idle when it was taken, ie. we were busy on the way to serial + 1
+    uint32_t trace_id;
+    char name[LIBIDLE_THREAD_NAME_LEN];
+    int depth;
+    void *frames[SAMPLE_FRAMES];
+} Sample;
+
+/**
+ * Single-producer single-consumer ring of trace events (LIBIDLE_TRACE).
+ * The producer is the thread that owns the ring, the consumer is libidle_trace_flush.
+ * head and tail only ever grow, and the ring is full when they are TRACE_RING_EVENTS apart.
+ * When its thread exits, the ring is released and can be taken over by a new thread;
+ * since that happens under the state mutex, there is still only one producer at a time.
+ * Rings are never freed, so the flusher can walk the list without a lock.
+ */
+typedef struct TraceRing {
+    // written by the producer
+    _Atomic uint64_t head __attribute__ ((aligned (64)));
+    // events that didn't fit; reported with the next event that does
+    uint64_t dropped;
+    // written by the consumer
+    _Atomic uint64_t tail __attribute__ ((aligned (64)));
+    // under the state mutex
+    bool in_use;
+    // immutable once the ring is published in state.trace_rings
+    struct TraceRing *next;
+    LibidleTraceEvent events[TRACE_RING_EVENTS];
+} TraceRing;
+
+typedef struct ThreadInfo {
+    // set by the thread itself once it runs (see libidle_claim_thread)
     pthread_t id;
     bool sleeping;
 
-    size_t forced_state_len;
+    // stack of forced states. points to forced_state_inline until that is outgrown.
+    size_t forced_state_len, forced_state_cap;
     enum ForcedState *forced_state_ptr;
-    const char *name;
+    enum ForcedState forced_state_inline[FORCED_STATE_INLINE];
+    // set by pthread_setname_np, under the state mutex
+    char name[LIBIDLE_THREAD_NAME_LEN];
+
+    // number in order of registration, as it appears in the trace
+    uint32_t trace_id;
+    // non-null if LIBIDLE_TRACE is set
+    TraceRing *trace_ring;
 
     // non-null when waiting on a semaphore, requires sleeping=true
-    sem_t *waiting_semaphore;
+    SemaphoreInfo *waiting_semaphore;
+    /**
+     * Channels we're waiting on in a read or poll-like call; each holds a reference.
+     * Only changed by the thread itself, under the state mutex.
+     */
+    ChannelInfo **waiting_channels_ptr;
+    size_t waiting_channels_len, waiting_channels_cap;
     // true if we're already in a call, indicates reentrancy
     bool in_call;
-} ThreadInfo;
+    // set while in nanosleep or clock_nanosleep, even where sleeping counts as busy, so LIBIDLE_SAMPLE leaves us alone
+    _Atomic bool in_sleep;
+    /**
+     * Set while the thread's name matches LIBIDLE_IGNORE_THREADS: it's counted as idle, whatever it does.
+     * Another thread may change it (pthread_setname_np, see libidle_apply_ignored).
+     */
+    bool ignored;
+
+    /**
+     * How the thread is counted right now. Changed by the thread itself in threadinfo_update_accounting,
+     * and by libidle_apply_ignored from whoever names it, but only between ACTIVE and IDLE; hence a CAS.
+     */
+    _Atomic enum ThreadAccounting accounting;
+    // set if accounting == ACCOUNTED_SEMAPHORE; only written by the thread itself
+    SemaphoreInfo *accounted_sem;
+
+    /**
+     * CLOCK_MONOTONIC ns at which a timed wait or sleep we're in will end by itself, or 0.
+     * Only written by the thread itself, without a lock; read on the transition to idle (libidle_next_deadline).
+     */
+    _Atomic uint64_t deadline;
+
+    // what the thread runs, set by pthread_create
+    void *(*start_routine)(void *);
+    void *start_arg;
+
+    /**
+     * Joining is waiting on this semaphore: the thread posts its one wakeup when it exits,
+     * before it stops counting as active, so that a joiner takes over without an idle moment in between.
+     */
+    SemaphoreInfo join_sem;
+    /**
+     * Under the state mutex. The record of a thread that is not detached outlives the thread,
+     * as a zombie, until it is joined (or detached). created is set once pthread_create has returned:
+     * until then, the record belongs to pthread_create too.
+     */
+    bool detached, created, exited;
+
+    /**
+     * For libidle_get_stats. Only the thread itself writes these (the mutex counters too,
+     * see libidle_lock_state_mutex), with STAT_ADD so that snapshots can read them at any time.
+     * stats_since is when the current busy or blocked period began, forced_since when the
+     * outermost forced state was entered.
+     */
+    LibidleThreadStats stats;
+    uint64_t stats_since, forced_since;
+
+    /**
+     * list of registered threads, in order of registration, or of zombies (exited).
+     * next is also used for the free list.
+     */
+    struct ThreadInfo *prev, *next;
+    /**
+     * Aligned to a cache line: every thread writes its own record constantly,
+     * so records of different threads must not share one.
+     * Records are never moved or freed (see Slab), so every thread can keep a pointer
+     * to its own record in `current_thread`.
+     */
+} __attribute__ ((aligned (64))) ThreadInfo;
+
+/**
+ * The ThreadInfo of the calling thread, or NULL if the thread was not registered.
+ * libidle is preloaded, so its TLS is part of the static TLS block and initial-exec is safe;
+ * this makes access a single load relative to the thread pointer.
+ */
+static __thread ThreadInfo *current_thread __attribute__ ((tls_model ("initial-exec")));
+
+/*
+ * To avoid a deadlock if a libidle function is interrupted by a signal while
+ * holding a lock, we block all signals while any of our mutexes is locked.
+ * The original mask is used to restore the previous set of signals
+ * after the outermost lock has been released.
+ * (Prompted by issues with parallel garbage collection in D 2.090. D uses signals
+ * to freeze all but one thread. The frozen threads may be in libidle operations.)
+ */
+static __thread int signals_blocked __attribute__ ((tls_model ("initial-exec")));
+static __thread sigset_t original_mask __attribute__ ((tls_model ("initial-exec")));
+
+// how many samples libidle_sample_handler took in this thread, so a sleep can tell that it was cut short by one
+static __thread unsigned samples_here __attribute__ ((tls_model ("initial-exec")));
+
+// how often the thread holds the state mutex, and since when; for the hold time in the stats
+static __thread int state_mutex_depth __attribute__ ((tls_model ("initial-exec")));
+static __thread uint64_t state_mutex_since __attribute__ ((tls_model ("initial-exec")));
+
+/**
+ * Bump a per-thread statistics counter: a plain load and store, without a locked instruction.
+ * Only the thread itself writes its counters, so that's exact.
+ */
+#define STAT_ADD(counter, n) __atomic_store_n(&(counter), __atomic_load_n(&(counter), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+/**
+ * Bump a counter of a semaphore or condition. Whoever uses the primitive bumps them, so this takes an atomic
+ * increment; it shares the cache line with the counts that the same call changes anyway.
+ */
+#define SHARED_STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
 
 static struct {
     bool initialized;
 
-    // locks access to state
+    /**
+     * Locks the registries: sem_info, cond_info and the thread list.
+     * Recursive, because registering a condition registers its semaphores.
+     * Lookups in the tables don't need it (see PtrMap), and semaphore and thread bookkeeping
+     * itself is done with atomics, so the common paths of sem_post and sem_wait never take it.
+     */
     pthread_mutex_t mutex;
-    // since the mutex is recursive, we count the number of locks here
-    // (this is used for restoring signal state on the last unlock)
-    int mutex_locks;
-
-    /*
-     * To avoid a deadlock if a libidle function is interrupted by a signal while
-     * holding the lock, we block all signals while the mutex is locked.
-     * The original_mask field is used to restore the previous set of signals
-     * after the lock has been released.
-     * (Prompted by issues with parallel garbage collection in D 2.090. D uses signals
-     * to freeze all but one thread. The frozen threads may be in libidle operations.)
+
+    /**
+     * Serializes idle/busy transitions, ie. changes to filedes, shm, subscribers, locked and times_idle.
+     * Only taken when active_threads crosses zero.
      */
-    sigset_t original_mask;
+    pthread_mutex_t idle_mutex;
 
     int filedes;
-    // file locked
+    // if set (LIBIDLE_SHM), idle state is published here instead of in the statefile
+    LibidleShm *shm;
+    // connections to LIBIDLE_SOCKET that receive a LibidleEvent on every transition
+    int *subscribers_ptr;
+    size_t subscribers_len, subscribers_cap;
+    // file locked (or busy published to shm)
     bool locked;
     int times_idle;
+    /**
+     * LIBIDLE_DOMAIN: the domain page, or NULL. domain_slot is our member slot, or NULL once we've left.
+     * Both under idle_mutex. domain_busy_periods is the root's last look at DomainPage.busy_periods.
+     */
+    DomainPage *domain;
+    DomainMember *domain_slot;
+    bool domain_root;
+    uint32_t domain_busy_periods;
     bool verbose;
+    // LIBIDLE_COND_SIGNAL_ONE: pthread_cond_signal wakes one thread instead of all of them
+    bool cond_signal_one;
+    // LIBIDLE_SLEEP_IDLE: sleeping threads count as idle
+    bool sleep_idle;
+    // LIBIDLE_STATEFILE_DEADLINE: write the next deadline into the statefile, after the serial
+    bool statefile_deadline;
+    // LIBIDLE_FUTEX: track futex waits and wakes made with syscall
+    bool track_futex;
+    // LIBIDLE_IGNORE_THREADS: fnmatch patterns for the names of threads that never count as active
+    char **ignore_threads_ptr;
+    size_t ignore_threads_len, ignore_threads_cap;
+
+    // earliest deadline as of the last transition to idle, 0 while busy. under idle_mutex.
+    uint64_t deadline;
+
+    // LIBIDLE_IDLE_SETTLE_US in ns: how long we must stay idle before we publish it, or 0
+    uint64_t idle_settle_ns;
+    /**
+     * Under idle_mutex. While settle_due is set, we're idle but still locked, and the settle timer
+     * will unlock at that time (kernel CLOCK_MONOTONIC ns) unless we go busy before.
+     * settle_seq is the futex word that the timer waits on while settle_timer_parked, ie. without a timeout.
+     */
+    uint64_t settle_due;
+    uint32_t settle_seq;
+    bool settle_timer_parked;
 
-    size_t sem_info_len;
-    SemaphoreInfo *sem_info_ptr;
+    /**
+     * Under idle_mutex: the busy periods for the stats. busy_since is when we last went busy
+     * (kernel CLOCK_MONOTONIC ns); busy_periods is a ring indexed by serial; last_idle is
+     * the thread that made us idle, as recorded when we found we were (or started settling).
+     */
+    uint64_t busy_since;
+    uint64_t busy_histogram[LIBIDLE_BUSY_BUCKETS];
+    LibidleBusyPeriod busy_periods[LIBIDLE_BUSY_PERIODS];
+    LibidleBusyPeriod last_idle;
+
+    // LIBIDLE_TRACE: file that trace rings are flushed to, or -1
+    int trace_fd;
+    // every trace ring ever allocated, newest first
+    _Atomic(TraceRing *) trace_rings;
+    // serializes libidle_trace_flush
+    pthread_mutex_t trace_mutex;
+    // for ThreadInfo.trace_id
+    uint32_t threads_registered;
+    // LIBIDLE_STATS: file that a snapshot of the stats is written to at exit
+    char *stats_path;
+    // LIBIDLE_STATS is set, even if another process of our domain writes the file: time the state mutex
+    bool time_state_mutex;
+
+    // LIBIDLE_SAMPLE: file that the samples are written to at exit, or -1
+    int sample_fd;
+    // LIBIDLE_SAMPLE_MS in ns
+    uint64_t sample_interval_ns;
+    // SAMPLE_RING samples; samples_taken % SAMPLE_RING is the next one to be written
+    Sample *samples;
+    _Atomic uint64_t samples_taken;
+    _Atomic bool sampling_stopped;
+
+    // number of threads that are not idle; we're idle when this reaches 0.
+    _Atomic int active_threads;
+
+    // SemaphoreInfo records by sem_t address
+    PtrMap sem_info;
+
+    // ConditionInfo records by pthread_cond_t address
+    PtrMap cond_info;
+
+    // FdInfo records by FD_KEY(fd)
+    PtrMap fd_info;
+    // odd while an fd is being removed, see libidle_find_fd_info
+    _Atomic unsigned fd_info_removals;
+    /**
+     * enum FdKind of every fd below FD_KINDS, found out by fstat on the first read and forgotten on close,
+     * so that reads on files never pay for the check of libidle_read_would_block.
+     */
+    _Atomic uint8_t fd_kinds[FD_KINDS];
 
-    size_t cond_info_len;
-    ConditionInfo *cond_info_ptr;
+    // FutexInfo records by futex word address
+    PtrMap futex_info;
 
-    size_t thr_info_len;
-    ThreadInfo *thr_info_ptr;
-} state = { 0 };
+    ThreadInfo *thr_info_first, *thr_info_last;
+    // exited threads that haven't been joined yet
+    ThreadInfo *zombies_first;
+    /**
+     * Under the state mutex: the stats of all exited threads, summed up, and the mutex counters
+     * of threads that have no record (our internal threads, and threads on their way out).
+     */
+    LibidleThreadStats stats_exited;
+
+    // record storage
+    Slab sem_info_slab, cond_info_slab, cond_frame_slab, thr_info_slab, channel_slab, fd_info_slab, futex_info_slab;
+} state = {
+    .trace_fd = -1,
+    .sample_fd = -1,
+    .trace_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .sem_info_slab = SLAB_INIT(SemaphoreInfo, next_free),
+    .cond_info_slab = SLAB_INIT(ConditionInfo, next_free),
+    .cond_frame_slab = SLAB_INIT(ConditionFrame, next),
+    .thr_info_slab = SLAB_INIT(ThreadInfo, next),
+    .channel_slab = SLAB_INIT(ChannelInfo, next_free),
+    .fd_info_slab = SLAB_INIT(FdInfo, next_free),
+    .futex_info_slab = SLAB_INIT(FutexInfo, next_free),
+};
 
 static ThreadInfo *find_thread_info();
-static void vmaybe_lock(const char *fmt, va_list ap);
-static void vmaybe_unlock(const char *fmt, va_list ap);
-static void maybe_lock(const char *fmt, ...) {
+static void vlog_block_change(const char *change, const char *fmt, va_list ap);
+static void log_block_change(const char *change, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
-    vmaybe_lock(fmt, args);
+    vlog_block_change(change, fmt, args);
     va_end(args);
 }
-static void maybe_unlock(const char *fmt, ...) {
-  va_list args;
-  va_start(args, fmt);
-  vmaybe_unlock(fmt, args);
-  va_end(args);
-}
 static void print_block_map();
 static int num_active_threads();
+static void libidle_lock_mutex(pthread_mutex_t *mutex);
+static void libidle_unlock_mutex(pthread_mutex_t *mutex);
+static void libidle_lock_state_mutex();
+static void libidle_unlock_state_mutex();
+static void libidle_trace(ThreadInfo *thr_info, enum LibidleTraceOp op,
+    enum LibidleTraceTransition transition, uint64_t object);
+static char threadinfo_block_letter(ThreadInfo *thr_info);
+static void libidle_dump_stats();
+static void libidle_domain_add(int delta);
+
+static SemaphoreCounts sem_counts_unpack(uint64_t word)
+{
+    return (SemaphoreCounts) {
+        .pending_wakeups = (int32_t) (uint32_t) word,
+        .blocked_waiters = (int32_t) (uint32_t) (word >> 32),
+    };
+}
 
-static SemaphoreInfo *libidle_find_sem_info(sem_t *sem)
+static uint64_t sem_counts_pack(SemaphoreCounts counts)
 {
-    for (int i = 0; i < state.sem_info_len; i++)
-    {
-        if (state.sem_info_ptr[i].sem == sem)
-        {
-            return &state.sem_info_ptr[i];
-        }
-    }
-    return NULL;
+    return (uint64_t) (uint32_t) counts.pending_wakeups | ((uint64_t) (uint32_t) counts.blocked_waiters << 32);
 }
 
-static ConditionInfo *libidle_find_cond_info(pthread_cond_t *cond)
+static _Atomic uint64_t *sem_info_counts_word(SemaphoreInfo *sem_info)
 {
-    for (int i = 0; i < state.cond_info_len; i++)
-    {
-        if (state.cond_info_ptr[i].cond == cond)
-        {
-            return &state.cond_info_ptr[i];
-        }
-    }
-    return NULL;
+    return sem_info->shared ? &sem_info->shared->counts : &sem_info->counts;
 }
 
-static ThreadInfo *libidle_find_thr_info(pthread_t id)
+static SemaphoreCounts sem_info_counts(SemaphoreInfo *sem_info)
 {
-    for (int i = 0; i < state.thr_info_len; i++)
-    {
-        if (state.thr_info_ptr[i].id == id)
-        {
-            return &state.thr_info_ptr[i];
-        }
-    }
-    return NULL;
+    return sem_counts_unpack(atomic_load(sem_info_counts_word(sem_info)));
+}
+
+// how many threads are active because of this semaphore
+static int sem_counts_active(SemaphoreCounts counts)
+{
+    return counts.pending_wakeups > 0 ? counts.blocked_waiters : 0;
 }
 
 /**
- * Has this thread gone to sleep in a way that will prevent it from waking up on its own?
+ * Atomically change the pending wakeups and blocked waiters of a semaphore.
+ * Returns the resulting change in the number of active threads.
+ * The waiters of a shared semaphore may be in any member, so their change goes to the domain instead.
  */
-static bool threadinfo_is_blocked(ThreadInfo *thr_info)
+static int sem_info_update_counts(SemaphoreInfo *sem_info, int pending_delta, int waiters_delta)
 {
-    if (thr_info->forced_state_len > 0 && thr_info->forced_state_ptr[0] == BUSY)
-    {
-        return false;
-    }
-    if (thr_info->forced_state_len > 0 && thr_info->forced_state_ptr[0] == IDLE)
-    {
-        return true;
-    }
-    if (!thr_info->sleeping)
-    {
-        return false;
-    }
-    if (!thr_info->waiting_semaphore)
+    _Atomic uint64_t *word = sem_info_counts_word(sem_info);
+    uint64_t old_word = atomic_load(word);
+    SemaphoreCounts old_counts, new_counts;
+    do
     {
-        return true;
+        old_counts = new_counts = sem_counts_unpack(old_word);
+        new_counts.pending_wakeups += pending_delta;
+        new_counts.blocked_waiters += waiters_delta;
     }
-    SemaphoreInfo *sem_info = libidle_find_sem_info(thr_info->waiting_semaphore);
-    return sem_info && sem_info->pending_wakeups > 0 ? false : true;
+    while (!atomic_compare_exchange_weak(word, &old_word, sem_counts_pack(new_counts)));
+
+    int delta = sem_counts_active(new_counts) - sem_counts_active(old_counts);
+    if (!sem_info->shared) return delta;
+    libidle_domain_add(delta);
+    return 0;
 }
 
-// called when we've gone busy
-static void libidle_lock()
+static SemaphoreInfo *libidle_find_sem_info(sem_t *sem)
 {
-    assert(!state.locked);
-    // printf("lock %i\n", state.filedes);
-    flock(state.filedes, LOCK_EX);
-    state.locked = true;
+    SemaphoreInfo *sem_info = ptrmap_find(&state.sem_info, sem);
+    if (sem_info) return sem_info;
+
+    // we may have raced with a removal; a miss is only certain with the lock held.
+    libidle_lock_state_mutex();
+    sem_info = ptrmap_find(&state.sem_info, sem);
+    libidle_unlock_state_mutex();
+    return sem_info;
 }
 
-// called when we've gone idle
-static void libidle_unlock()
+// shared: the domain's counts for a pshared semaphore, which already hold its pending wakeups; or NULL
+static void libidle_register_sem(sem_t *sem, bool named_semaphore, int pending_wakeups, DomainSemaphore *shared)
 {
-    assert(state.locked);
-    // printf("unlock %i\n", state.filedes);
-    lseek(state.filedes, 0, SEEK_SET);
-    ftruncate(state.filedes, 0);
-    dprintf(state.filedes, "%i\n", ++state.times_idle);
-    flock(state.filedes, LOCK_UN);
-    state.locked = false;
+    SemaphoreInfo *sem_info = slab_alloc(&state.sem_info_slab);
+
+    // ptrmap_insert sets the key.
+    sem_info->named_semaphore = named_semaphore;
+    sem_info->shared = shared;
+    atomic_store(&sem_info->counts, sem_counts_pack((SemaphoreCounts) { .pending_wakeups = pending_wakeups }));
+    ptrmap_insert(&state.sem_info, sem_info, sem);
 }
 
-static void libidle_lock_state_mutex()
+// take a frame from the pool, or make a new one
+static ConditionFrame *libidle_get_cond_frame()
 {
-    // block all signals while locked. prevents deadlocks if signal interrupts in in mid-operation.
-    // state.mutex_locks is used to only store/reset the sigmask on the outermost lock/unlock
-    // we call pthread_sigmask even if we're already locked (because we can't access state.mutex_locks
-    // without the lock), but those calls have no issue since they don't corrupt the original_mask.
-    sigset_t all_signals, original_mask;
-    sigfillset(&all_signals);
-    pthread_sigmask(SIG_SETMASK, &all_signals, &original_mask);
-    pthread_mutex_lock(&state.mutex);
-    state.mutex_locks ++;
+    libidle_lock_state_mutex();
+    ConditionFrame *frame = slab_alloc(&state.cond_frame_slab);
+    libidle_unlock_state_mutex();
 
-    if (state.mutex_locks == 1)
-    {
-        // outermost lock
-        state.original_mask = original_mask;
-    }
+    frame->signaled = false;
+    frame->sleeping_threads = 0;
+    frame->tokens = 0;
+    frame->next = NULL;
+    return frame;
 }
 
-static void libidle_unlock_state_mutex()
+/**
+ * Return a frame to the pool.
+ * Every token posted on it must have been consumed, so that IN and its pending wakeups are back at 0.
+ */
+static void libidle_put_cond_frame(ConditionFrame *frame)
 {
-    bool was_outermost_lock = (state.mutex_locks == 1) ? true : false;
-    sigset_t original_mask = state.original_mask;
-    state.mutex_locks --;
-    pthread_mutex_unlock(&state.mutex);
-    if (was_outermost_lock)
+    libidle_lock_state_mutex();
+    slab_free(&state.cond_frame_slab, frame);
+    libidle_unlock_state_mutex();
+}
+
+// called by every woken thread once it's done with the frame of a broadcast
+static void libidle_release_cond_frame(ConditionFrame *frame)
+{
+    if (atomic_fetch_sub(&frame->refs, 1) == 1)
     {
-        pthread_sigmask(SIG_SETMASK, &original_mask, NULL);
+        libidle_put_cond_frame(frame);
     }
 }
 
-static void libidle_register_thread(pthread_t thread)
+/**
+ * A thread leaves a frame that hasn't been signaled, either by timing out or
+ * by consuming a token from pthread_cond_signal. Requires the condition mutex.
+ */
+static void libidle_sleeper_left_cond_frame(ConditionInfo *cond_info, ConditionFrame *frame)
 {
-    libidle_lock_state_mutex();
-    PUSH(state.thr_info) = (ThreadInfo) {
-        .id = thread,
-        .sleeping = false,
-        .forced_state_ptr = NULL,
-        .forced_state_len = 0,
-        .waiting_semaphore = NULL,
-        .in_call = false,
-    };
-    libidle_unlock_state_mutex();
+    frame->sleeping_threads--;
+    atomic_fetch_sub(&cond_info->sleeping_threads, 1);
+
+    if (frame != cond_info->frame && frame->sleeping_threads == 0)
+    {
+        // closed and abandoned: nobody can get at it anymore
+        ConditionFrame **link = &cond_info->oldest_frame;
+        while (*link != frame) link = &(*link)->next;
+        *link = frame->next;
+        libidle_put_cond_frame(frame);
+    }
 }
 
-static void libidle_unregister_thread(pthread_t thread)
+/**
+ * Called by a thread that consumed its token from the frame.
+ * Without LIBIDLE_COND_SIGNAL_ONE, only broadcasts post tokens, so the frame must have been signaled.
+ * Otherwise, the token may have come from pthread_cond_signal on a frame that's still in the list.
+ */
+static void libidle_leave_cond_frame(ConditionInfo *cond_info, ConditionFrame *frame)
 {
-    libidle_lock_state_mutex();
-    for (int i = 0; i < state.thr_info_len; i++)
+    // once set, signaled stays set until the last reference is gone, and we hold one then
+    if (state.cond_signal_one && !__atomic_load_n(&frame->signaled, __ATOMIC_ACQUIRE))
     {
-        ThreadInfo *thr_info = &state.thr_info_ptr[i];
-        if (thr_info->id == thread)
+        libidle_lock_mutex(&cond_info->mutex);
+        bool signaled = frame->signaled;
+        if (!signaled)
         {
-            // swap with last entry and shrink
-            *thr_info = state.thr_info_ptr[state.thr_info_len - 1];
-            DROP(state.thr_info);
-            break;
+            frame->tokens--;
+            libidle_sleeper_left_cond_frame(cond_info, frame);
         }
+        libidle_unlock_mutex(&cond_info->mutex);
+
+        if (!signaled) return;
     }
-    libidle_unlock_state_mutex();
+    libidle_release_cond_frame(frame);
 }
 
-__attribute__ ((constructor))
-void libidle_init()
+static ConditionInfo *libidle_register_cond(pthread_cond_t *cond, clockid_t clock)
 {
-    if (state.initialized) return;
-
-    next_accept = dlsym(RTLD_NEXT, "accept");
-    next_pthread_cond_destroy = dlvsym(RTLD_NEXT, "pthread_cond_destroy", "GLIBC_2.3.2");
-    next_pthread_cond_init = dlvsym(RTLD_NEXT, "pthread_cond_init", "GLIBC_2.3.2");
-    next_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
-    next_pthread_join = dlsym(RTLD_NEXT, "pthread_join");
-    next_sem_destroy = dlvsym(RTLD_NEXT, "sem_destroy", "GLIBC_2.2.5");
-    next_sem_init = dlvsym(RTLD_NEXT, "sem_init", "GLIBC_2.2.5");
-    next_sem_open = dlsym(RTLD_NEXT, "sem_open");
-    next_sem_post = dlvsym(RTLD_NEXT, "sem_post", "GLIBC_2.2.5");
-    next_sem_timedwait = dlvsym(RTLD_NEXT, "sem_timedwait", "GLIBC_2.2.5");
-    next_sem_wait = dlvsym(RTLD_NEXT, "sem_wait", "GLIBC_2.2.5");
-    next_pthread_setname_np = dlvsym(RTLD_NEXT, "pthread_setname_np", "GLIBC_2.12");
+    ConditionInfo *info = slab_alloc(&state.cond_info_slab);
 
-    char *statefile = getenv("LIBIDLE_STATEFILE");
-    if (!statefile) statefile = ".libidle_state";
-
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&state.mutex, &attr);
-    pthread_mutexattr_destroy(&attr);
-    state.mutex_locks = 0;
+    // ptrmap_insert sets the key.
+    pthread_mutex_init(&info->mutex, NULL);
+    info->frame = info->oldest_frame = libidle_get_cond_frame();
+    atomic_store(&info->sleeping_threads, 0);
+    info->clock = clock;
 
-    state.filedes = open(statefile, O_RDWR | O_CREAT | O_TRUNC, 0600);
-    state.verbose = getenv("LIBIDLE_VERBOSE") ? true : false;
-    libidle_register_thread(pthread_self());
-    libidle_lock();
-    state.initialized = true;
+    ptrmap_insert(&state.cond_info, info, cond);
+    return info;
 }
 
-static void entering_blocked_op(const char *fmt, ...)
+static void libidle_unregister_cond(pthread_cond_t *cond)
 {
-    libidle_lock_state_mutex();
+    ConditionInfo *cond_info = ptrmap_remove(&state.cond_info, cond);
+    if (!cond_info) return;
 
-    ThreadInfo *thr_info = find_thread_info();
-    assert(!thr_info || thr_info->sleeping == false);
-    if (thr_info) thr_info->sleeping = true;
-    if (!thr_info || thr_info->forced_state_len == 0 || thr_info->forced_state_ptr[0] != BUSY) {
-        va_list args;
-        va_start(args, fmt);
-        vmaybe_unlock(fmt, args);
-        va_end(args);
-    }
+    // pthread_cond_destroy undefined if we're still waiting on this condition
+    assert(cond_info->sleeping_threads == 0);
 
-    libidle_unlock_state_mutex();
+    // with nobody sleeping, closed frames have all left the list
+    assert(cond_info->oldest_frame == cond_info->frame);
+    libidle_put_cond_frame(cond_info->frame);
+    pthread_mutex_destroy(&cond_info->mutex);
+    slab_free(&state.cond_info_slab, cond_info);
 }
 
-static void left_blocked_op(const char *fmt, ...)
+/**
+ * Conditions initialized with PTHREAD_COND_INITIALIZER never pass through pthread_cond_init.
+ * Such conditions are registered on first use, with the default clock.
+ */
+static ConditionInfo *libidle_find_cond_info(pthread_cond_t *cond)
 {
-    libidle_lock_state_mutex();
-
-    ThreadInfo *thr_info = find_thread_info();
-    assert(!thr_info || thr_info->sleeping == true);
-    if (thr_info) thr_info->sleeping = false;
-    if (!thr_info || thr_info->forced_state_len == 0 || thr_info->forced_state_ptr[0] != BUSY) {
-        va_list args;
-        va_start(args, fmt);
-        vmaybe_lock(fmt, args);
-        va_end(args);
-    }
-
-    libidle_unlock_state_mutex();
-}
+    ConditionInfo *cond_info = ptrmap_find(&state.cond_info, cond);
+    if (cond_info) return cond_info;
 
-// equivalent to entering a blocked op
-void libidle_enable_forced_idle()
-{
     libidle_lock_state_mutex();
-
-    ThreadInfo *thr_info = find_thread_info();
-    assert(thr_info);
-
-    PUSH(thr_info->forced_state) = IDLE;
-
-    maybe_unlock("libidle_enable_forced_idle()\n");
-
+    cond_info = ptrmap_find(&state.cond_info, cond);
+    if (!cond_info) cond_info = libidle_register_cond(cond, CLOCK_REALTIME);
     libidle_unlock_state_mutex();
+    return cond_info;
 }
 
-// equivalent to leaving a blocked op
-void libidle_disable_forced_idle()
+/**
+ * Determine how this thread should be accounted for, given its current state.
+ * Sets *sem_info_ptr for ACCOUNTED_SEMAPHORE.
+ */
+static enum ThreadAccounting threadinfo_target_accounting(ThreadInfo *thr_info, SemaphoreInfo **sem_info_ptr)
 {
-    libidle_lock_state_mutex();
-
-    ThreadInfo *thr_info = find_thread_info();
-    assert(thr_info);
-
-    assert(thr_info->forced_state_len > 0 && thr_info->forced_state_ptr[thr_info->forced_state_len - 1] == IDLE);
-    DROP(thr_info->forced_state);
-
-    maybe_lock("libidle_disable_forced_idle()\n");
-
-    libidle_unlock_state_mutex();
+    *sem_info_ptr = NULL;
+    if (__atomic_load_n(&thr_info->ignored, __ATOMIC_RELAXED))
+    {
+        return ACCOUNTED_IDLE;
+    }
+    if (thr_info->forced_state_len > 0 && thr_info->forced_state_ptr[0] == BUSY)
+    {
+        return ACCOUNTED_ACTIVE;
+    }
+    if (thr_info->forced_state_len > 0 && thr_info->forced_state_ptr[0] == IDLE)
+    {
+        return ACCOUNTED_IDLE;
+    }
+    if (!thr_info->sleeping)
+    {
+        return ACCOUNTED_ACTIVE;
+    }
+    if (thr_info->waiting_channels_len > 0)
+    {
+        return ACCOUNTED_CHANNELS;
+    }
+    if (!thr_info->waiting_semaphore)
+    {
+        return ACCOUNTED_IDLE;
+    }
+    *sem_info_ptr = thr_info->waiting_semaphore;
+    return ACCOUNTED_SEMAPHORE;
 }
 
-void libidle_enable_forced_busy()
-{
-    libidle_lock_state_mutex();
-
-    ThreadInfo *thr_info = find_thread_info();
-    assert(thr_info);
-
-    PUSH(thr_info->forced_state) = BUSY;
-
-    /*printf("enable forced busy\n");
-    void *buffer[16];
-    backtrace(buffer, 16);
-    backtrace_symbols_fd(buffer, 16, 1);*/
-
-    libidle_unlock_state_mutex();
-}
+static void libidle_sync_idle_state();
 
-void libidle_disable_forced_busy()
+/**
+ * Change the number of active threads.
+ * Whoever moves the count across zero is responsible for performing the idle transition.
+ */
+static void active_threads_add(int delta)
 {
-    libidle_lock_state_mutex();
-
-    ThreadInfo *thr_info = find_thread_info();
-    assert(thr_info);
+    if (delta == 0) return;
 
-    assert(thr_info->forced_state_len > 0 && thr_info->forced_state_ptr[thr_info->forced_state_len - 1] == BUSY);
-    DROP(thr_info->forced_state);
+    int old_active = atomic_fetch_add(&state.active_threads, delta);
 
-    libidle_unlock_state_mutex();
+    if ((old_active > 0) != (old_active + delta > 0))
+    {
+        libidle_sync_idle_state();
+    }
 }
 
-static void vmaybe_lock(const char *fmt, va_list ap)
+// add (waiters_delta = 1) or remove (-1) the thread as a blocked waiter of its channels
+static void accounting_update_channels(ThreadInfo *thr_info, int waiters_delta)
 {
-    /**
-     * It is not the case that leaving a blocking op necessarily acquires lock.
-     * For instance, the blocking op may be inside a forced_idle pair.
-     * In that case, the lock is acquired when we disable forced_idle, bringing
-     * the active thread count up.
-     */
-    if (state.verbose)
-    {
-        print_block_map();
-        printf(": %lx: -block: ", pthread_self());
-        vprintf(fmt, ap);
-    }
-    if (!state.locked && num_active_threads() > 0)
+    for (size_t i = 0; i < thr_info->waiting_channels_len; i++)
     {
-        if (state.verbose)
-        {
-            printf("  lock\n");
-        }
-        libidle_lock();
+        active_threads_add(sem_info_update_counts(&thr_info->waiting_channels_ptr[i]->sem_info, 0, waiters_delta));
     }
 }
 
-static void vmaybe_unlock(const char *fmt, va_list ap)
+static void accounting_add(ThreadInfo *thr_info, enum ThreadAccounting accounting, SemaphoreInfo *sem_info)
 {
-    if (state.verbose)
-    {
-        print_block_map();
-        printf(": %lx: +block: ", pthread_self());
-        vprintf(fmt, ap);
-    }
-    if (state.locked && num_active_threads() == 0)
+    switch (accounting)
     {
-        if (state.verbose)
-        {
-            printf("  unlock\n");
-        }
-        libidle_unlock();
+        case ACCOUNTED_ACTIVE:
+            active_threads_add(1);
+            break;
+        case ACCOUNTED_IDLE:
+            break;
+        case ACCOUNTED_SEMAPHORE:
+            active_threads_add(sem_info_update_counts(sem_info, 0, 1));
+            break;
+        case ACCOUNTED_CHANNELS:
+            accounting_update_channels(thr_info, 1);
+            break;
     }
 }
 
-static ThreadInfo *find_thread_info()
+static void accounting_remove(ThreadInfo *thr_info, enum ThreadAccounting accounting, SemaphoreInfo *sem_info)
 {
-    pthread_t self = pthread_self();
-    for (int i = 0; i < state.thr_info_len; i++)
+    switch (accounting)
     {
-        ThreadInfo *thr_info = &state.thr_info_ptr[i];
-
-        if (thr_info->id == self)
-        {
-            return thr_info;
-        }
+        case ACCOUNTED_ACTIVE:
+            active_threads_add(-1);
+            break;
+        case ACCOUNTED_IDLE:
+            break;
+        case ACCOUNTED_SEMAPHORE:
+            active_threads_add(sem_info_update_counts(sem_info, 0, -1));
+            break;
+        case ACCOUNTED_CHANNELS:
+            accounting_update_channels(thr_info, -1);
+            break;
     }
-    return NULL;
 }
 
-static void print_block_map()
+/**
+ * Must be called after every change to a thread's sleeping, forced_state or waiting_semaphore.
+ */
+static void threadinfo_update_accounting(ThreadInfo *thr_info)
 {
-    for (int i = 0; i < state.thr_info_len; i++)
+    bool ignored;
+    do
     {
-        ThreadInfo *thr_info = &state.thr_info_ptr[i];
-
+        ignored = __atomic_load_n(&thr_info->ignored, __ATOMIC_SEQ_CST);
         SemaphoreInfo *sem_info;
-        if (thr_info->waiting_semaphore)
-            sem_info = libidle_find_sem_info(thr_info->waiting_semaphore);
-        if (i) printf("|");
-        printf(
-            (thr_info->forced_state_len > 0 && thr_info->forced_state_ptr[0] == BUSY) ? "B" : // forced busy
-            (thr_info->forced_state_len > 0 && thr_info->forced_state_ptr[0] == IDLE) ? "i" : // forced idle
-            (!thr_info->sleeping) ? "-" : // computing
-            (!thr_info->waiting_semaphore) ? "b" : // blocking busy
-            !sem_info ? "?" : // sleeping on an unknown semaphore
-            (sem_info->pending_wakeups > 0) ? "S" : // sleeping on a signaled semaphore
-            "s"); // sleeping on a semaphore
-        // printf(threadinfo_is_blocked(thr_info) ? "x" : "-");
-    }
+        enum ThreadAccounting accounting = threadinfo_target_accounting(thr_info, &sem_info);
+        enum ThreadAccounting old_accounting = atomic_load(&thr_info->accounting);
+
+        if (accounting == old_accounting && sem_info == thr_info->accounted_sem) return;
+
+        // add the new contribution before removing the old one, so that we never pass through zero
+        // on the way. (Other threads can still see the count go to zero if they're idle themselves.)
+        accounting_add(thr_info, accounting, sem_info);
+        // libidle_apply_ignored may move us in the meantime; then we remove what it left
+        while (!atomic_compare_exchange_weak(&thr_info->accounting, &old_accounting, accounting)) { }
+        accounting_remove(thr_info, old_accounting, thr_info->accounted_sem);
+        thr_info->accounted_sem = sem_info;
+        // if our name changed while we were at it, we just counted ourselves by the old one
+    } while (__atomic_load_n(&thr_info->ignored, __ATOMIC_SEQ_CST) != ignored);
 }
 
-static int num_active_threads()
+/**
+ * Set whether a thread is ignored. If it's getting ignored while it runs, we take it off the active count
+ * right away, since a thread that spins without making calls would never get around to it itself.
+ * Anything else is applied by the thread's own next threadinfo_update_accounting;
+ * we can't tell from here whether a thread that is counted as idle would be running.
+ * Called with the state mutex locked.
+ */
+static void libidle_apply_ignored(ThreadInfo *thr_info, bool ignored)
 {
-    int active_threads = 0;
-    for (int i = 0; i < state.thr_info_len; i++)
+    // stored before the CAS, so that if the thread's own CAS comes up against ours, it sees the new name after
+    __atomic_store_n(&thr_info->ignored, ignored, __ATOMIC_SEQ_CST);
+    enum ThreadAccounting active = ACCOUNTED_ACTIVE;
+    if (ignored && atomic_compare_exchange_strong(&thr_info->accounting, &active, ACCOUNTED_IDLE))
     {
-        ThreadInfo *thr_info = &state.thr_info_ptr[i];
-        active_threads += threadinfo_is_blocked(thr_info) ? 0 : 1;
+        active_threads_add(-1);
     }
-    return active_threads;
-}
-
-//
-// function proxies
-//
-int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
-{
-    NON_NULL(next_accept);
-    entering_blocked_op("accept()\n");
-    int ret = next_accept(sockfd, addr, addrlen);
-    left_blocked_op("accept()\n");
-    return ret;
 }
 
 /**
- * pthread_create
+ * Change the number of pending wakeups on a semaphore.
+ * When it crosses zero, all its blocked waiters change between idle and active.
  */
-
-void remove_thread_info()
+static void sem_info_add_pending(SemaphoreInfo *sem_info, int delta)
 {
-    libidle_unregister_thread(pthread_self());
+    active_threads_add(sem_info_update_counts(sem_info, delta, 0));
 }
 
-struct ActualThreadInfo
+static uint64_t timespec_ns(struct timespec ts)
 {
-    void *(*start_routine)(void*);
-    void *arg;
-    sem_t *started;
-};
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-void *thread_wrapper(void *arg)
+static uint64_t monotonic_ns()
 {
-    NON_NULL(next_sem_post);
-    libidle_register_thread(pthread_self());
-
-    // now that we're registered, pthread_create can return
-
-    struct ActualThreadInfo actual_thread_info = *(struct ActualThreadInfo*) arg;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_ns(now);
+}
 
-    next_sem_post(actual_thread_info.started);
+// the real time, with the syscall, since faketime doesn't get to fake it
+static uint64_t kernel_monotonic_ns()
+{
+    struct timespec now;
+    // not our own syscall, which would look at every call
+    next_syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &now);
+    return timespec_ns(now);
+}
 
-    void *ret; // pthread_cleanup_push and _pop are actually macros with unbalanced braces
+/**
+ * Convert an absolute timeout on clock to CLOCK_MONOTONIC ns, for the deadline.
+ * Both clocks are read through clock_gettime, so under faketime, this is in fake time too.
+ */
+static uint64_t libidle_deadline(const struct timespec *abs_timeout, clockid_t clock)
+{
+    if (clock == CLOCK_MONOTONIC) return timespec_ns(*abs_timeout);
 
-    pthread_cleanup_push(&remove_thread_info, NULL);
-    ret = actual_thread_info.start_routine(actual_thread_info.arg);
-    pthread_cleanup_pop(true);
-    return ret;
+    struct timespec now;
+    clock_gettime(clock, &now);
+    int64_t remaining = (int64_t) timespec_ns(*abs_timeout) - (int64_t) timespec_ns(now);
+    return monotonic_ns() + (remaining > 0 ? remaining : 0);
 }
 
-int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
-        void *(*start_routine) (void *), void *arg)
+/**
+ * Record that the thread will wake up by itself at deadline (if not 0).
+ * Called before the thread can go idle: whoever makes the transition to idle saw our change of
+ * active_threads after this, so the release is enough for it to see the deadline too.
+ */
+static void libidle_add_deadline(ThreadInfo *thr_info, uint64_t deadline)
 {
-    NON_NULL(next_pthread_create);
-    NON_NULL(next_sem_init);
-    NON_NULL(next_sem_wait);
-    NON_NULL(next_sem_destroy);
-
-    struct ActualThreadInfo *actual_thread_info = malloc(sizeof(struct ActualThreadInfo));
+    assert(atomic_load_explicit(&thr_info->deadline, memory_order_relaxed) == 0);
+    atomic_store_explicit(&thr_info->deadline, deadline, memory_order_release);
+}
 
-    *actual_thread_info = (struct ActualThreadInfo) {
-        .start_routine = start_routine,
-        .arg = arg,
-        .started = malloc(sizeof(sem_t)),
-    };
-    next_sem_init(actual_thread_info->started, 0, 0);
+static void libidle_remove_deadline(ThreadInfo *thr_info)
+{
+    atomic_store_explicit(&thr_info->deadline, 0, memory_order_relaxed);
+}
 
-    // Despite blocking on a semaphore, we are busy: the other end of the semaphore is dangling
-    // until next_pthread_create completes.
-    libidle_enable_forced_busy();
-    int ret = next_pthread_create(thread, attr, thread_wrapper, actual_thread_info);
-    if (ret == 0)
+/**
+ * The earliest deadline of any thread, or 0. Call with idle_mutex locked, which keeps the thread list
+ * from changing. Only the earliest deadline matters, and only on the transition to idle, so we scan then.
+ */
+static uint64_t libidle_next_deadline()
+{
+    uint64_t next = 0;
+    for (ThreadInfo *thr_info = state.thr_info_first; thr_info; thr_info = thr_info->next)
     {
-        // wait for the child thread to be started and registered so we don't prematurely unlock during startup
-        next_sem_wait(actual_thread_info->started);
-        next_sem_destroy(actual_thread_info->started);
-        free(actual_thread_info->started);
-        // child thread will have copied it
-        free(actual_thread_info);
+        uint64_t deadline = atomic_load_explicit(&thr_info->deadline, memory_order_acquire);
+        if (deadline && (next == 0 || deadline < next)) next = deadline;
     }
-    libidle_disable_forced_busy();
-    return ret;
+    return next;
 }
 
-int pthread_join(pthread_t thread, void **retval)
+static long futex(uint32_t *uaddr, int futex_op, uint32_t val, const struct timespec *timeout)
 {
-    ThreadInfo *thr_info = libidle_find_thr_info(pthread_self());
+    return next_syscall(SYS_futex, uaddr, futex_op, val, timeout, NULL, 0);
+}
 
-    NON_NULL(next_pthread_join);
-    if (thr_info->in_call)
+static void libidle_shm_publish(bool idle)
+{
+    __atomic_store_n(&state.shm->deadline, state.deadline, __ATOMIC_RELAXED);
+    // seq_cst pairs with the waiter incrementing waiters, then checking state:
+    // either we see its increment, or it sees our new state.
+    __atomic_store_n(&state.shm->state, ((uint32_t) state.times_idle << 1) | (idle ? 1 : 0), __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&state.shm->waiters, __ATOMIC_SEQ_CST) > 0)
     {
-        /**
-         * As with libidle_sem_wait, we just forward the call and don't worry about it.
-         */
-        return next_pthread_join(thread, retval);
+        futex(&state.shm->state, FUTEX_WAKE, INT_MAX, NULL);
     }
-    entering_blocked_op("pthread_join()\n");
-    thr_info->in_call = true;
-    // TODO wakeup signalling on thread destruction
-    int ret = next_pthread_join(thread, retval);
-    thr_info->in_call = false;
-    left_blocked_op("pthread_join()\n");
-    return ret;
 }
 
-int pthread_setname_np(pthread_t thread, const char *name)
+/**
+ * Send the current state to a subscriber.
+ * Returns false if the subscriber is gone or can't keep up.
+ */
+static bool libidle_send_event(int fd, bool idle)
 {
-    NON_NULL(next_pthread_setname_np);
-    int ret = next_pthread_setname_np(thread, name);
-    if (state.verbose)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    LibidleEvent event = {
+        .serial = state.times_idle,
+        .idle = idle,
+        .timestamp = timespec_ns(now),
+        .deadline = state.deadline,
+    };
+    // never block a transition on a subscriber
+    return next_send(fd, &event, sizeof(event), MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(event);
+}
+
+static void libidle_notify_subscribers(bool idle)
+{
+    for (size_t i = 0; i < state.subscribers_len; )
     {
-      libidle_lock_state_mutex();
-      for (int i = 0; i < state.thr_info_len; i++)
-      {
-          ThreadInfo *thr_info = &state.thr_info_ptr[i];
-          if (thr_info->id == thread)
-          {
-              for (int k = 0; k < i; k++) printf("  ");
-              printf("/ %s\n", name);
-              thr_info->name = name;
-              break;
-          }
-      }
-      print_block_map();
-      printf("\n");
-      libidle_unlock_state_mutex();
+        if (libidle_send_event(state.subscribers_ptr[i], idle))
+        {
+            i++;
+            continue;
+        }
+        // disconnecting tells the subscriber that it has missed events
+        next_close(state.subscribers_ptr[i]);
+        state.subscribers_ptr[i] = state.subscribers_ptr[state.subscribers_len - 1];
+        DROP(state.subscribers);
     }
-    return ret;
 }
 
-sem_t *sem_open(const char *name, int oflag, ...)
+// the thread that's making us go idle. call with idle_mutex locked.
+static void libidle_record_last_idle(ThreadInfo *thr_info)
 {
-    // we may be called very early by libfaketime
-    libidle_init();
+    state.last_idle = (LibidleBusyPeriod) { .last_trace_id = thr_info ? thr_info->trace_id : UINT32_MAX };
+    // pthread_setname_np may be writing it; that only garbles the name
+    if (thr_info) memcpy(state.last_idle.last_name, thr_info->name, LIBIDLE_THREAD_NAME_LEN - 1);
+}
 
-    NON_NULL(next_sem_open);
+// on going idle: the busy period that just ended. call with idle_mutex locked.
+static void libidle_record_busy_period()
+{
+    uint64_t busy_ns = kernel_monotonic_ns() - state.busy_since;
+    state.busy_histogram[63 - __builtin_clzll(busy_ns | 1)]++;
 
-    sem_t *ret;
-    if (oflag & O_CREAT)
+    LibidleBusyPeriod *period = &state.busy_periods[state.times_idle % LIBIDLE_BUSY_PERIODS];
+    *period = state.last_idle;
+    period->serial = state.times_idle;
+    period->busy_ns = busy_ns;
+}
+
+// called when we've gone busy
+static void libidle_lock()
+{
+    assert(!state.locked);
+    state.deadline = 0;
+    state.busy_since = kernel_monotonic_ns();
+    libidle_notify_subscribers(false);
+    if (state.shm)
     {
-        va_list args;
-        va_start(args, oflag);
-        mode_t mode = va_arg(args, mode_t);
-        unsigned int value = va_arg(args, unsigned int);
-        va_end(args);
-        ret = next_sem_open(name, oflag, mode, value);
+        libidle_shm_publish(false);
     }
     else
     {
-        ret = next_sem_open(name, oflag);
+        // printf("lock %i\n", state.filedes);
+        flock(state.filedes, LOCK_EX);
     }
-    if (ret == SEM_FAILED) return ret;
-
+    state.locked = true;
+}
+
+// called when we've gone idle
+static void libidle_unlock()
+{
+    assert(state.locked);
+    ++state.times_idle;
+    state.deadline = libidle_next_deadline();
+    libidle_record_busy_period();
+    libidle_notify_subscribers(true);
+    if (state.shm)
+    {
+        libidle_shm_publish(true);
+    }
+    else
+    {
+        // printf("unlock %i\n", state.filedes);
+        lseek(state.filedes, 0, SEEK_SET);
+        ftruncate(state.filedes, 0);
+        dprintf(state.filedes, "%i\n", state.times_idle);
+        if (state.statefile_deadline && state.deadline) dprintf(state.filedes, "%lu\n", (unsigned long) state.deadline);
+        flock(state.filedes, LOCK_UN);
+    }
+    state.locked = false;
+}
+
+/**
+ * Create the shared memory page for LIBIDLE_SHM.
+ * Returns NULL on failure, in which case we fall back to the statefile.
+ */
+static LibidleShm *libidle_open_shm(const char *name)
+{
+    char path[NAME_MAX + 1];
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+
+    int fd = shm_open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1)
+    {
+        fprintf(stderr, "libidle: cannot open shared memory %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    // truncate first, so that a page left over by a previous run starts from scratch
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, sizeof(LibidleShm)) == -1)
+    {
+        fprintf(stderr, "libidle: cannot size shared memory %s: %s\n", path, strerror(errno));
+        next_close(fd);
+        return NULL;
+    }
+    LibidleShm *shm = mmap(NULL, sizeof(LibidleShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    next_close(fd);
+    if (shm == MAP_FAILED)
+    {
+        fprintf(stderr, "libidle: cannot map shared memory %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    // state starts out as 0: serial 0, busy. that's what we are until the main thread registers.
+    __atomic_store_n(&shm->version, LIBIDLE_SHM_VERSION, __ATOMIC_RELAXED);
+    __atomic_store_n(&shm->magic, LIBIDLE_SHM_MAGIC, __ATOMIC_RELEASE);
+    return shm;
+}
+
+static void libidle_block_signals()
+{
+    // block all signals while locked. prevents deadlocks if signal interrupts in in mid-operation.
+    // signals_blocked is used to only store/reset the sigmask on the outermost lock/unlock.
+    if (signals_blocked++ == 0)
+    {
+        sigset_t all_signals;
+        sigfillset(&all_signals);
+        pthread_sigmask(SIG_SETMASK, &all_signals, &original_mask);
+    }
+}
+
+static void libidle_unblock_signals()
+{
+    if (--signals_blocked == 0)
+    {
+        pthread_sigmask(SIG_SETMASK, &original_mask, NULL);
+    }
+}
+
+static void libidle_lock_mutex(pthread_mutex_t *mutex)
+{
+    libidle_block_signals();
+    pthread_mutex_lock(mutex);
+}
+
+static void libidle_unlock_mutex(pthread_mutex_t *mutex)
+{
+    pthread_mutex_unlock(mutex);
+    libidle_unblock_signals();
+}
+
+// where the mutex counters of the calling thread go. call with the state mutex locked.
+static LibidleThreadStats *libidle_mutex_stats()
+{
+    return current_thread ? &current_thread->stats : &state.stats_exited;
+}
+
+/**
+ * The mutex counters cost a trylock and two clock reads per acquisition,
+ * so they're only kept with LIBIDLE_STATS. state_mutex_since is 0 while we don't time the current hold.
+ */
+static void libidle_lock_state_mutex()
+{
+    libidle_block_signals();
+    if (!state.time_state_mutex)
+    {
+        pthread_mutex_lock(&state.mutex);
+        state_mutex_depth++;
+        return;
+    }
+    // a recursive lock never blocks, so this only counts waiting for other threads
+    bool contended = pthread_mutex_trylock(&state.mutex) != 0;
+    if (contended) pthread_mutex_lock(&state.mutex);
+    if (state_mutex_depth++ == 0)
+    {
+        LibidleThreadStats *stats = libidle_mutex_stats();
+        STAT_ADD(stats->mutex_acquisitions, 1);
+        if (contended) STAT_ADD(stats->mutex_contended, 1);
+        state_mutex_since = monotonic_ns();
+    }
+}
+
+static void libidle_unlock_state_mutex()
+{
+    if (--state_mutex_depth == 0 && state_mutex_since)
+    {
+        STAT_ADD(libidle_mutex_stats()->mutex_hold_ns, monotonic_ns() - state_mutex_since);
+        state_mutex_since = 0;
+    }
+    libidle_unlock_mutex(&state.mutex);
+}
+
+/**
+ * Bring the statefile lock in line with the number of active threads.
+ * Called whenever active_threads crosses zero, in either direction.
+ * Since there may be several crossings in quick succession from different threads,
+ * we don't act on the crossing we saw, but on the count we see once we hold idle_mutex.
+ * The last crossing is always followed by a sync that sees the final count.
+ */
+static void libidle_go_idle()
+{
+    if (state.verbose)
+    {
+        printf("  unlock\n");
+    }
+    libidle_unlock();
+    libidle_trace(find_thread_info(), LIBIDLE_TRACE_IDLE, LIBIDLE_TRACE_NONE, state.times_idle);
+}
+
+// bring the published state in line with busy. call with idle_mutex locked.
+static void libidle_publish_sync(bool busy)
+{
+    if (!state.locked && busy)
+    {
+        if (state.verbose)
+        {
+            printf("  lock\n");
+        }
+        libidle_lock();
+        libidle_trace(find_thread_info(), LIBIDLE_TRACE_BUSY, LIBIDLE_TRACE_NONE, state.times_idle);
+    }
+    else if (state.locked && busy)
+    {
+        // busy again before we settled: we never went idle as far as anyone can tell.
+        // a waiting timer will find nothing to do.
+        state.settle_due = 0;
+    }
+    else if (state.locked && !busy)
+    {
+        libidle_record_last_idle(find_thread_info());
+        if (!state.idle_settle_ns)
+        {
+            libidle_go_idle();
+        }
+        else if (!state.settle_due)
+        {
+            // a timer that's waiting for an earlier due time will look again then
+            state.settle_due = kernel_monotonic_ns() + state.idle_settle_ns;
+            if (state.settle_timer_parked)
+            {
+                state.settle_seq++;
+                futex(&state.settle_seq, FUTEX_WAKE_PRIVATE, 1, NULL);
+            }
+        }
+    }
+}
+
+// change the number of active members and shared waiters of our domain
+static void libidle_domain_add(int delta)
+{
+    if (delta == 0) return;
+
+    DomainPage *domain = state.domain;
+    int old_active = atomic_fetch_add(&domain->active, delta);
+
+    if ((old_active > 0) != (old_active + delta > 0))
+    {
+        if (old_active == 0) atomic_fetch_add(&domain->busy_periods, 1);
+        atomic_fetch_add(&domain->seq, 1);
+        // not private: the root's watcher waits in another process
+        futex((uint32_t *) &domain->seq, FUTEX_WAKE, INT_MAX, NULL);
+    }
+}
+
+// count our process as a busy or idle member. call with idle_mutex locked.
+static void libidle_domain_member_sync(bool busy)
+{
+    DomainMember *slot = state.domain_slot;
+    // we've left the domain
+    if (!slot) return;
+    if (atomic_load(&slot->busy) == busy) return;
+
+    atomic_store(&slot->busy, busy);
+    libidle_domain_add(busy ? 1 : -1);
+}
+
+/**
+ * For the root: bring the published state in line with the domain. call with idle_mutex locked.
+ * A member that went busy and idle again since we last looked still makes a busy period,
+ * so that whoever waits for the serial to move on sees it.
+ */
+static void libidle_domain_publish()
+{
+    DomainPage *domain = state.domain;
+    uint32_t busy_periods = atomic_load(&domain->busy_periods);
+    if (busy_periods != state.domain_busy_periods)
+    {
+        state.domain_busy_periods = busy_periods;
+        libidle_publish_sync(true);
+    }
+    libidle_publish_sync(atomic_load(&domain->active) > 0);
+}
+
+// whether the settle timer may go idle: the domain must not have been busy since we started settling
+static bool libidle_domain_quiet()
+{
+    if (!state.domain) return true;
+    return atomic_load(&state.domain->active) == 0
+        && atomic_load(&state.domain->busy_periods) == state.domain_busy_periods;
+}
+
+static void libidle_sync_idle_state()
+{
+    libidle_lock_mutex(&state.idle_mutex);
+
+    bool busy = num_active_threads() > 0;
+    if (state.domain)
+    {
+        libidle_domain_member_sync(busy);
+        // the root publishes its own transitions right away, and those of other members from its watcher
+        if (state.domain_root) libidle_domain_publish();
+    }
+    else
+    {
+        libidle_publish_sync(busy);
+    }
+
+    libidle_unlock_mutex(&state.idle_mutex);
+}
+
+/**
+ * Internal thread for LIBIDLE_IDLE_SETTLE_US: goes idle once we have been idle for that long.
+ * Busy periods never wait for it; they just cancel settle_due.
+ */
+static void *libidle_settle_timer(void *arg)
+{
+    while (true)
+    {
+        libidle_lock_mutex(&state.idle_mutex);
+        uint64_t now = kernel_monotonic_ns();
+        // in a domain, a member may have been busy since; the watcher is on its way to cancel settle_due then
+        if (state.settle_due && now >= state.settle_due && libidle_domain_quiet())
+        {
+            // settle_due is only set while idle and locked
+            state.settle_due = 0;
+            libidle_go_idle();
+        }
+        uint64_t due = state.settle_due;
+        uint32_t seq = state.settle_seq;
+        // an overdue settle_due is cancelled or set anew, which wakes us
+        bool parked = due == 0 || now >= due;
+        state.settle_timer_parked = parked;
+        libidle_unlock_mutex(&state.idle_mutex);
+
+        struct timespec timeout = { .tv_sec = (due - now) / 1000000000, .tv_nsec = (due - now) % 1000000000 };
+        // woken, timed out or raced: either way, look again
+        futex(&state.settle_seq, FUTEX_WAIT_PRIVATE, seq, parked ? NULL : &timeout);
+    }
+    return NULL;
+}
+
+/**
+ * Start a thread for libidle's own use.
+ * It is invisible to idle tracking, since it doesn't go through our pthread_create,
+ * and it never handles signals meant for the process.
+ * Internal threads must call next_ functions only.
+ */
+static void libidle_start_internal_thread(void *(*start_routine)(void*), void *arg)
+{
+    sigset_t all_signals, original_mask;
+    sigfillset(&all_signals);
+    // the new thread inherits our signal mask
+    pthread_sigmask(SIG_SETMASK, &all_signals, &original_mask);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (next_pthread_create(&thread, &attr, start_routine, arg) != 0)
+    {
+        fprintf(stderr, "libidle: cannot start internal thread\n");
+    }
+    pthread_attr_destroy(&attr);
+
+    pthread_sigmask(SIG_SETMASK, &original_mask, NULL);
+}
+
+// whether a member has died without leaving (zombies included, since they'll never run again)
+static bool libidle_domain_member_dead(pid_t pid)
+{
+    if (kill(pid, 0) == -1) return errno == ESRCH;
+
+    char path[32], status[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    ssize_t len = next_read(fd, status, sizeof(status) - 1);
+    next_close(fd);
+    if (len <= 0) return false;
+    status[len] = 0;
+    // "pid (comm) S ...", where comm may contain anything
+    char *state_letter = strrchr(status, ')');
+    return state_letter && state_letter[1] == ' ' && state_letter[2] == 'Z';
+}
+
+// for the root: free the slots of members that died without leaving
+static void libidle_domain_sweep()
+{
+    for (int i = 0; i < DOMAIN_MEMBERS; i++)
+    {
+        DomainMember *member = &state.domain->members[i];
+        pid_t pid = atomic_load(&member->pid);
+        if (pid <= 0 || pid == getpid() || !libidle_domain_member_dead(pid)) continue;
+
+        // nobody else touches the slot of a dead member until it's free
+        if (atomic_exchange(&member->busy, false)) libidle_domain_add(-1);
+        atomic_compare_exchange_strong(&member->pid, &pid, 0);
+    }
+}
+
+/**
+ * Internal thread of the root: publishes the state of the domain whenever its active count crosses zero.
+ * Dead members are swept every 100ms, so a member that was killed doesn't keep the domain busy forever.
+ */
+static void *libidle_domain_watcher(void *arg)
+{
+    DomainPage *domain = state.domain;
+    uint64_t next_sweep = 0;
+    while (true)
+    {
+        uint32_t seq = atomic_load(&domain->seq);
+        uint64_t now = kernel_monotonic_ns();
+        if (now >= next_sweep)
+        {
+            libidle_domain_sweep();
+            next_sweep = now + 100000000;
+        }
+
+        libidle_lock_mutex(&state.idle_mutex);
+        libidle_domain_publish();
+        libidle_unlock_mutex(&state.idle_mutex);
+
+        struct timespec timeout = { .tv_sec = 0, .tv_nsec = 100000000 };
+        futex((uint32_t *) &domain->seq, FUTEX_WAIT, seq, &timeout);
+    }
+    return NULL;
+}
+
+// take a free member slot for pid, or return NULL if the domain is full
+static DomainMember *libidle_domain_take_slot(pid_t pid)
+{
+    for (int i = 0; i < DOMAIN_MEMBERS; i++)
+    {
+        DomainMember *member = &state.domain->members[i];
+        pid_t free_pid = 0;
+        if (atomic_compare_exchange_strong(&member->pid, &free_pid, pid)) return member;
+    }
+    return NULL;
+}
+
+// the slot that the process we were before exec held
+static DomainMember *libidle_domain_find_slot(pid_t pid)
+{
+    for (int i = 0; i < DOMAIN_MEMBERS; i++)
+    {
+        if (atomic_load(&state.domain->members[i].pid) == pid) return &state.domain->members[i];
+    }
+    return NULL;
+}
+
+// at exit of the root: nobody can join any more
+static void libidle_domain_unlink()
+{
+    char name[NAME_MAX + 1];
+    snprintf(name, sizeof(name), "/libidle-domain-%d", (int) getpid());
+    if (state.domain_root) shm_unlink(name);
+}
+
+// read a small file from /proc into buf, NUL-terminated
+static bool libidle_read_proc(const char *path, char *buf, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    ssize_t len = next_read(fd, buf, size - 1);
+    next_close(fd);
+    if (len <= 0) return false;
+    buf[len] = 0;
+    return true;
+}
+
+// the start time of pid, from field 22 of its stat
+static bool libidle_start_time(pid_t pid, uint64_t *start_time)
+{
+    char path[32], status[512];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    if (!libidle_read_proc(path, status, sizeof(status))) return false;
+    // "pid (comm) state ...", where comm may contain anything; the state is field 3
+    char *field = strrchr(status, ')');
+    if (!field) return false;
+    field++;
+    for (int i = 3; i < 22; i++)
+    {
+        field = strchr(field + 1, ' ');
+        if (!field) return false;
+    }
+    unsigned long long ticks;
+    if (sscanf(field, " %llu", &ticks) != 1) return false;
+    *start_time = ticks;
+    return true;
+}
+
+static bool libidle_own_root_id(DomainRootId *root_id)
+{
+    *root_id = (DomainRootId) { 0 };
+    struct stat st;
+    if (!libidle_read_proc("/proc/sys/kernel/random/boot_id", root_id->boot_id, sizeof(root_id->boot_id))
+        || stat("/proc/self/ns/pid", &st) == -1 || !libidle_start_time(getpid(), &root_id->start_time))
+    {
+        return false;
+    }
+    root_id->pid_ns = st.st_ino;
+    return true;
+}
+
+/**
+ * Whether the domain named name provably belongs to a root that is gone: one of an earlier boot,
+ * or one in our pid namespace whose pid is dead or now belongs to a process that started at another time.
+ * Anything we can't tell about, like a domain of another pid namespace that shares /dev/shm with us
+ * or one that is still being set up, is left alone.
+ */
+static bool libidle_domain_stale(const char *name, const DomainRootId *own_id)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) return false;
+    struct stat st;
+    DomainPage *domain = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size == sizeof(DomainPage))
+    {
+        domain = mmap(NULL, sizeof(DomainPage), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    next_close(fd);
+    if (domain == MAP_FAILED) return false;
+
+    bool stale = false;
+    if (domain->magic == DOMAIN_MAGIC && domain->version == DOMAIN_VERSION)
+    {
+        const DomainRootId *root_id = &domain->root_id;
+        pid_t root = atomic_load(&domain->root);
+        uint64_t start_time;
+        // a root that couldn't find out who it is has an empty boot_id
+        if (!root_id->boot_id[0]) stale = false;
+        else if (strcmp(root_id->boot_id, own_id->boot_id) != 0) stale = true;
+        else if (root_id->pid_ns != own_id->pid_ns || root == getpid()) stale = false;
+        else if (libidle_domain_member_dead(root)) stale = true;
+        else stale = libidle_start_time(root, &start_time) && start_time != root_id->start_time;
+    }
+    munmap(domain, sizeof(DomainPage));
+    return stale;
+}
+
+/**
+ * Remove the domains of roots that were killed, and so couldn't remove them at exit.
+ * Once the root is gone, nobody can join the domain any more. Members that are still around keep it mapped.
+ */
+static void libidle_domain_remove_stale(const DomainRootId *own_id)
+{
+    DIR *dir = opendir("/dev/shm");
+    if (!dir) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
+    {
+        int pid;
+        char end;
+        if (sscanf(entry->d_name, "libidle-domain-%d%c", &pid, &end) != 1) continue;
+
+        char name[NAME_MAX + 2];
+        snprintf(name, sizeof(name), "/%s", entry->d_name);
+        if (libidle_domain_stale(name, own_id)) shm_unlink(name);
+    }
+    closedir(dir);
+}
+
+static DomainPage *libidle_create_domain()
+{
+    // without knowing who we are, nobody can tell whether our domain is stale, so we can't tell about theirs
+    DomainRootId root_id;
+    bool know_root_id = libidle_own_root_id(&root_id);
+    if (know_root_id) libidle_domain_remove_stale(&root_id);
+
+    char name[NAME_MAX + 1];
+    snprintf(name, sizeof(name), "/libidle-domain-%d", (int) getpid());
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1 || ftruncate(fd, sizeof(DomainPage)) == -1)
+    {
+        fprintf(stderr, "libidle: cannot create domain %s: %s\n", name, strerror(errno));
+        if (fd != -1) next_close(fd);
+        return NULL;
+    }
+    DomainPage *domain = mmap(NULL, sizeof(DomainPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    next_close(fd);
+    if (domain == MAP_FAILED)
+    {
+        fprintf(stderr, "libidle: cannot map domain %s: %s\n", name, strerror(errno));
+        shm_unlink(name);
+        return NULL;
+    }
+    if (know_root_id) domain->root_id = root_id;
+    atomic_store(&domain->root, getpid());
+    __atomic_store_n(&domain->version, DOMAIN_VERSION, __ATOMIC_RELAXED);
+    __atomic_store_n(&domain->magic, DOMAIN_MAGIC, __ATOMIC_RELEASE);
+    // for the members we fork or exec
+    setenv("LIBIDLE_DOMAIN_PAGE", name, 1);
+    atexit(libidle_domain_unlink);
+    return domain;
+}
+
+static DomainPage *libidle_open_domain(const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1)
+    {
+        fprintf(stderr, "libidle: cannot open domain %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    DomainPage *domain = mmap(NULL, sizeof(DomainPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    next_close(fd);
+    if (domain == MAP_FAILED || domain->magic != DOMAIN_MAGIC || domain->version != DOMAIN_VERSION)
+    {
+        fprintf(stderr, "libidle: %s is not a libidle domain\n", name);
+        if (domain != MAP_FAILED) munmap(domain, sizeof(DomainPage));
+        return NULL;
+    }
+    return domain;
+}
+
+/**
+ * At startup: create the domain (LIBIDLE_DOMAIN=1) or join the one we inherited (LIBIDLE_DOMAIN_PAGE).
+ * After exec, we take over the slot of the process we were, including its busy count;
+ * if that slot was the root's, we're the root.
+ */
+static void libidle_join_domain(const char *page_name)
+{
+    char *domain_enabled = getenv("LIBIDLE_DOMAIN");
+    if (page_name) state.domain = libidle_open_domain(page_name);
+    else if (domain_enabled && strcmp(domain_enabled, "1") == 0) state.domain = libidle_create_domain();
+    if (!state.domain) return;
+
+    pid_t pid = getpid();
+    state.domain_root = atomic_load(&state.domain->root) == pid;
+    if (state.domain_root && page_name) atexit(libidle_domain_unlink);
+    state.domain_slot = libidle_domain_find_slot(pid);
+    if (!state.domain_slot) state.domain_slot = libidle_domain_take_slot(pid);
+    if (!state.domain_slot) fprintf(stderr, "libidle: domain is full, not counting pid %d\n", (int) pid);
+}
+
+// leave the domain: at exit, or on exec into an image that won't join it
+static void libidle_leave_domain()
+{
+    libidle_lock_mutex(&state.idle_mutex);
+    DomainMember *slot = state.domain_slot;
+    if (slot)
+    {
+        state.domain_slot = NULL;
+        if (atomic_exchange(&slot->busy, false)) libidle_domain_add(-1);
+        atomic_store(&slot->pid, 0);
+    }
+    libidle_unlock_mutex(&state.idle_mutex);
+}
+
+// back in after an exec that failed
+static void libidle_rejoin_domain()
+{
+    libidle_lock_mutex(&state.idle_mutex);
+    state.domain_slot = libidle_domain_take_slot(getpid());
+    libidle_domain_member_sync(num_active_threads() > 0);
+    libidle_unlock_mutex(&state.idle_mutex);
+}
+
+/**
+ * The shared counts for a pshared semaphore that is being initialized, or NULL if the domain has no room.
+ * A semaphore that is initialized again, or that a member forgot to destroy, keeps its entry.
+ */
+static DomainSemaphore *libidle_domain_semaphore(sem_t *sem, int pending_wakeups)
+{
+    uintptr_t key = (uintptr_t) sem;
+    DomainSemaphore *entry = NULL;
+    for (int i = 0; i < DOMAIN_SEMAPHORES && !entry; i++)
+    {
+        if (atomic_load(&state.domain->semaphores[i].key) == key) entry = &state.domain->semaphores[i];
+    }
+    for (int i = 0; i < DOMAIN_SEMAPHORES && !entry; i++)
+    {
+        uintptr_t free_key = 0;
+        if (atomic_compare_exchange_strong(&state.domain->semaphores[i].key, &free_key, key))
+        {
+            entry = &state.domain->semaphores[i];
+        }
+    }
+    if (entry) atomic_store(&entry->counts, sem_counts_pack((SemaphoreCounts) { .pending_wakeups = pending_wakeups }));
+    return entry;
+}
+
+static void *libidle_socket_listener(void *arg)
+{
+    int listen_fd = (int) (intptr_t) arg;
+    while (true)
+    {
+        int fd = next_accept(listen_fd, NULL, NULL);
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "libidle: subscriber socket: %s\n", strerror(errno));
+            return NULL;
+        }
+        // taking idle_mutex keeps the initial state in order with the transitions.
+        libidle_lock_mutex(&state.idle_mutex);
+        if (libidle_send_event(fd, !state.locked))
+        {
+            PUSH(state.subscribers) = fd;
+        }
+        else
+        {
+            next_close(fd);
+        }
+        libidle_unlock_mutex(&state.idle_mutex);
+    }
+}
+
+// create the LIBIDLE_SOCKET endpoint. subscribers are accepted in an internal thread.
+static void libidle_open_socket(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "libidle: socket path too long: %s\n", path);
+        return;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        fprintf(stderr, "libidle: cannot create socket: %s\n", strerror(errno));
+        return;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, 16) == -1)
+    {
+        fprintf(stderr, "libidle: cannot listen on %s: %s\n", path, strerror(errno));
+        next_close(fd);
+        return;
+    }
+    libidle_start_internal_thread(libidle_socket_listener, (void *) (intptr_t) fd);
+}
+
+/**
+ * Record an event in the thread's trace ring, if it has one.
+ * Never blocks and never takes a lock: if the ring is full, the event is dropped and counted.
+ */
+static void libidle_trace(ThreadInfo *thr_info, enum LibidleTraceOp op,
+    enum LibidleTraceTransition transition, uint64_t object)
+{
+    TraceRing *ring = thr_info ? thr_info->trace_ring : NULL;
+    if (!ring) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t timestamp = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t free_events = TRACE_RING_EVENTS - (head - atomic_load_explicit(&ring->tail, memory_order_acquire));
+    if (free_events < (ring->dropped ? 2 : 1))
+    {
+        ring->dropped++;
+        return;
+    }
+    if (ring->dropped)
+    {
+        ring->events[head++ % TRACE_RING_EVENTS] = (LibidleTraceEvent) {
+            .timestamp = timestamp,
+            .object = ring->dropped,
+            .thread = thr_info->trace_id,
+            .op = LIBIDLE_TRACE_DROPPED,
+            .state = threadinfo_block_letter(thr_info),
+        };
+        ring->dropped = 0;
+    }
+    ring->events[head++ % TRACE_RING_EVENTS] = (LibidleTraceEvent) {
+        .timestamp = timestamp,
+        .object = object,
+        .thread = thr_info->trace_id,
+        .op = op,
+        .transition = transition,
+        .state = threadinfo_block_letter(thr_info),
+    };
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+}
+
+static void libidle_trace_write(const void *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = next_write(state.trace_fd, data, size);
+        if (written == -1)
+        {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data = (const char *) data + written;
+        size -= written;
+    }
+}
+
+// move every event recorded so far from the rings to the trace file
+static void libidle_trace_flush()
+{
+    pthread_mutex_lock(&state.trace_mutex);
+    for (TraceRing *ring = atomic_load_explicit(&state.trace_rings, memory_order_acquire); ring; ring = ring->next)
+    {
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head)
+        {
+            size_t start = tail % TRACE_RING_EVENTS;
+            size_t events = head - tail;
+            // at most two runs, if the events wrap around the end of the ring
+            if (events > TRACE_RING_EVENTS - start) events = TRACE_RING_EVENTS - start;
+            libidle_trace_write(&ring->events[start], events * sizeof(LibidleTraceEvent));
+            tail += events;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    pthread_mutex_unlock(&state.trace_mutex);
+}
+
+// internal thread: keeps the rings from filling up
+static void *libidle_trace_flusher(void *arg)
+{
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = 100000000 };
+    while (next_nanosleep(&interval, NULL) == 0)
+    {
+        libidle_trace_flush();
+    }
+    return NULL;
+}
+
+static void libidle_open_trace(const char *path)
+{
+    state.trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (state.trace_fd == -1)
+    {
+        fprintf(stderr, "libidle: cannot open trace file %s: %s\n", path, strerror(errno));
+        return;
+    }
+    LibidleTraceHeader header = {
+        .magic = LIBIDLE_TRACE_MAGIC,
+        .version = LIBIDLE_TRACE_VERSION,
+        .event_size = sizeof(LibidleTraceEvent),
+    };
+    libidle_trace_write(&header, sizeof(header));
+    atexit(libidle_trace_flush);
+}
+
+// a released ring, or a new one. call with the state mutex locked.
+static TraceRing *libidle_trace_ring_acquire()
+{
+    TraceRing *ring;
+    for (ring = atomic_load_explicit(&state.trace_rings, memory_order_relaxed); ring; ring = ring->next)
+    {
+        if (!ring->in_use) break;
+    }
+    if (!ring)
+    {
+        ring = aligned_alloc(_Alignof(TraceRing), sizeof(TraceRing));
+        ring->head = 0;
+        ring->tail = 0;
+        ring->next = atomic_load_explicit(&state.trace_rings, memory_order_relaxed);
+        atomic_store_explicit(&state.trace_rings, ring, memory_order_release);
+    }
+    ring->in_use = true;
+    ring->dropped = 0;
+    return ring;
+}
+
+/**
+ * Whether the thread is in a blocking call, or counted as idle anyway.
+ * Threads for which this is false are the ones that keep us busy by running.
+ */
+static bool threadinfo_is_blocked(ThreadInfo *thr_info)
+{
+    return thr_info->sleeping || thr_info->accounting != ACCOUNTED_ACTIVE
+        || atomic_load_explicit(&thr_info->in_sleep, memory_order_relaxed);
+}
+
+/**
+ * SIGPROF handler for LIBIDLE_SAMPLE: record the stack of the interrupted thread.
+ * Only touches the preallocated samples and the thread's own record, so it's async-signal-safe
+ * (backtrace is, once libgcc has been loaded; see libidle_open_samples).
+ * It can't interrupt libidle itself either, since we block signals while we hold our locks.
+ */
+static void libidle_sample_handler(int signal)
+{
+    int saved_errno = errno;
+    ThreadInfo *thr_info = current_thread;
+    samples_here++;
+    if (thr_info)
+    {
+        uint64_t index = atomic_fetch_add_explicit(&state.samples_taken, 1, memory_order_relaxed);
+        Sample *sample = &state.samples[index % SAMPLE_RING];
+        atomic_store_explicit(&sample->seq, 0, memory_order_relaxed);
+        sample->timestamp = kernel_monotonic_ns();
+        sample->serial = __atomic_load_n(&state.times_idle, __ATOMIC_RELAXED);
+        sample->trace_id = thr_info->trace_id;
+        memcpy(sample->name, thr_info->name, LIBIDLE_THREAD_NAME_LEN);
+        sample->name[LIBIDLE_THREAD_NAME_LEN - 1] = 0;
+        sample->depth = backtrace(sample->frames, SAMPLE_FRAMES);
+        atomic_store_explicit(&sample->seq, index + 1, memory_order_release);
+    }
+    errno = saved_errno;
+}
+
+/**
+ * Internal thread: every LIBIDLE_SAMPLE_MS while we're busy, have every running thread take a sample.
+ * Threads in a blocking call are left alone, since the signal could cut the call short.
+ */
+static void *libidle_sampler(void *arg)
+{
+    struct timespec interval = {
+        .tv_sec = state.sample_interval_ns / 1000000000,
+        .tv_nsec = state.sample_interval_ns % 1000000000,
+    };
+    while (next_nanosleep(&interval, NULL) == 0 && !atomic_load(&state.sampling_stopped))
+    {
+        // nobody is keeping us busy
+        if (atomic_load(&state.active_threads) == 0) continue;
+
+        libidle_lock_state_mutex();
+        for (ThreadInfo *thr_info = state.thr_info_first; thr_info; thr_info = thr_info->next)
+        {
+            // threads leave the list under the mutex before they exit, so every thread with an id is still there
+            pthread_t id = __atomic_load_n(&thr_info->id, __ATOMIC_RELAXED);
+            if (id && !threadinfo_is_blocked(thr_info)) pthread_kill(id, SIGPROF);
+        }
+        libidle_unlock_state_mutex();
+    }
+    return NULL;
+}
+
+// at exit: symbolize the samples and write them out, oldest first
+static void libidle_write_samples()
+{
+    // closed in the child of a fork
+    if (state.sample_fd == -1) return;
+    atomic_store(&state.sampling_stopped, true);
+    uint64_t taken = atomic_load(&state.samples_taken);
+    uint64_t first = taken > SAMPLE_RING ? taken - SAMPLE_RING : 0;
+    dprintf(state.sample_fd, "# %lu samples taken, the last %lu kept\n",
+        (unsigned long) taken, (unsigned long) (taken - first));
+    for (uint64_t i = first; i < taken; i++)
+    {
+        Sample *sample = &state.samples[i % SAMPLE_RING];
+        if (atomic_load_explicit(&sample->seq, memory_order_acquire) != i + 1) continue;
+        dprintf(state.sample_fd, "sample %lu serial=%lu time=%lu thread=%u name=%s\n",
+            (unsigned long) i, (unsigned long) sample->serial, (unsigned long) sample->timestamp,
+            sample->trace_id, sample->name);
+        // the first frame is libidle_sample_handler
+        if (sample->depth > 1) backtrace_symbols_fd(sample->frames + 1, sample->depth - 1, state.sample_fd);
+        dprintf(state.sample_fd, "\n");
+    }
+}
+
+static void libidle_open_samples(const char *path)
+{
+    state.sample_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (state.sample_fd == -1)
+    {
+        fprintf(stderr, "libidle: cannot open sample file %s: %s\n", path, strerror(errno));
+        return;
+    }
+    state.samples = calloc(SAMPLE_RING, sizeof(Sample));
+    // the first backtrace loads libgcc, which must not happen in a signal handler
+    void *frame;
+    backtrace(&frame, 1);
+
+    struct sigaction action = { .sa_handler = libidle_sample_handler, .sa_flags = SA_RESTART };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+    atexit(libidle_write_samples);
+}
+
+/**
+ * Create the record of a thread that is about to start, counted as active from now on.
+ * The thread claims it with libidle_claim_thread.
+ */
+static ThreadInfo *libidle_add_thread_info(void *(*start_routine)(void *), void *start_arg, bool detached)
+{
+    libidle_lock_state_mutex();
+    ThreadInfo *thr_info = slab_alloc(&state.thr_info_slab);
+
+    *thr_info = (ThreadInfo) {
+        .sleeping = false,
+        .forced_state_len = 0,
+        .forced_state_cap = FORCED_STATE_INLINE,
+        .waiting_semaphore = NULL,
+        .in_call = false,
+        .accounting = ACCOUNTED_ACTIVE,
+        .accounted_sem = NULL,
+        .start_routine = start_routine,
+        .start_arg = start_arg,
+        .detached = detached,
+        .prev = state.thr_info_last,
+        .next = NULL,
+    };
+    // libidle_next_deadline walks the list with only idle_mutex
+    libidle_lock_mutex(&state.idle_mutex);
+    if (state.thr_info_last) state.thr_info_last->next = thr_info;
+    else state.thr_info_first = thr_info;
+    state.thr_info_last = thr_info;
+    libidle_unlock_mutex(&state.idle_mutex);
+
+    thr_info->forced_state_ptr = thr_info->forced_state_inline;
+    thr_info->trace_id = state.threads_registered++;
+    thr_info->stats.trace_id = thr_info->trace_id;
+    thr_info->stats_since = monotonic_ns();
+    if (state.trace_fd != -1) thr_info->trace_ring = libidle_trace_ring_acquire();
+
+    // a new thread is running (or about to be), so it's active
+    accounting_add(thr_info, ACCOUNTED_ACTIVE, NULL);
+    libidle_unlock_state_mutex();
+    return thr_info;
+}
+
+static bool libidle_ignored_name(const char *name)
+{
+    for (size_t i = 0; i < state.ignore_threads_len; i++)
+    {
+        if (fnmatch(state.ignore_threads_ptr[i], name, 0) == 0) return true;
+    }
+    return false;
+}
+
+// called by the thread itself, before anything else. doesn't need the lock: the record is ours.
+static void libidle_claim_thread(ThreadInfo *thr_info)
+{
+    __atomic_store_n(&thr_info->id, pthread_self(), __ATOMIC_RELAXED);
+    current_thread = thr_info;
+    libidle_trace(thr_info, LIBIDLE_TRACE_THREAD_START, LIBIDLE_TRACE_NONE, thr_info->id);
+    if (state.ignore_threads_len > 0)
+    {
+        // the name we inherited from our creator, unless it has already named us
+        char name[LIBIDLE_THREAD_NAME_LEN];
+        if (!thr_info->ignored && pthread_getname_np(pthread_self(), name, sizeof(name)) == 0)
+        {
+            __atomic_store_n(&thr_info->ignored, libidle_ignored_name(name), __ATOMIC_RELAXED);
+        }
+        threadinfo_update_accounting(thr_info);
+    }
+}
+
+static void libidle_register_thread()
+{
+    ThreadInfo *thr_info = libidle_add_thread_info(NULL, NULL, false);
+    thr_info->created = true;
+    libidle_claim_thread(thr_info);
+}
+
+// stop counting the thread and take it off the thread list. call with the state mutex locked.
+static void libidle_retire_thread_info(ThreadInfo *thr_info)
+{
+    accounting_remove(thr_info, thr_info->accounting, thr_info->accounted_sem);
+    // if we were cancelled in a timed wait
+    libidle_remove_deadline(thr_info);
+
+    libidle_lock_mutex(&state.idle_mutex);
+    if (thr_info->prev) thr_info->prev->next = thr_info->next;
+    else state.thr_info_first = thr_info->next;
+    if (thr_info->next) thr_info->next->prev = thr_info->prev;
+    else state.thr_info_last = thr_info->prev;
+    libidle_unlock_mutex(&state.idle_mutex);
+
+    if (thr_info->forced_state_ptr != thr_info->forced_state_inline) free(thr_info->forced_state_ptr);
+    free(thr_info->waiting_channels_ptr);
+    if (thr_info->trace_ring) thr_info->trace_ring->in_use = false;
+}
+
+/**
+ * The stats of a thread as of now, including the period it's in.
+ * Safe from any thread, but only exact from the thread itself.
+ */
+static LibidleThreadStats threadinfo_stats(ThreadInfo *thr_info, uint64_t now)
+{
+    LibidleThreadStats stats = thr_info->stats;
+    stats.thread = __atomic_load_n(&thr_info->id, __ATOMIC_RELAXED);
+    uint64_t since = __atomic_load_n(&thr_info->stats_since, __ATOMIC_RELAXED);
+    if (now > since)
+    {
+        if (thr_info->sleeping) stats.blocked_ns += now - since;
+        else stats.busy_ns += now - since;
+    }
+    uint64_t forced_since = __atomic_load_n(&thr_info->forced_since, __ATOMIC_RELAXED);
+    if (thr_info->forced_state_len > 0 && now > forced_since) stats.forced_ns += now - forced_since;
+    return stats;
+}
+
+static void stats_add(LibidleThreadStats *sum, LibidleThreadStats stats)
+{
+    sum->busy_ns += stats.busy_ns;
+    sum->blocked_ns += stats.blocked_ns;
+    sum->forced_ns += stats.forced_ns;
+    sum->transitions += stats.transitions;
+    sum->mutex_hold_ns += stats.mutex_hold_ns;
+    sum->mutex_acquisitions += stats.mutex_acquisitions;
+    sum->mutex_contended += stats.mutex_contended;
+}
+
+// call with the state mutex locked
+static void libidle_free_zombie(ThreadInfo *thr_info)
+{
+    if (thr_info->prev) thr_info->prev->next = thr_info->next;
+    else state.zombies_first = thr_info->next;
+    if (thr_info->next) thr_info->next->prev = thr_info->prev;
+    slab_free(&state.thr_info_slab, thr_info);
+}
+
+// the record of a thread that can be joined (running or zombie), or NULL. call with the state mutex locked.
+static ThreadInfo *libidle_find_joinable(pthread_t thread)
+{
+    ThreadInfo *lists[] = { state.thr_info_first, state.zombies_first };
+    for (int i = 0; i < 2; i++)
+    {
+        for (ThreadInfo *thr_info = lists[i]; thr_info; thr_info = thr_info->next)
+        {
+            if (__atomic_load_n(&thr_info->id, __ATOMIC_RELAXED) == thread) return thr_info->detached ? NULL : thr_info;
+        }
+    }
+    return NULL;
+}
+
+// unregister the calling thread
+static void libidle_unregister_thread()
+{
+    libidle_lock_state_mutex();
+    ThreadInfo *thr_info = current_thread;
+    if (thr_info)
+    {
+        libidle_trace(thr_info, LIBIDLE_TRACE_THREAD_EXIT, LIBIDLE_TRACE_NONE, thr_info->id);
+        // wake our joiner before we stop counting, like sem_post
+        if (!thr_info->detached) sem_info_add_pending(&thr_info->join_sem, 1);
+        libidle_retire_thread_info(thr_info);
+        stats_add(&state.stats_exited, threadinfo_stats(thr_info, monotonic_ns()));
+        if (thr_info->detached && thr_info->created)
+        {
+            slab_free(&state.thr_info_slab, thr_info);
+        }
+        else
+        {
+            thr_info->exited = true;
+            thr_info->prev = NULL;
+            thr_info->next = state.zombies_first;
+            if (state.zombies_first) state.zombies_first->prev = thr_info;
+            state.zombies_first = thr_info;
+        }
+        current_thread = NULL;
+    }
+    libidle_unlock_state_mutex();
+}
+
+// the other members of a domain write their own trace, stats and samples, with their pid appended
+static char *libidle_own_path(char *path, bool publisher)
+{
+    if (!path || publisher) return path;
+    char *own_path;
+    if (asprintf(&own_path, "%s.%d", path, (int) getpid()) == -1) return NULL;
+    return own_path;
+}
+
+__attribute__ ((constructor))
+void libidle_init()
+{
+    if (state.initialized) return;
+
+    next_accept = dlsym(RTLD_NEXT, "accept");
+    next_pthread_cond_destroy = dlvsym(RTLD_NEXT, "pthread_cond_destroy", "GLIBC_2.3.2");
+    next_pthread_cond_init = dlvsym(RTLD_NEXT, "pthread_cond_init", "GLIBC_2.3.2");
+    next_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
+    next_pthread_detach = dlsym(RTLD_NEXT, "pthread_detach");
+    next_pthread_join = dlsym(RTLD_NEXT, "pthread_join");
+    next_sem_destroy = dlvsym(RTLD_NEXT, "sem_destroy", "GLIBC_2.2.5");
+    next_sem_init = dlvsym(RTLD_NEXT, "sem_init", "GLIBC_2.2.5");
+    next_sem_open = dlsym(RTLD_NEXT, "sem_open");
+    next_sem_clockwait = dlsym(RTLD_NEXT, "sem_clockwait"); // glibc 2.30
+    next_sem_post = dlvsym(RTLD_NEXT, "sem_post", "GLIBC_2.2.5");
+    next_sem_timedwait = dlvsym(RTLD_NEXT, "sem_timedwait", "GLIBC_2.2.5");
+    next_sem_wait = dlvsym(RTLD_NEXT, "sem_wait", "GLIBC_2.2.5");
+    next_pthread_setname_np = dlvsym(RTLD_NEXT, "pthread_setname_np", "GLIBC_2.12");
+    next_clock_nanosleep = dlsym(RTLD_NEXT, "clock_nanosleep");
+    next_close = dlsym(RTLD_NEXT, "close");
+    next_dup2 = dlsym(RTLD_NEXT, "dup2");
+    next_dup3 = dlsym(RTLD_NEXT, "dup3");
+    next_epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
+    next_epoll_pwait = dlsym(RTLD_NEXT, "epoll_pwait");
+    next_epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
+    next_eventfd = dlsym(RTLD_NEXT, "eventfd");
+    next_nanosleep = dlsym(RTLD_NEXT, "nanosleep");
+    next_pipe = dlsym(RTLD_NEXT, "pipe");
+    next_pipe2 = dlsym(RTLD_NEXT, "pipe2");
+    next_poll = dlsym(RTLD_NEXT, "poll");
+    next_ppoll = dlsym(RTLD_NEXT, "ppoll");
+    next_pselect = dlsym(RTLD_NEXT, "pselect");
+    next_read = dlsym(RTLD_NEXT, "read");
+    next_readv = dlsym(RTLD_NEXT, "readv");
+    next_recv = dlsym(RTLD_NEXT, "recv");
+    next_recvfrom = dlsym(RTLD_NEXT, "recvfrom");
+    next_recvmsg = dlsym(RTLD_NEXT, "recvmsg");
+    next_select = dlsym(RTLD_NEXT, "select");
+    next_send = dlsym(RTLD_NEXT, "send");
+    next_sendmsg = dlsym(RTLD_NEXT, "sendmsg");
+    next_sendto = dlsym(RTLD_NEXT, "sendto");
+    next_socketpair = dlsym(RTLD_NEXT, "socketpair");
+    next_syscall = dlsym(RTLD_NEXT, "syscall");
+    next_write = dlsym(RTLD_NEXT, "write");
+    next_writev = dlsym(RTLD_NEXT, "writev");
+    next_execv = dlsym(RTLD_NEXT, "execv");
+    next_execve = dlsym(RTLD_NEXT, "execve");
+    next_execvp = dlsym(RTLD_NEXT, "execvp");
+    next_execvpe = dlsym(RTLD_NEXT, "execvpe");
+    next_fork = dlsym(RTLD_NEXT, "fork");
+    next_wait4 = dlsym(RTLD_NEXT, "wait4");
+    next_waitid = dlsym(RTLD_NEXT, "waitid");
+    next_waitpid = dlsym(RTLD_NEXT, "waitpid");
+
+    char *statefile = getenv("LIBIDLE_STATEFILE");
+    if (!statefile) statefile = ".libidle_state";
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&state.mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&state.idle_mutex, NULL);
+
+    char *domain_page = getenv("LIBIDLE_DOMAIN_PAGE");
+    libidle_join_domain(domain_page);
+    if (state.domain_slot) atexit(libidle_leave_domain);
+    // the statefile, shm page and socket of a domain are the root's; the other members only count
+    bool publisher = !domain_page || state.domain_root;
+
+    char *shm_name = getenv("LIBIDLE_SHM");
+    if (shm_name && publisher) state.shm = libidle_open_shm(shm_name);
+    // not inherited by exec: the new image would keep our lock forever
+    if (!state.shm) state.filedes = publisher ? open(statefile, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+    state.verbose = getenv("LIBIDLE_VERBOSE") ? true : false;
+    char *cond_signal_one = getenv("LIBIDLE_COND_SIGNAL_ONE");
+    state.cond_signal_one = cond_signal_one && strcmp(cond_signal_one, "1") == 0;
+    char *idle_settle = getenv("LIBIDLE_IDLE_SETTLE_US");
+    if (idle_settle && publisher) state.idle_settle_ns = strtoull(idle_settle, NULL, 10) * 1000;
+    char *sleep_idle = getenv("LIBIDLE_SLEEP_IDLE");
+    state.sleep_idle = sleep_idle && strcmp(sleep_idle, "1") == 0;
+    char *statefile_deadline = getenv("LIBIDLE_STATEFILE_DEADLINE");
+    state.statefile_deadline = statefile_deadline && strcmp(statefile_deadline, "1") == 0;
+    char *track_futex = getenv("LIBIDLE_FUTEX");
+    state.track_futex = track_futex && strcmp(track_futex, "1") == 0;
+    char *ignore_threads = getenv("LIBIDLE_IGNORE_THREADS");
+    if (ignore_threads)
+    {
+        char *saveptr, *patterns = strdup(ignore_threads);
+        for (char *pattern = strtok_r(patterns, ",", &saveptr); pattern; pattern = strtok_r(NULL, ",", &saveptr))
+        {
+            PUSH(state.ignore_threads) = pattern;
+        }
+    }
+    char *trace_path = libidle_own_path(getenv("LIBIDLE_TRACE"), publisher);
+    if (trace_path) libidle_open_trace(trace_path);
+    state.time_state_mutex = getenv("LIBIDLE_STATS") != NULL;
+    state.stats_path = libidle_own_path(getenv("LIBIDLE_STATS"), publisher);
+    if (state.stats_path) atexit(libidle_dump_stats);
+    char *sample_path = libidle_own_path(getenv("LIBIDLE_SAMPLE"), publisher);
+    if (sample_path)
+    {
+        char *sample_ms = getenv("LIBIDLE_SAMPLE_MS");
+        state.sample_interval_ns = (sample_ms ? strtoull(sample_ms, NULL, 10) : 10) * 1000000;
+        if (state.sample_interval_ns) libidle_open_samples(sample_path);
+    }
+    // the main thread being active takes the lock
+    libidle_register_thread();
+    state.initialized = true;
+
+    char *socket_path = getenv("LIBIDLE_SOCKET");
+    if (socket_path && publisher) libidle_open_socket(socket_path);
+    if (state.domain_root) libidle_start_internal_thread(libidle_domain_watcher, NULL);
+    if (state.trace_fd != -1) libidle_start_internal_thread(libidle_trace_flusher, NULL);
+    if (state.idle_settle_ns) libidle_start_internal_thread(libidle_settle_timer, NULL);
+    if (state.sample_fd != -1) libidle_start_internal_thread(libidle_sampler, NULL);
+}
+
+#define LIBIDLE_TRACE_OP_NAME(op, name) [op] = name,
+static const char *trace_op_names[] = { LIBIDLE_TRACE_OPS(LIBIDLE_TRACE_OP_NAME) };
+#undef LIBIDLE_TRACE_OP_NAME
+
+// object is whatever identifies the thing we block on in the trace
+static void entering_blocked_op(enum LibidleTraceOp op, uint64_t object)
+{
+    ThreadInfo *thr_info = find_thread_info();
+    assert(!thr_info || thr_info->sleeping == false);
+    if (thr_info)
+    {
+        uint64_t now = monotonic_ns();
+        STAT_ADD(thr_info->stats.busy_ns, now - thr_info->stats_since);
+        STAT_ADD(thr_info->stats.transitions, 1);
+        __atomic_store_n(&thr_info->stats_since, now, __ATOMIC_RELAXED);
+        thr_info->sleeping = true;
+        threadinfo_update_accounting(thr_info);
+    }
+    libidle_trace(thr_info, op, LIBIDLE_TRACE_ENTER, object);
+    if (state.verbose && (!thr_info || thr_info->forced_state_len == 0 || thr_info->forced_state_ptr[0] != BUSY)) {
+        log_block_change("+block", "%s\n", trace_op_names[op]);
+    }
+}
+
+static void left_blocked_op(enum LibidleTraceOp op, uint64_t object)
+{
+    ThreadInfo *thr_info = find_thread_info();
+    assert(!thr_info || thr_info->sleeping == true);
+    if (thr_info)
+    {
+        uint64_t now = monotonic_ns();
+        STAT_ADD(thr_info->stats.blocked_ns, now - thr_info->stats_since);
+        __atomic_store_n(&thr_info->stats_since, now, __ATOMIC_RELAXED);
+        thr_info->sleeping = false;
+        threadinfo_update_accounting(thr_info);
+    }
+    libidle_trace(thr_info, op, LIBIDLE_TRACE_LEAVE, object);
+    if (state.verbose && (!thr_info || thr_info->forced_state_len == 0 || thr_info->forced_state_ptr[0] != BUSY)) {
+        log_block_change("-block", "%s\n", trace_op_names[op]);
+    }
+}
+
+static void forced_state_push(ThreadInfo *thr_info, enum ForcedState forced_state)
+{
+    if (thr_info->forced_state_len == thr_info->forced_state_cap)
+    {
+        size_t cap = thr_info->forced_state_cap * 2;
+        enum ForcedState *ptr = malloc(sizeof(enum ForcedState) * cap);
+        memcpy(ptr, thr_info->forced_state_ptr, sizeof(enum ForcedState) * thr_info->forced_state_len);
+
+        // the state mutex keeps print_block_map in other threads off the old buffer
+        libidle_lock_state_mutex();
+        enum ForcedState *old_ptr = thr_info->forced_state_ptr;
+        thr_info->forced_state_ptr = ptr;
+        thr_info->forced_state_cap = cap;
+        libidle_unlock_state_mutex();
+
+        if (old_ptr != thr_info->forced_state_inline) free(old_ptr);
+    }
+    if (thr_info->forced_state_len == 0) __atomic_store_n(&thr_info->forced_since, monotonic_ns(), __ATOMIC_RELAXED);
+    thr_info->forced_state_ptr[thr_info->forced_state_len++] = forced_state;
+}
+
+static void forced_state_pop(ThreadInfo *thr_info, enum ForcedState forced_state)
+{
+    assert(thr_info->forced_state_len > 0 && thr_info->forced_state_ptr[thr_info->forced_state_len - 1] == forced_state);
+    thr_info->forced_state_len--;
+    if (thr_info->forced_state_len == 0) STAT_ADD(thr_info->stats.forced_ns, monotonic_ns() - thr_info->forced_since);
+}
+
+// equivalent to entering a blocked op
+void libidle_enable_forced_idle()
+{
+    ThreadInfo *thr_info = find_thread_info();
+    assert(thr_info);
+
+    forced_state_push(thr_info, IDLE);
+    threadinfo_update_accounting(thr_info);
+    libidle_trace(thr_info, LIBIDLE_TRACE_FORCED_IDLE, LIBIDLE_TRACE_ENTER, 0);
+
+    if (state.verbose) log_block_change("+block", "libidle_enable_forced_idle()\n");
+}
+
+/**
+ * Equivalent to leaving a blocked op.
+ * It is not the case that leaving a blocking op necessarily makes us busy.
+ * For instance, the blocking op may be inside a forced_idle pair.
+ * In that case, we go busy when we disable forced_idle, bringing
+ * the active thread count up.
+ */
+void libidle_disable_forced_idle()
+{
+    ThreadInfo *thr_info = find_thread_info();
+    assert(thr_info);
+
+    forced_state_pop(thr_info, IDLE);
+    threadinfo_update_accounting(thr_info);
+    libidle_trace(thr_info, LIBIDLE_TRACE_FORCED_IDLE, LIBIDLE_TRACE_LEAVE, 0);
+
+    if (state.verbose) log_block_change("-block", "libidle_disable_forced_idle()\n");
+}
+
+void libidle_enable_forced_busy()
+{
+    ThreadInfo *thr_info = find_thread_info();
+    assert(thr_info);
+
+    forced_state_push(thr_info, BUSY);
+    threadinfo_update_accounting(thr_info);
+    libidle_trace(thr_info, LIBIDLE_TRACE_FORCED_BUSY, LIBIDLE_TRACE_ENTER, 0);
+}
+
+void libidle_disable_forced_busy()
+{
+    ThreadInfo *thr_info = find_thread_info();
+    assert(thr_info);
+
+    forced_state_pop(thr_info, BUSY);
+    threadinfo_update_accounting(thr_info);
+    libidle_trace(thr_info, LIBIDLE_TRACE_FORCED_BUSY, LIBIDLE_TRACE_LEAVE, 0);
+}
+
+// add the primitives of map that have been used at all. call with the state mutex locked.
+static void stats_add_primitives(LibidleStats *stats, PtrMap *map, enum LibidlePrimitiveKind kind)
+{
+    PtrMapTable *table = atomic_load_explicit(&map->table, memory_order_relaxed);
+    if (!table) return;
+    for (size_t i = 0; i <= table->mask; i++)
+    {
+        void *record = atomic_load_explicit(&table->slots[i], memory_order_relaxed);
+        if (!record) continue;
+        PrimitiveStats counters =
+            kind == LIBIDLE_STATS_SEMAPHORE ? ((SemaphoreInfo *) record)->stats :
+            kind == LIBIDLE_STATS_CONDITION ? ((ConditionInfo *) record)->stats :
+            ((FutexInfo *) record)->sem_info.stats;
+        if (!counters.posts && !counters.waits && !counters.broadcasts) continue;
+        stats->primitives[stats->primitives_len++] = (LibidlePrimitiveStats) {
+            .object = (uintptr_t) RECORD_KEY(record),
+            .kind = kind,
+            .posts = counters.posts,
+            .waits = counters.waits,
+            .broadcasts = counters.broadcasts,
+            .contended = counters.contended,
+        };
+    }
+}
+
+/**
+ * Take a snapshot of the statistics: every registered thread, in order of registration,
+ * and every semaphore, condition and futex word that has been posted or waited on.
+ * Free it with libidle_free_stats.
+ */
+LibidleStats *libidle_get_stats()
+{
+    LibidleStats *stats = calloc(1, sizeof(LibidleStats));
+
+    libidle_lock_state_mutex();
+    uint64_t now = monotonic_ns();
+
+    size_t threads = 0;
+    for (ThreadInfo *thr_info = state.thr_info_first; thr_info; thr_info = thr_info->next) threads++;
+    stats->threads = calloc(threads, sizeof(LibidleThreadStats));
+    for (ThreadInfo *thr_info = state.thr_info_first; thr_info; thr_info = thr_info->next)
+    {
+        stats->threads[stats->threads_len] = threadinfo_stats(thr_info, now);
+        stats_add(&stats->exited, stats->threads[stats->threads_len]);
+        stats->threads_len++;
+    }
+    // the live threads were only summed up for the mutex totals
+    stats->mutex_hold_ns = stats->exited.mutex_hold_ns + state.stats_exited.mutex_hold_ns;
+    stats->mutex_acquisitions = stats->exited.mutex_acquisitions + state.stats_exited.mutex_acquisitions;
+    stats->mutex_contended = stats->exited.mutex_contended + state.stats_exited.mutex_contended;
+    stats->exited = state.stats_exited;
+
+    stats->primitives = calloc(state.sem_info.len + state.cond_info.len + state.futex_info.len,
+        sizeof(LibidlePrimitiveStats));
+    stats_add_primitives(stats, &state.sem_info, LIBIDLE_STATS_SEMAPHORE);
+    stats_add_primitives(stats, &state.cond_info, LIBIDLE_STATS_CONDITION);
+    stats_add_primitives(stats, &state.futex_info, LIBIDLE_STATS_FUTEX);
+
+    libidle_lock_mutex(&state.idle_mutex);
+    // transitions alternate, starting with the main thread going busy
+    stats->idle_edges = state.times_idle;
+    stats->busy_edges = state.times_idle + (state.locked ? 1 : 0);
+    memcpy(stats->busy_histogram, state.busy_histogram, sizeof(stats->busy_histogram));
+    stats->busy_periods_len = state.times_idle < LIBIDLE_BUSY_PERIODS ? state.times_idle : LIBIDLE_BUSY_PERIODS;
+    for (size_t i = 0; i < stats->busy_periods_len; i++)
+    {
+        uint64_t serial = state.times_idle - stats->busy_periods_len + 1 + i;
+        stats->busy_periods[i] = state.busy_periods[serial % LIBIDLE_BUSY_PERIODS];
+    }
+    libidle_unlock_mutex(&state.idle_mutex);
+
+    libidle_unlock_state_mutex();
+    return stats;
+}
+
+void libidle_free_stats(LibidleStats *stats)
+{
+    if (!stats) return;
+    free(stats->threads);
+    free(stats->primitives);
+    free(stats);
+}
+
+static void stats_print_thread(FILE *file, const char *label, LibidleThreadStats *thread)
+{
+    fprintf(file, "%s busy_ns=%lu blocked_ns=%lu forced_ns=%lu transitions=%lu "
+        "mutex_hold_ns=%lu mutex_acquisitions=%lu mutex_contended=%lu\n",
+        label, (unsigned long) thread->busy_ns, (unsigned long) thread->blocked_ns,
+        (unsigned long) thread->forced_ns, (unsigned long) thread->transitions,
+        (unsigned long) thread->mutex_hold_ns, (unsigned long) thread->mutex_acquisitions,
+        (unsigned long) thread->mutex_contended);
+}
+
+static void libidle_dump_stats()
+{
+    // cleared in the child of a fork
+    if (!state.stats_path) return;
+    FILE *file = fopen(state.stats_path, "w");
+    if (!file)
+    {
+        fprintf(stderr, "libidle: cannot open stats file %s: %s\n", state.stats_path, strerror(errno));
+        return;
+    }
+    LibidleStats *stats = libidle_get_stats();
+    fprintf(file, "idle_edges=%lu busy_edges=%lu mutex_hold_ns=%lu mutex_acquisitions=%lu mutex_contended=%lu\n",
+        (unsigned long) stats->idle_edges, (unsigned long) stats->busy_edges,
+        (unsigned long) stats->mutex_hold_ns, (unsigned long) stats->mutex_acquisitions,
+        (unsigned long) stats->mutex_contended);
+    for (size_t i = 0; i < stats->threads_len; i++)
+    {
+        char label[64];
+        snprintf(label, sizeof(label), "thread %u %lx", stats->threads[i].trace_id,
+            (unsigned long) stats->threads[i].thread);
+        stats_print_thread(file, label, &stats->threads[i]);
+    }
+    stats_print_thread(file, "exited", &stats->exited);
+    for (size_t i = 0; i < stats->primitives_len; i++)
+    {
+        LibidlePrimitiveStats *primitive = &stats->primitives[i];
+        fprintf(file, "%s 0x%lx posts=%lu waits=%lu broadcasts=%lu contended=%lu\n",
+            primitive->kind == LIBIDLE_STATS_SEMAPHORE ? "semaphore" :
+            primitive->kind == LIBIDLE_STATS_CONDITION ? "condition" : "futex",
+            (unsigned long) primitive->object, (unsigned long) primitive->posts,
+            (unsigned long) primitive->waits, (unsigned long) primitive->broadcasts,
+            (unsigned long) primitive->contended);
+    }
+    fprintf(file, "busy_histogram");
+    for (int i = 0; i < LIBIDLE_BUSY_BUCKETS; i++)
+    {
+        if (stats->busy_histogram[i]) fprintf(file, " %lu:%lu", 1UL << i, (unsigned long) stats->busy_histogram[i]);
+    }
+    fprintf(file, "\n");
+    for (size_t i = 0; i < stats->busy_periods_len; i++)
+    {
+        LibidleBusyPeriod *period = &stats->busy_periods[i];
+        fprintf(file, "busy_period serial=%lu busy_ns=%lu last_thread=%d last_name=%s\n",
+            (unsigned long) period->serial, (unsigned long) period->busy_ns,
+            period->last_trace_id == UINT32_MAX ? -1 : (int) period->last_trace_id, period->last_name);
+    }
+    libidle_free_stats(stats);
+    fclose(file);
+}
+
+static void vlog_block_change(const char *change, const char *fmt, va_list ap)
+{
+    // the state mutex keeps the thread list stable, and keeps lines from different threads apart
+    libidle_lock_state_mutex();
+    print_block_map();
+    printf(": %lx: %s: ", pthread_self(), change);
+    vprintf(fmt, ap);
+    libidle_unlock_state_mutex();
+}
+
+static ThreadInfo *find_thread_info()
+{
+    return current_thread;
+}
+
+static bool threadinfo_channel_pending(ThreadInfo *thr_info)
+{
+    for (size_t i = 0; i < thr_info->waiting_channels_len; i++)
+    {
+        if (sem_info_counts(&thr_info->waiting_channels_ptr[i]->sem_info).pending_wakeups > 0) return true;
+    }
+    return false;
+}
+
+static char threadinfo_block_letter(ThreadInfo *thr_info)
+{
+    SemaphoreInfo *sem_info = thr_info->waiting_semaphore;
+    return
+        thr_info->ignored ? 'x' : // ignored by name
+        (thr_info->forced_state_len > 0 && thr_info->forced_state_ptr[0] == BUSY) ? 'B' : // forced busy
+        (thr_info->forced_state_len > 0 && thr_info->forced_state_ptr[0] == IDLE) ? 'i' : // forced idle
+        (!thr_info->sleeping) ? '-' : // computing
+        (thr_info->waiting_channels_len > 0) ? (threadinfo_channel_pending(thr_info) ? 'S' : 's') : // on channels
+        (!sem_info) ? 'b' : // blocking busy
+        (sem_info_counts(sem_info).pending_wakeups > 0) ? 'S' : // sleeping on a signaled semaphore
+        's'; // sleeping on a semaphore
+}
+
+static void print_block_map()
+{
+    // other threads' fields may change under us; this is only a diagnostic snapshot.
+    for (ThreadInfo *thr_info = state.thr_info_first; thr_info; thr_info = thr_info->next)
+    {
+        if (thr_info != state.thr_info_first) printf("|");
+        printf("%c", threadinfo_block_letter(thr_info));
+    }
+}
+
+static int num_active_threads()
+{
+    return atomic_load(&state.active_threads);
+}
+
+//
+// function proxies
+//
+int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    NON_NULL(next_accept);
+    entering_blocked_op(LIBIDLE_TRACE_ACCEPT, sockfd);
+    int ret = next_accept(sockfd, addr, addrlen);
+    left_blocked_op(LIBIDLE_TRACE_ACCEPT, sockfd);
+    return ret;
+}
+
+/**
+ * pthread_create
+ */
+
+void remove_thread_info()
+{
+    libidle_unregister_thread();
+}
+
+void *thread_wrapper(void *arg)
+{
+    ThreadInfo *thr_info = arg;
+    libidle_claim_thread(thr_info);
+
+    void *ret; // pthread_cleanup_push and _pop are actually macros with unbalanced braces
+
+    pthread_cleanup_push(&remove_thread_info, NULL);
+    ret = thr_info->start_routine(thr_info->start_arg);
+    pthread_cleanup_pop(true);
+    return ret;
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+        void *(*start_routine) (void *), void *arg)
+{
+    NON_NULL(next_pthread_create);
+
+    int detach_state = PTHREAD_CREATE_JOINABLE;
+    if (attr) pthread_attr_getdetachstate(attr, &detach_state);
+
+    // the child is registered (and active) before it exists, so we can't go idle while it starts up,
+    // and we don't have to wait for it.
+    ThreadInfo *thr_info = libidle_add_thread_info(start_routine, arg, detach_state == PTHREAD_CREATE_DETACHED);
+    int ret = next_pthread_create(thread, attr, thread_wrapper, thr_info);
+
+    libidle_lock_state_mutex();
+    if (ret != 0)
+    {
+        libidle_retire_thread_info(thr_info);
+        slab_free(&state.thr_info_slab, thr_info);
+    }
+    else
+    {
+        // the child sets its id too, but we may want to join it before it gets to run
+        __atomic_store_n(&thr_info->id, *thread, __ATOMIC_RELAXED);
+        thr_info->created = true;
+        // a detached child that was quicker than us left its record for us to free
+        if (thr_info->exited && thr_info->detached) libidle_free_zombie(thr_info);
+    }
+    libidle_unlock_state_mutex();
+    return ret;
+}
+
+int pthread_join(pthread_t thread, void **retval)
+{
+    ThreadInfo *thr_info = find_thread_info();
+
+    NON_NULL(next_pthread_join);
+    if (!thr_info || thr_info->in_call)
+    {
+        /**
+         * As with libidle_sem_wait, we just forward the call and don't worry about it.
+         */
+        return next_pthread_join(thread, retval);
+    }
+    thr_info->in_call = true;
+
+    // a thread that we don't know (not started by pthread_create) is just blocking, like accept
+    libidle_lock_state_mutex();
+    ThreadInfo *target = libidle_find_joinable(thread);
+    libidle_unlock_state_mutex();
+    // target can't go away while we're joining it: zombies are freed by their joiner
+    thr_info->waiting_semaphore = target ? &target->join_sem : NULL;
+
+    entering_blocked_op(LIBIDLE_TRACE_JOIN, thread);
+    int ret = next_pthread_join(thread, retval);
+    // as in libidle_tracked_wait: become active, then consume the wakeup
+    left_blocked_op(LIBIDLE_TRACE_JOIN, thread);
+    thr_info->waiting_semaphore = NULL;
+    threadinfo_update_accounting(thr_info);
+
+    if (target && ret == 0)
+    {
+        assert(target->exited);
+        sem_info_add_pending(&target->join_sem, -1);
+        libidle_lock_state_mutex();
+        libidle_free_zombie(target);
+        libidle_unlock_state_mutex();
+    }
+    thr_info->in_call = false;
+    return ret;
+}
+
+int pthread_detach(pthread_t thread)
+{
+    NON_NULL(next_pthread_detach);
+
+    // nobody will join it, so nobody will free its zombie
+    libidle_lock_state_mutex();
+    ThreadInfo *target = libidle_find_joinable(thread);
+    if (target)
+    {
+        target->detached = true;
+        if (target->exited && target->created) libidle_free_zombie(target);
+    }
+    libidle_unlock_state_mutex();
+
+    return next_pthread_detach(thread);
+}
+
+int pthread_setname_np(pthread_t thread, const char *name)
+{
+    NON_NULL(next_pthread_setname_np);
+    int ret = next_pthread_setname_np(thread, name);
+    if (ret != 0) return ret;
+
+    libidle_lock_state_mutex();
+    int i = 0;
+    for (ThreadInfo *thr_info = state.thr_info_first; thr_info; thr_info = thr_info->next, i++)
+    {
+        // a thread that hasn't started running yet doesn't have its id yet, and isn't found
+        if (__atomic_load_n(&thr_info->id, __ATOMIC_RELAXED) == thread)
+        {
+            snprintf(thr_info->name, sizeof(thr_info->name), "%s", name);
+            if (state.ignore_threads_len > 0) libidle_apply_ignored(thr_info, libidle_ignored_name(name));
+            if (state.verbose)
+            {
+                for (int k = 0; k < i; k++) printf("  ");
+                printf("/ %s\n", name);
+            }
+            break;
+        }
+    }
+    if (state.verbose)
+    {
+        print_block_map();
+        printf("\n");
+    }
+    libidle_unlock_state_mutex();
+
+    // if we named ourselves, we can recount ourselves right away
+    ThreadInfo *thr_info = find_thread_info();
+    if (thr_info && thr_info->id == thread) threadinfo_update_accounting(thr_info);
+    return ret;
+}
+
+sem_t *sem_open(const char *name, int oflag, ...)
+{
+    // we may be called very early by libfaketime
+    libidle_init();
+
+    NON_NULL(next_sem_open);
+
+    sem_t *ret;
+    if (oflag & O_CREAT)
+    {
+        va_list args;
+        va_start(args, oflag);
+        mode_t mode = va_arg(args, mode_t);
+        unsigned int value = va_arg(args, unsigned int);
+        va_end(args);
+        ret = next_sem_open(name, oflag, mode, value);
+    }
+    else
+    {
+        ret = next_sem_open(name, oflag);
+    }
+    if (ret == SEM_FAILED) return ret;
+
+    libidle_lock_state_mutex();
+
+    // register semaphore in SemaphoreInfo table
+    libidle_register_sem(ret, true, 0, NULL);
+
+    libidle_unlock_state_mutex();
+
+    return 0;
+}
+
+int sem_init_225(sem_t *sem, int pshared, unsigned int value)
+{
+    NON_NULL(next_sem_init);
+
+    /**
+     * see sem_init docs:
+     *
+     * > If  pshared  has  the  value  0,  then the semaphore is shared between the
+     * > threads of a process, and should be located at some address that is visible
+     * > to all threads (e.g., a global variable, or a variable allocated
+     * > dynamically on the heap).
+     */
+    int ret = next_sem_init(sem, pshared, value);
+    if (ret != 0) return ret;
+
+    libidle_lock_state_mutex();
+
+    // register semaphore in SemaphoreInfo table
+    // the counts of a semaphore that other members can post or wait on must be in the domain
+    DomainSemaphore *shared = pshared && state.domain ? libidle_domain_semaphore(sem, value) : NULL;
+    libidle_register_sem(sem, false, value, shared);
+
+    libidle_unlock_state_mutex();
+
+    return 0;
+}
+
+int sem_destroy_225(sem_t *sem)
+{
+    NON_NULL(next_sem_destroy);
+
+    libidle_lock_state_mutex();
+
+    // should assert we actually removed something rn... meh
+    SemaphoreInfo *sem_info = ptrmap_remove(&state.sem_info, sem);
+    if (sem_info && sem_info->shared) atomic_store(&sem_info->shared->key, 0);
+    if (sem_info) slab_free(&state.sem_info_slab, sem_info);
+
+    libidle_unlock_state_mutex();
+
+    return next_sem_destroy(sem);
+}
+
+int sem_post_225(sem_t *sem)
+{
+    NON_NULL(next_sem_post);
+
+    SemaphoreInfo *sem_info = libidle_find_sem_info(sem);
+
+    assert(sem_info);
+    SHARED_STAT_ADD(sem_info->stats.posts, 1);
+    sem_info_add_pending(sem_info, 1);
+    libidle_trace(find_thread_info(), LIBIDLE_TRACE_SEM_POST, LIBIDLE_TRACE_NONE, (uintptr_t) sem);
+
+    return next_sem_post(sem);
+}
+
+/**
+ * Blocks on some object until it has a token for us, or until abs_timeout (if not NULL) on clock has passed.
+ * Returns 0 if a token was taken, -1 with errno like sem_timedwait otherwise.
+ */
+typedef int (*WaitFunction)(void *object, const struct timespec *abs_timeout, clockid_t clock);
+
+static int libidle_tracked_wait(SemaphoreInfo *sem_info, enum LibidleTraceOp op, WaitFunction wait, void *object,
+    const struct timespec *abs_timeout, clockid_t clock);
+
+static bool timespec_before(struct timespec a, struct timespec b)
+{
+    return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+// shortest and longest re-wait once a wait has timed out early, see libidle_rewait_interval
+#define REWAIT_BACKOFF_MIN_NS 1000000
+#define REWAIT_BACKOFF_MAX_NS 100000000
+
+/**
+ * When a wait on abs_timeout has returned, find out if the timeout has really passed on clock, as we see it.
+ * Under faketime, the clock the wait ran on and the clock we see can disagree, so the wait can end early.
+ * Returns false if the timeout has passed. Otherwise, interval is how long to wait again in real time:
+ * the time remaining on clock, but at least *backoff, which grows with every early return (from 0,
+ * for the first wait), so a fake clock that runs slow or stands still can't make us spin.
+ */
+static bool libidle_rewait_interval(const struct timespec *abs_timeout, clockid_t clock, uint64_t *backoff,
+    struct timespec *interval)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    if (!timespec_before(now, *abs_timeout)) return false;
+
+    uint64_t remaining = timespec_ns(*abs_timeout) - timespec_ns(now);
+    if (remaining < *backoff) remaining = *backoff;
+    *interval = (struct timespec) { .tv_sec = remaining / 1000000000, .tv_nsec = remaining % 1000000000 };
+
+    *backoff = *backoff == 0 ? REWAIT_BACKOFF_MIN_NS : *backoff * 2;
+    if (*backoff > REWAIT_BACKOFF_MAX_NS) *backoff = REWAIT_BACKOFF_MAX_NS;
+    return true;
+}
+
+static int libidle_posix_sem_wait(void *object, const struct timespec *abs_timeout, clockid_t clock)
+{
+    sem_t *sem = object;
+    if (!abs_timeout)
+    {
+        return next_sem_wait(sem);
+    }
+    // sem_timedwait is on CLOCK_REALTIME; for sem_clockwait, glibc has the real one
+    int ret = clock != CLOCK_REALTIME && next_sem_clockwait
+        ? next_sem_clockwait(sem, clock, abs_timeout)
+        : next_sem_timedwait(sem, abs_timeout);
+
+    // we compensate for issues with faketime by manually checking the clock,
+    // then waiting for the rest of the time on the kernel's own clock, which is what the wait really runs on.
+    uint64_t backoff = REWAIT_BACKOFF_MIN_NS;
+    struct timespec interval;
+    while (ret == -1 && errno == ETIMEDOUT && libidle_rewait_interval(abs_timeout, clock, &backoff, &interval))
+    {
+        // the syscall, since faketime doesn't get to fake it
+        struct timespec kernel_now;
+        clockid_t kernel_clock = next_sem_clockwait ? CLOCK_MONOTONIC : CLOCK_REALTIME;
+        next_syscall(SYS_clock_gettime, kernel_clock, &kernel_now);
+        uint64_t until = timespec_ns(kernel_now) + timespec_ns(interval);
+        struct timespec kernel_timeout = { .tv_sec = until / 1000000000, .tv_nsec = until % 1000000000 };
+
+        ret = next_sem_clockwait
+            ? next_sem_clockwait(sem, kernel_clock, &kernel_timeout)
+            : next_sem_timedwait(sem, &kernel_timeout);
+    }
+    return ret;
+}
+
+static int libidle_sem_wait(sem_t *sem, const struct timespec *abs_timeout, const clockid_t clock)
+{
+    NON_NULL(next_sem_wait);
+    NON_NULL(next_sem_timedwait);
+
+    ThreadInfo *thr_info = find_thread_info();
+    assert(thr_info);
+
+    if (thr_info->in_call)
+    {
+        // see libidle_tracked_wait. don't even look up the semaphore.
+        return libidle_posix_sem_wait(sem, abs_timeout, clock);
+    }
+
+    SemaphoreInfo *sem_info = libidle_find_sem_info(sem);
+    assert(sem_info);
+
+    SHARED_STAT_ADD(sem_info->stats.waits, 1);
+    if (sem_info_counts(sem_info).blocked_waiters > 0) SHARED_STAT_ADD(sem_info->stats.contended, 1);
+
+    if (sem_info->named_semaphore)
+    {
+        // doesn't count as blocked: it gets external wakeups
+        int ret;
+        do ret = libidle_posix_sem_wait(sem, abs_timeout, clock);
+        while (ret == -1 && errno == EINTR);
+        return ret;
+    }
+
+    return libidle_tracked_wait(sem_info, LIBIDLE_TRACE_SEM_WAIT, libidle_posix_sem_wait, sem, abs_timeout, clock);
+}
+
+/**
+ * When we signal a semaphore, we don't know which sleeping semaphore will wake up.
+ * Because of this, we must track additionally the number of *pending* wakeups.
+ * The goal of this is to bridge the gap between the signalling thread going
+ * idle and the sleeping thread waking up.
+ * This is incremented in sem_post.
+ * Conversely, sem_wait decrements.
+ */
+int sem_wait_225(sem_t *sem)
+{
+    return libidle_sem_wait(sem, NULL, 0);
+}
+
+int sem_timedwait_225(sem_t *sem, const struct timespec *abs_timeout)
+{
+    // "The timeout shall be based on the CLOCK_REALTIME clock."
+    // -- POSIX spec, sem_timedwait
+    return libidle_sem_wait(sem, abs_timeout, CLOCK_REALTIME);
+}
+
+// glibc 2.30: sem_timedwait on a clock of the caller's choice
+static int libidle_sem_clockwait(sem_t *sem, clockid_t clock, const struct timespec *abs_timeout)
+{
+    if (clock != CLOCK_MONOTONIC && clock != CLOCK_REALTIME)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return libidle_sem_wait(sem, abs_timeout, clock);
+}
+
+int sem_clockwait_230(sem_t *sem, clockid_t clock, const struct timespec *abs_timeout)
+{
+    return libidle_sem_clockwait(sem, clock, abs_timeout);
+}
+
+int sem_clockwait_234(sem_t *sem, clockid_t clock, const struct timespec *abs_timeout)
+{
+    return libidle_sem_clockwait(sem, clock, abs_timeout);
+}
+
+/**
+ * Wait for a token, accounting for this thread as sleeping on sem_info in the meantime.
+ * This is the core of every wait on something that we know the pending wakeups of.
+ */
+static int libidle_tracked_wait(SemaphoreInfo *sem_info, enum LibidleTraceOp op, WaitFunction wait, void *object,
+    const struct timespec *abs_timeout, clockid_t clock)
+{
+    ThreadInfo *thr_info = find_thread_info();
+    assert(thr_info);
+
+    if (thr_info->in_call)
+    {
+        /**
+         * There's already a call going on.
+         * This means we're being called from a signal handler, like the D GC handler.
+         * Signal handlers should not participate in libidle operation, since they
+         * are not part of the normal thread behavior.
+         * So just ignore this one. sem_post may indicate pending wakeups, but we don't
+         * need to consider them.
+         */
+        return wait(object, abs_timeout, clock);
+    }
+
+    thr_info->in_call = true;
+    thr_info->waiting_semaphore = sem_info;
+    // before we can go idle, so the deadline is published with the transition
+    if (abs_timeout) libidle_add_deadline(thr_info, libidle_deadline(abs_timeout, clock));
+
+    entering_blocked_op(op, (uintptr_t) object);
+
+    int ret;
+
+    // EINTR == interrupted by a system call, just retry with the same parameters
+    do
+    {
+        ret = wait(object, abs_timeout, clock);
+    }
+    while (ret == -1 && errno == EINTR);
+
+    /**
+     * order matters here!
+     * - unblock the op
+     * - unlink the semaphore
+     * - then decrement the wakeups.
+     * the point is that we must enter a known state of wakefulness before we
+     * untrack the semaphore. otherwise, libidle may miss the thread having woken.
+     */
+    int wait_errno = errno;
+
+    left_blocked_op(op, (uintptr_t) object);
+
+    // thr_info and sem_info are stable: the semaphore cannot be destroyed while we're waiting on it
+    thr_info->waiting_semaphore = NULL;
+    threadinfo_update_accounting(thr_info);
+    libidle_remove_deadline(thr_info);
+    // a timeout or error didn't consume a token, so the wakeup is still pending for someone else
+    if (ret == 0)
+    {
+        sem_info_add_pending(sem_info, -1);
+    }
+    thr_info->in_call = false;
+
+    errno = wait_errno;
+    return ret;
+}
+
+// release n tokens on IN at once, with one bookkeeping step and at most one syscall
+static void libidle_cond_frame_post(ConditionFrame *frame, int n)
+{
+    // pending first, so we never look idle with a token on the way
+    sem_info_add_pending(&frame->sem_info, n);
+    atomic_fetch_add(&frame->in, n);
+    futex((uint32_t *) &frame->in, FUTEX_WAKE_PRIVATE, n, NULL);
+}
+
+// WaitFunction for IN
+static int libidle_cond_frame_wait(void *object, const struct timespec *abs_timeout, clockid_t clock)
+{
+    ConditionFrame *frame = object;
+    // the first wait is for exactly the remaining time
+    uint64_t backoff = 0;
+    while (true)
+    {
+        uint32_t tokens = atomic_load(&frame->in);
+        if (tokens > 0)
+        {
+            if (atomic_compare_exchange_weak(&frame->in, &tokens, tokens - 1)) return 0;
+            continue;
+        }
+        struct timespec relative, *timeout = NULL;
+        if (abs_timeout)
+        {
+            // the futex timeout is relative, and measuring it ourselves keeps us in line with faketime.
+            if (!libidle_rewait_interval(abs_timeout, clock, &backoff, &relative))
+            {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            timeout = &relative;
+        }
+        // woken, timed out, interrupted or raced: either way, look again
+        futex((uint32_t *) &frame->in, FUTEX_WAIT_PRIVATE, 0, timeout);
+    }
+}
+
+static int libidle_cond_frame_take(ConditionFrame *frame, const struct timespec *abs_timeout, clockid_t clock)
+{
+    return libidle_tracked_wait(&frame->sem_info, LIBIDLE_TRACE_COND_WAIT, libidle_cond_frame_wait, frame, abs_timeout, clock);
+}
+
+int pthread_cond_init_232(pthread_cond_t *restrict cond, const pthread_condattr_t *restrict attr)
+{
+    libidle_lock_state_mutex();
+    // printf("  register %p\n", cond);
+
+    clockid_t clock = CLOCK_REALTIME;
+    if (attr)
+    {
+        pthread_condattr_getclock(attr, &clock);
+    }
+
+    // reinitializing a condition is allowed once it's been destroyed, but be lenient if it wasn't
+    libidle_unregister_cond(cond);
+    // register condition in ConditionInfo table
+    libidle_register_cond(cond, clock);
+
+    libidle_unlock_state_mutex();
+
+    return 0;
+}
+
+int pthread_cond_destroy_232(pthread_cond_t *cond)
+{
+    NON_NULL(next_pthread_cond_destroy);
+
+    libidle_lock_state_mutex();
+
+    // statically initialized conditions that were never waited on have no ConditionInfo
+    libidle_unregister_cond(cond);
+
+    libidle_unlock_state_mutex();
+
+    return next_pthread_cond_destroy(cond);
+}
+
+// wait on cond_info, with abstime (if not NULL) on clock
+static int libidle_cond_wait(ConditionInfo *cond_info, pthread_mutex_t *restrict mutex,
+    const struct timespec *restrict abstime, clockid_t clock)
+{
+    libidle_lock_mutex(&cond_info->mutex);
+
+    // printf("> sleep on %p: frame %p, %i\n", cond, cond_info->frame, !!abstime);
+
+    // under cond_info->mutex, like every other waiter, so contended is exact
+    SHARED_STAT_ADD(cond_info->stats.waits, 1);
+    if (atomic_load(&cond_info->sleeping_threads) > 0) SHARED_STAT_ADD(cond_info->stats.contended, 1);
+
+    ConditionFrame *frame = cond_info->frame;
+    frame->sleeping_threads++;
+    atomic_fetch_add(&cond_info->sleeping_threads, 1);
+
+    // mutex is locked here per condition semantics. however, we can safely release it at this
+    // point because we hold cond_info->mutex, which any rotating broadcast has to take,
+    // and we've already counted ourselves for the ones that don't.
+    pthread_mutex_unlock(mutex);
+
+    libidle_unlock_mutex(&cond_info->mutex); // all state modifications are done.
+
+    int ret;
+    if (abstime)
+    {
+        ret = libidle_cond_frame_take(frame, abstime, clock);
+        if (ret == -1 && errno == ETIMEDOUT)
+        {
+            // printf("! ! ! timeout case\n");
+            libidle_lock_mutex(&cond_info->mutex);
+            if (frame->signaled)
+            {
+                // printf("? ? ? already signaled\n");
+                // consume our semaphore (will always succeed)
+                // this situation happens if the condition was signaled after the timeout,
+                // but before we got the lock - for instance, if it timed out while _broadcast held the lock.
+                // In that case, _broadcast will not see our reduction in sleeping_threads,
+                // so it has posted a token for us and counted us as a reference.
+                libidle_cond_frame_take(frame, NULL, 0);
+                libidle_unlock_mutex(&cond_info->mutex);
+                libidle_release_cond_frame(frame);
+            }
+            else
+            {
+                // pthread_cond_signal may have posted a token for every thread still on the frame, us included.
+                // (Threads that took theirs already are waiting for our lock.) Take the wakeup then:
+                // leaving without it could lose a signal meant for us.
+                bool woken = frame->tokens > 0 && frame->tokens >= frame->sleeping_threads;
+                if (woken)
+                {
+                    libidle_cond_frame_take(frame, NULL, 0);
+                    frame->tokens--;
+                }
+                libidle_sleeper_left_cond_frame(cond_info, frame);
+                libidle_unlock_mutex(&cond_info->mutex);
+
+                if (woken)
+                {
+                    pthread_mutex_lock(mutex);
+                    return 0;
+                }
+            }
+
+            pthread_mutex_lock(mutex);
+
+            // pthread_cond_timedwait reports errors differently from sem_timedwait
+            return ETIMEDOUT;
+        }
+    }
+    else
+    {
+        ret = libidle_cond_frame_take(frame, NULL, 0);
+    }
+    assert(ret == 0);
+    // printf("cond waiter woke up.\n");
+    libidle_leave_cond_frame(cond_info, frame);
+
+    // grab the mutex back
+    pthread_mutex_lock(mutex);
+
+    return 0;
+}
+
+int pthread_cond_timedwait_232(pthread_cond_t *restrict cond, pthread_mutex_t *restrict mutex,
+    const struct timespec *restrict abstime)
+{
+    ConditionInfo *cond_info = libidle_find_cond_info(cond);
+    return libidle_cond_wait(cond_info, mutex, abstime, cond_info->clock);
+}
+
+int pthread_cond_wait_232(pthread_cond_t *restrict cond, pthread_mutex_t *restrict mutex)
+{
+    return pthread_cond_timedwait_232(cond, mutex, NULL);
+}
+
+// glibc 2.30: like pthread_cond_timedwait, but on a clock of the caller's choice instead of the condition's
+static int libidle_cond_clockwait(pthread_cond_t *restrict cond, pthread_mutex_t *restrict mutex,
+    clockid_t clock, const struct timespec *restrict abstime)
+{
+    if (clock != CLOCK_MONOTONIC && clock != CLOCK_REALTIME) return EINVAL;
+
+    return libidle_cond_wait(libidle_find_cond_info(cond), mutex, abstime, clock);
+}
+
+int pthread_cond_clockwait_230(pthread_cond_t *restrict cond, pthread_mutex_t *restrict mutex,
+    clockid_t clock, const struct timespec *restrict abstime)
+{
+    return libidle_cond_clockwait(cond, mutex, clock, abstime);
+}
+
+int pthread_cond_clockwait_234(pthread_cond_t *restrict cond, pthread_mutex_t *restrict mutex,
+    clockid_t clock, const struct timespec *restrict abstime)
+{
+    return libidle_cond_clockwait(cond, mutex, clock, abstime);
+}
+
+// wake every thread sleeping on the condition
+static void libidle_cond_broadcast(ConditionInfo *cond_info)
+{
+    // nobody to wake up: the common case for producers that signal on every enqueue.
+    if (atomic_load(&cond_info->sleeping_threads) == 0)
+    {
+        return;
+    }
+
+    libidle_lock_mutex(&cond_info->mutex);
+
+    // printf("> broadcast to %i (%p)\n", cond_info->sleeping_threads, cond);
+
+    if (atomic_load(&cond_info->sleeping_threads) == 0)
+    {
+        // they timed out while we were getting the lock
+        libidle_unlock_mutex(&cond_info->mutex);
+        return;
+    }
+
+    // take out every frame, and create a new "cond_wait/cond_signal group".
+    ConditionFrame *frame = cond_info->oldest_frame;
+    cond_info->frame = cond_info->oldest_frame = libidle_get_cond_frame();
+    atomic_store(&cond_info->sleeping_threads, 0);
+
+    while (frame)
+    {
+        // once the tokens are out, the frame may be recycled at any moment.
+        ConditionFrame *next = frame->next;
+        int were_sleeping = frame->sleeping_threads;
+
+        if (were_sleeping == 0)
+        {
+            // only the current frame can be empty
+            libidle_put_cond_frame(frame);
+            frame = next;
+            continue;
+        }
+
+        // must be set before the first token goes out: its consumer may drop its reference right away.
+        atomic_store(&frame->refs, were_sleeping);
+        __atomic_store_n(&frame->signaled, true, __ATOMIC_RELEASE);
+
+        // printf("> distribute tokens\n");
+        // threads that pthread_cond_signal already posted a token for only need their reference.
+        libidle_cond_frame_post(frame, were_sleeping - frame->tokens);
+        frame = next;
+    }
+    libidle_unlock_mutex(&cond_info->mutex); // done with state mutation
+
+    // the frames now belong to the woken threads; the last one to leave each recycles it.
+}
+
+int pthread_cond_broadcast_232(pthread_cond_t *cond)
+{
+    ConditionInfo *cond_info = libidle_find_cond_info(cond);
+    ThreadInfo *thr_info = find_thread_info();
+
+    assert(thr_info);
+
+    SHARED_STAT_ADD(cond_info->stats.broadcasts, 1);
+    libidle_cond_broadcast(cond_info);
+    return 0;
+}
+
+int pthread_cond_signal_232(pthread_cond_t *cond)
+{
+    ConditionInfo *cond_info = libidle_find_cond_info(cond);
+
+    SHARED_STAT_ADD(cond_info->stats.posts, 1);
+    if (!state.cond_signal_one)
+    {
+        // allowed under condition semantics!
+        libidle_cond_broadcast(cond_info);
+        return 0;
+    }
+
+    if (atomic_load(&cond_info->sleeping_threads) == 0)
+    {
+        return 0;
+    }
+
+    libidle_lock_mutex(&cond_info->mutex);
+
+    // wake the longest-sleeping thread that has no token coming yet.
+    // if every sleeper already has one, one of them waking up satisfies us too.
+    ConditionFrame *frame = cond_info->oldest_frame;
+    while (frame && frame->sleeping_threads <= frame->tokens) frame = frame->next;
+
+    if (frame)
+    {
+        if (frame == cond_info->frame)
+        {
+            // close the frame, so that the token can't go to a thread that starts sleeping after us.
+            cond_info->frame = frame->next = libidle_get_cond_frame();
+        }
+        frame->tokens++;
+        libidle_cond_frame_post(frame, 1);
+    }
+
+    libidle_unlock_mutex(&cond_info->mutex);
+
+    return 0;
+}
+
+/**
+ * File descriptors
+ */
+
+// call with the state mutex locked
+static ChannelInfo *libidle_new_channel(bool counter, int pending)
+{
+    ChannelInfo *channel = slab_alloc(&state.channel_slab);
+    channel->counter = counter;
+    atomic_init(&channel->sem_info.counts, sem_counts_pack((SemaphoreCounts) { .pending_wakeups = pending }));
+    return channel;
+}
+
+// call with the state mutex locked
+static void libidle_put_channel(ChannelInfo *channel)
+{
+    if (channel && --channel->refs == 0) slab_free(&state.channel_slab, channel);
+}
+
+/**
+ * Change the pending units of a channel, keeping them within 0 and INT_MAX:
+ * the other end may also be written to or read from outside the process, or not at all.
+ */
+static void channel_add_pending(ChannelInfo *channel, long delta)
+{
+    if (delta == 0) return;
+
+    uint64_t old_word = atomic_load(&channel->sem_info.counts);
+    SemaphoreCounts old_counts, new_counts;
+    do
+    {
+        old_counts = new_counts = sem_counts_unpack(old_word);
+        long pending = (long) old_counts.pending_wakeups + delta;
+        new_counts.pending_wakeups = pending < 0 ? 0 : pending > INT_MAX ? INT_MAX : pending;
+    }
+    while (!atomic_compare_exchange_weak(&channel->sem_info.counts, &old_word, sem_counts_pack(new_counts)));
+
+    active_threads_add(sem_counts_active(new_counts) - sem_counts_active(old_counts));
+}
+
+// the units that len bytes of data transfer through the channel
+static long channel_units(ChannelInfo *channel, const struct iovec *iov, int iovcnt, ssize_t len)
+{
+    if (len <= 0) return 0;
+    if (!channel->counter) return len;
+
+    // an eventfd transfers one uint64_t
+    uint64_t value;
+    size_t copied = 0;
+    for (int i = 0; i < iovcnt && copied < sizeof(value); i++)
+    {
+        size_t n = iov[i].iov_len < sizeof(value) - copied ? iov[i].iov_len : sizeof(value) - copied;
+        memcpy((char *) &value + copied, iov[i].iov_base, n);
+        copied += n;
+    }
+    if (copied < sizeof(value)) return 0;
+    return value > INT_MAX ? INT_MAX : (long) value;
+}
+
+/**
+ * Find the record of an fd.
+ * Like every PtrMap lookup, this can miss an fd while another one is being removed; since fds
+ * are removed rarely, we detect that with a counter instead of confirming every miss with the lock.
+ */
+static FdInfo *libidle_find_fd_info(int fd)
+{
+    // nobody made a channel yet
+    if (!atomic_load_explicit(&state.fd_info.table, memory_order_acquire)) return NULL;
+
+    unsigned removals = atomic_load(&state.fd_info_removals);
+    FdInfo *fd_info = ptrmap_find(&state.fd_info, FD_KEY(fd));
+    if (fd_info || (removals % 2 == 0 && atomic_load(&state.fd_info_removals) == removals)) return fd_info;
+
     libidle_lock_state_mutex();
+    fd_info = ptrmap_find(&state.fd_info, FD_KEY(fd));
+    libidle_unlock_state_mutex();
+    return fd_info;
+}
+
+static ChannelInfo *libidle_fd_in(int fd)
+{
+    FdInfo *fd_info = libidle_find_fd_info(fd);
+    return fd_info ? fd_info->in : NULL;
+}
+
+static ChannelInfo *libidle_fd_out(int fd)
+{
+    FdInfo *fd_info = libidle_find_fd_info(fd);
+    return fd_info ? fd_info->out : NULL;
+}
+
+// call with the state mutex locked
+static void libidle_forget_fd_locked(int fd)
+{
+    atomic_fetch_add(&state.fd_info_removals, 1);
+    FdInfo *fd_info = ptrmap_remove(&state.fd_info, FD_KEY(fd));
+    atomic_fetch_add(&state.fd_info_removals, 1);
+    if (!fd_info) return;
+
+    if (fd_info->in)
+    {
+        // nobody can read the pending units anymore (as far as we know)
+        channel_add_pending(fd_info->in, -(long) INT_MAX);
+    }
+    libidle_put_channel(fd_info->in);
+    libidle_put_channel(fd_info->out);
+    for (size_t i = 0; i < fd_info->watches_len; i++) libidle_put_channel(fd_info->watches_ptr[i].channel);
+    free(fd_info->watches_ptr);
+    slab_free(&state.fd_info_slab, fd_info);
+}
 
-    // register semaphore in SemaphoreInfo list
-    PUSH(state.sem_info) = (SemaphoreInfo) { .sem = ret, .named_semaphore = true };
+// the fd is about to be closed or replaced
+static void libidle_forget_fd(int fd)
+{
+    if (fd >= 0 && fd < FD_KINDS) atomic_store_explicit(&state.fd_kinds[fd], FD_KIND_UNKNOWN, memory_order_relaxed);
+    // only our own fds have a record, and nobody can register one for this fd number while it's open
+    if (!libidle_find_fd_info(fd)) return;
 
+    libidle_lock_state_mutex();
+    libidle_forget_fd_locked(fd);
     libidle_unlock_state_mutex();
+}
 
-    return 0;
+// call with the state mutex locked
+static FdInfo *libidle_register_fd(int fd, ChannelInfo *in, ChannelInfo *out)
+{
+    // we may have missed the close of a previous fd with this number
+    libidle_forget_fd_locked(fd);
+
+    FdInfo *fd_info = slab_alloc(&state.fd_info_slab);
+    fd_info->in = in;
+    fd_info->out = out;
+    if (in) in->refs++;
+    if (out) out->refs++;
+    ptrmap_insert(&state.fd_info, fd_info, FD_KEY(fd));
+    return fd_info;
 }
 
-int sem_init_225(sem_t *sem, int pshared, unsigned int value)
+// call with the state mutex locked
+static void libidle_watch_channel(ThreadInfo *thr_info, ChannelInfo *channel)
 {
-    NON_NULL(next_sem_init);
+    if (!channel) return;
+    channel->refs++;
+    PUSH(thr_info->waiting_channels) = channel;
+}
 
-    /**
-     * see sem_init docs:
-     *
-     * > If  pshared  has  the  value  0,  then the semaphore is shared between the
-     * > threads of a process, and should be located at some address that is visible
-     * > to all threads (e.g., a global variable, or a variable allocated
-     * > dynamically on the heap).
-     */
-    int ret = next_sem_init(sem, pshared, value);
+// whether a read on fd can wait at all; channel is what the fd reads from, if it's one of ours
+static bool libidle_fd_may_block(int fd, ChannelInfo *channel)
+{
+    if (channel || fd < 0 || fd >= FD_KINDS) return true;
+
+    enum FdKind kind = atomic_load_explicit(&state.fd_kinds[fd], memory_order_relaxed);
+    if (kind == FD_KIND_UNKNOWN)
+    {
+        struct stat st;
+        // a bad fd fails the read anyway
+        if (fstat(fd, &st) == -1) return false;
+        kind = S_ISSOCK(st.st_mode) || S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode) ? FD_KIND_MAY_BLOCK : FD_KIND_READY;
+        atomic_store_explicit(&state.fd_kinds[fd], kind, memory_order_relaxed);
+    }
+    return kind == FD_KIND_MAY_BLOCK;
+}
+
+/**
+ * Whether reading from fd would block: nothing to read right now, and the fd is in blocking mode.
+ * If data is ready, we never look idle in the call. Only worth asking if libidle_fd_may_block.
+ * A channel with pending units keeps us busy while we wait on it anyway, so it's entered without a syscall;
+ * anything else costs a poll, and a fcntl if nothing is ready.
+ */
+static bool libidle_read_would_block(int fd, ChannelInfo *channel)
+{
+    if (channel && sem_counts_unpack(atomic_load(&channel->sem_info.counts)).pending_wakeups > 0) return true;
+
+    struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+    if (next_poll(&pollfd, 1, 0) != 0) return false;
+    int flags = fcntl(fd, F_GETFL);
+    return flags != -1 && !(flags & O_NONBLOCK);
+}
+
+/**
+ * Enter a wait that isn't on a semaphore: on the thread's waiting_channels (collected beforehand),
+ * if any, or else on an external event or just the time.
+ * deadline is when the wait times out (see libidle_add_deadline), or 0.
+ */
+static void libidle_wait_enter(ThreadInfo *thr_info, enum LibidleTraceOp op, uint64_t object, uint64_t deadline)
+{
+    thr_info->in_call = true;
+    libidle_add_deadline(thr_info, deadline);
+    entering_blocked_op(op, object);
+}
+
+// after left_blocked_op: we're active again, so our channels don't need to count us anymore, nor our deadline
+static void libidle_unwatch_channels(ThreadInfo *thr_info)
+{
+    libidle_lock_state_mutex();
+    for (size_t i = 0; i < thr_info->waiting_channels_len; i++) libidle_put_channel(thr_info->waiting_channels_ptr[i]);
+    thr_info->waiting_channels_len = 0;
+    libidle_unlock_state_mutex();
+    threadinfo_update_accounting(thr_info);
+    libidle_remove_deadline(thr_info);
+    thr_info->in_call = false;
+}
+
+static void libidle_wait_leave(ThreadInfo *thr_info, enum LibidleTraceOp op, uint64_t object)
+{
+    int wait_errno = errno;
+    left_blocked_op(op, object);
+    libidle_unwatch_channels(thr_info);
+    errno = wait_errno;
+}
+
+/**
+ * Common part of the read calls, before the call.
+ * Returns the channel the fd reads from, if any. *blocking says if we entered a blocked op.
+ */
+static ChannelInfo *libidle_read_enter(int fd, bool dontwait, enum LibidleTraceOp op, bool *blocking)
+{
+    ChannelInfo *channel = libidle_fd_in(fd);
+    ThreadInfo *thr_info = find_thread_info();
+
+    *blocking = thr_info && !thr_info->in_call && !dontwait
+        && libidle_fd_may_block(fd, channel) && libidle_read_would_block(fd, channel);
+    if (*blocking)
+    {
+        libidle_lock_state_mutex();
+        libidle_watch_channel(thr_info, channel);
+        libidle_unlock_state_mutex();
+        libidle_wait_enter(thr_info, op, fd, 0);
+    }
+    return channel;
+}
+
+// after the call: consume what was read, unless it was only peeked at.
+static void libidle_read_leave(ChannelInfo *channel, bool blocking, enum LibidleTraceOp op, int fd,
+    const struct iovec *iov, int iovcnt, ssize_t ret, bool consume)
+{
+    int read_errno = errno;
+
+    // as with semaphores: become active, then consume the wakeup
+    if (blocking) left_blocked_op(op, fd);
+    if (channel && consume) channel_add_pending(channel, -channel_units(channel, iov, iovcnt, ret));
+    if (blocking) libidle_unwatch_channels(find_thread_info());
+
+    errno = read_errno;
+}
+
+// before a write call: the units are pending from before the data can be read
+static ChannelInfo *libidle_write_enter(int fd, const struct iovec *iov, int iovcnt, size_t len, long *units)
+{
+    ChannelInfo *channel = libidle_fd_out(fd);
+    if (!channel) return NULL;
+    *units = channel_units(channel, iov, iovcnt, len);
+    channel_add_pending(channel, *units);
+    return channel;
+}
+
+// after the call: take back what wasn't written
+static void libidle_write_leave(ChannelInfo *channel, const struct iovec *iov, int iovcnt, long units, ssize_t ret)
+{
+    if (!channel) return;
+    int write_errno = errno;
+    channel_add_pending(channel, channel_units(channel, iov, iovcnt, ret) - units);
+    errno = write_errno;
+}
+
+static size_t iov_len(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) len += iov[i].iov_len;
+    return len;
+}
+
+// the interposed functions may be called by other libraries' constructors before ours
+#define LIBIDLE_EARLY(next) do { if (!next) libidle_init(); NON_NULL(next); } while (false)
+
+int pipe(int pipefd[2])
+{
+    LIBIDLE_EARLY(next_pipe);
+    int ret = next_pipe(pipefd);
+    if (ret == 0)
+    {
+        libidle_lock_state_mutex();
+        ChannelInfo *channel = libidle_new_channel(false, 0);
+        libidle_register_fd(pipefd[0], channel, NULL);
+        libidle_register_fd(pipefd[1], NULL, channel);
+        libidle_unlock_state_mutex();
+    }
+    return ret;
+}
+
+int pipe2(int pipefd[2], int flags)
+{
+    LIBIDLE_EARLY(next_pipe2);
+    int ret = next_pipe2(pipefd, flags);
+    if (ret == 0)
+    {
+        libidle_lock_state_mutex();
+        ChannelInfo *channel = libidle_new_channel(false, 0);
+        libidle_register_fd(pipefd[0], channel, NULL);
+        libidle_register_fd(pipefd[1], NULL, channel);
+        libidle_unlock_state_mutex();
+    }
+    return ret;
+}
+
+int eventfd(unsigned int initval, int flags)
+{
+    LIBIDLE_EARLY(next_eventfd);
+    int fd = next_eventfd(initval, flags);
+    if (fd != -1)
+    {
+        libidle_lock_state_mutex();
+        ChannelInfo *channel = libidle_new_channel(true, initval > INT_MAX ? INT_MAX : (int) initval);
+        libidle_register_fd(fd, channel, channel);
+        libidle_unlock_state_mutex();
+    }
+    return fd;
+}
+
+int socketpair(int domain, int type, int protocol, int sv[2])
+{
+    LIBIDLE_EARLY(next_socketpair);
+    int ret = next_socketpair(domain, type, protocol, sv);
+    if (ret == 0)
+    {
+        // one channel per direction
+        libidle_lock_state_mutex();
+        ChannelInfo *to_first = libidle_new_channel(false, 0), *to_second = libidle_new_channel(false, 0);
+        libidle_register_fd(sv[0], to_first, to_second);
+        libidle_register_fd(sv[1], to_second, to_first);
+        libidle_unlock_state_mutex();
+    }
+    return ret;
+}
+
+int close(int fd)
+{
+    LIBIDLE_EARLY(next_close);
+    // before the fd number can be reused
+    libidle_forget_fd(fd);
+    return next_close(fd);
+}
+
+int dup2(int oldfd, int newfd)
+{
+    LIBIDLE_EARLY(next_dup2);
+    if (oldfd != newfd) libidle_forget_fd(newfd);
+    return next_dup2(oldfd, newfd);
+}
+
+int dup3(int oldfd, int newfd, int flags)
+{
+    LIBIDLE_EARLY(next_dup3);
+    libidle_forget_fd(newfd);
+    return next_dup3(oldfd, newfd, flags);
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    LIBIDLE_EARLY(next_read);
+    bool blocking;
+    ChannelInfo *channel = libidle_read_enter(fd, false, LIBIDLE_TRACE_READ, &blocking);
+    ssize_t ret = next_read(fd, buf, count);
+    struct iovec iov = { .iov_base = buf, .iov_len = count };
+    libidle_read_leave(channel, blocking, LIBIDLE_TRACE_READ, fd, &iov, 1, ret, true);
+    return ret;
+}
+
+ssize_t readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    LIBIDLE_EARLY(next_readv);
+    bool blocking;
+    ChannelInfo *channel = libidle_read_enter(fd, false, LIBIDLE_TRACE_READ, &blocking);
+    ssize_t ret = next_readv(fd, iov, iovcnt);
+    libidle_read_leave(channel, blocking, LIBIDLE_TRACE_READ, fd, iov, iovcnt, ret, true);
+    return ret;
+}
+
+ssize_t recv(int sockfd, void *buf, size_t len, int flags)
+{
+    LIBIDLE_EARLY(next_recv);
+    bool blocking;
+    ChannelInfo *channel = libidle_read_enter(sockfd, flags & MSG_DONTWAIT, LIBIDLE_TRACE_RECV, &blocking);
+    ssize_t ret = next_recv(sockfd, buf, len, flags);
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    libidle_read_leave(channel, blocking, LIBIDLE_TRACE_RECV, sockfd, &iov, 1, ret, !(flags & MSG_PEEK));
+    return ret;
+}
+
+ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags, struct sockaddr *src_addr, socklen_t *addrlen)
+{
+    LIBIDLE_EARLY(next_recvfrom);
+    bool blocking;
+    ChannelInfo *channel = libidle_read_enter(sockfd, flags & MSG_DONTWAIT, LIBIDLE_TRACE_RECV, &blocking);
+    ssize_t ret = next_recvfrom(sockfd, buf, len, flags, src_addr, addrlen);
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    libidle_read_leave(channel, blocking, LIBIDLE_TRACE_RECV, sockfd, &iov, 1, ret, !(flags & MSG_PEEK));
+    return ret;
+}
+
+ssize_t recvmsg(int sockfd, struct msghdr *msg, int flags)
+{
+    LIBIDLE_EARLY(next_recvmsg);
+    bool blocking;
+    ChannelInfo *channel = libidle_read_enter(sockfd, flags & MSG_DONTWAIT, LIBIDLE_TRACE_RECV, &blocking);
+    ssize_t ret = next_recvmsg(sockfd, msg, flags);
+    libidle_read_leave(channel, blocking, LIBIDLE_TRACE_RECV, sockfd, msg->msg_iov, msg->msg_iovlen, ret,
+        !(flags & MSG_PEEK));
+    return ret;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+    LIBIDLE_EARLY(next_write);
+    struct iovec iov = { .iov_base = (void *) buf, .iov_len = count };
+    long units;
+    ChannelInfo *channel = libidle_write_enter(fd, &iov, 1, count, &units);
+    ssize_t ret = next_write(fd, buf, count);
+    libidle_write_leave(channel, &iov, 1, units, ret);
+    return ret;
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    LIBIDLE_EARLY(next_writev);
+    long units;
+    ChannelInfo *channel = libidle_write_enter(fd, iov, iovcnt, iov_len(iov, iovcnt), &units);
+    ssize_t ret = next_writev(fd, iov, iovcnt);
+    libidle_write_leave(channel, iov, iovcnt, units, ret);
+    return ret;
+}
+
+ssize_t send(int sockfd, const void *buf, size_t len, int flags)
+{
+    LIBIDLE_EARLY(next_send);
+    struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+    long units;
+    ChannelInfo *channel = libidle_write_enter(sockfd, &iov, 1, len, &units);
+    ssize_t ret = next_send(sockfd, buf, len, flags);
+    libidle_write_leave(channel, &iov, 1, units, ret);
+    return ret;
+}
+
+ssize_t sendto(int sockfd, const void *buf, size_t len, int flags, const struct sockaddr *dest_addr, socklen_t addrlen)
+{
+    LIBIDLE_EARLY(next_sendto);
+    struct iovec iov = { .iov_base = (void *) buf, .iov_len = len };
+    long units;
+    ChannelInfo *channel = libidle_write_enter(sockfd, &iov, 1, len, &units);
+    ssize_t ret = next_sendto(sockfd, buf, len, flags, dest_addr, addrlen);
+    libidle_write_leave(channel, &iov, 1, units, ret);
+    return ret;
+}
+
+ssize_t sendmsg(int sockfd, const struct msghdr *msg, int flags)
+{
+    LIBIDLE_EARLY(next_sendmsg);
+    long units;
+    ChannelInfo *channel = libidle_write_enter(sockfd, msg->msg_iov, msg->msg_iovlen,
+        iov_len(msg->msg_iov, msg->msg_iovlen), &units);
+    ssize_t ret = next_sendmsg(sockfd, msg, flags);
+    libidle_write_leave(channel, msg->msg_iov, msg->msg_iovlen, units, ret);
+    return ret;
+}
+
+// glibc's versions call read and write internally, bypassing us
+int eventfd_read(int fd, eventfd_t *value)
+{
+    return read(fd, value, sizeof(eventfd_t)) == sizeof(eventfd_t) ? 0 : -1;
+}
+
+int eventfd_write(int fd, eventfd_t value)
+{
+    return write(fd, &value, sizeof(eventfd_t)) == sizeof(eventfd_t) ? 0 : -1;
+}
+
+// deadlines of the relative timeouts of poll-like calls
+static uint64_t timeout_ms_deadline(int timeout)
+{
+    return timeout < 0 ? 0 : monotonic_ns() + (uint64_t) timeout * 1000000;
+}
+
+static uint64_t timespec_deadline(const struct timespec *timeout)
+{
+    return timeout ? monotonic_ns() + timespec_ns(*timeout) : 0;
+}
+
+#define POLL_READ_EVENTS (POLLIN | POLLPRI | POLLRDNORM | POLLRDBAND)
+
+// call with the state mutex locked
+static void libidle_watch_pollfds(ThreadInfo *thr_info, struct pollfd *fds, nfds_t nfds)
+{
+    for (nfds_t i = 0; i < nfds; i++)
+    {
+        if (fds[i].events & POLL_READ_EVENTS) libidle_watch_channel(thr_info, libidle_fd_in(fds[i].fd));
+    }
+}
+
+/**
+ * The poll-like calls first check without a timeout: if anything is ready, we return that
+ * and never look idle. Otherwise, we wait for real, as a waiter on the channels being read.
+ */
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    LIBIDLE_EARLY(next_poll);
+    ThreadInfo *thr_info = find_thread_info();
+    if (!thr_info || thr_info->in_call || timeout == 0) return next_poll(fds, nfds, timeout);
+
+    int ret = next_poll(fds, nfds, 0);
     if (ret != 0) return ret;
 
     libidle_lock_state_mutex();
+    libidle_watch_pollfds(thr_info, fds, nfds);
+    libidle_unlock_state_mutex();
+    libidle_wait_enter(thr_info, LIBIDLE_TRACE_POLL, nfds, timeout_ms_deadline(timeout));
+    ret = next_poll(fds, nfds, timeout);
+    libidle_wait_leave(thr_info, LIBIDLE_TRACE_POLL, nfds);
+    return ret;
+}
 
-    // register semaphore in SemaphoreInfo list
-    PUSH(state.sem_info) = (SemaphoreInfo) { .sem = sem, .pending_wakeups = value };
+int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout_ts, const sigset_t *sigmask)
+{
+    LIBIDLE_EARLY(next_ppoll);
+    ThreadInfo *thr_info = find_thread_info();
+    bool nowait = timeout_ts && timeout_ts->tv_sec == 0 && timeout_ts->tv_nsec == 0;
+    if (!thr_info || thr_info->in_call || nowait) return next_ppoll(fds, nfds, timeout_ts, sigmask);
+
+    int ret = next_ppoll(fds, nfds, &(struct timespec) { 0 }, sigmask);
+    if (ret != 0) return ret;
 
+    libidle_lock_state_mutex();
+    libidle_watch_pollfds(thr_info, fds, nfds);
     libidle_unlock_state_mutex();
+    libidle_wait_enter(thr_info, LIBIDLE_TRACE_POLL, nfds, timespec_deadline(timeout_ts));
+    ret = next_ppoll(fds, nfds, timeout_ts, sigmask);
+    libidle_wait_leave(thr_info, LIBIDLE_TRACE_POLL, nfds);
+    return ret;
+}
 
-    return 0;
+/**
+ * Check the fd sets of select without waiting.
+ * Returns the result of select, with the sets updated if anything was ready.
+ */
+static int libidle_select_now(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, const sigset_t *sigmask)
+{
+    fd_set sets[3];
+    fd_set *user_sets[3] = { readfds, writefds, exceptfds };
+    for (int i = 0; i < 3; i++) if (user_sets[i]) sets[i] = *user_sets[i];
+
+    int ret = next_pselect(nfds, readfds ? &sets[0] : NULL, writefds ? &sets[1] : NULL, exceptfds ? &sets[2] : NULL,
+        &(struct timespec) { 0 }, sigmask);
+    // on a timeout, the sets would come back empty; keep the user's for the real wait
+    if (ret > 0)
+    {
+        for (int i = 0; i < 3; i++) if (user_sets[i]) *user_sets[i] = sets[i];
+    }
+    return ret;
 }
 
-int sem_destroy_225(sem_t *sem)
+// call with the state mutex locked
+static void libidle_watch_fd_set(ThreadInfo *thr_info, int nfds, fd_set *readfds)
 {
-    NON_NULL(next_sem_destroy);
+    for (int fd = 0; readfds && fd < nfds; fd++)
+    {
+        if (FD_ISSET(fd, readfds)) libidle_watch_channel(thr_info, libidle_fd_in(fd));
+    }
+}
+
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout)
+{
+    LIBIDLE_EARLY(next_select);
+    NON_NULL(next_pselect);
+    ThreadInfo *thr_info = find_thread_info();
+    bool nowait = timeout && timeout->tv_sec == 0 && timeout->tv_usec == 0;
+    if (!thr_info || thr_info->in_call || nowait) return next_select(nfds, readfds, writefds, exceptfds, timeout);
+
+    int ret = libidle_select_now(nfds, readfds, writefds, exceptfds, NULL);
+    if (ret != 0) return ret;
+
+    libidle_lock_state_mutex();
+    libidle_watch_fd_set(thr_info, nfds, readfds);
+    libidle_unlock_state_mutex();
+    libidle_wait_enter(thr_info, LIBIDLE_TRACE_SELECT, nfds, timeout ? timespec_deadline(
+        &(struct timespec) { .tv_sec = timeout->tv_sec, .tv_nsec = timeout->tv_usec * 1000 }) : 0);
+    ret = next_select(nfds, readfds, writefds, exceptfds, timeout);
+    libidle_wait_leave(thr_info, LIBIDLE_TRACE_SELECT, nfds);
+    return ret;
+}
+
+int pselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+    const struct timespec *timeout, const sigset_t *sigmask)
+{
+    LIBIDLE_EARLY(next_pselect);
+    ThreadInfo *thr_info = find_thread_info();
+    bool nowait = timeout && timeout->tv_sec == 0 && timeout->tv_nsec == 0;
+    if (!thr_info || thr_info->in_call || nowait) return next_pselect(nfds, readfds, writefds, exceptfds, timeout, sigmask);
+
+    int ret = libidle_select_now(nfds, readfds, writefds, exceptfds, sigmask);
+    if (ret != 0) return ret;
 
     libidle_lock_state_mutex();
+    libidle_watch_fd_set(thr_info, nfds, readfds);
+    libidle_unlock_state_mutex();
+    libidle_wait_enter(thr_info, LIBIDLE_TRACE_SELECT, nfds, timespec_deadline(timeout));
+    ret = next_pselect(nfds, readfds, writefds, exceptfds, timeout, sigmask);
+    libidle_wait_leave(thr_info, LIBIDLE_TRACE_SELECT, nfds);
+    return ret;
+}
+
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event)
+{
+    LIBIDLE_EARLY(next_epoll_ctl);
+    int ret = next_epoll_ctl(epfd, op, fd, event);
+    if (ret == -1) return ret;
+
+    ChannelInfo *channel = libidle_fd_in(fd);
+    FdInfo *epoll_info = libidle_find_fd_info(epfd);
+    // only epoll fds that watch a channel need a record
+    if (!channel && !epoll_info) return ret;
 
-    // TODO iterate backwards- faster? more recently created sems are likely to be at the back
-    for (int i = 0; i < state.sem_info_len; i++)
+    libidle_lock_state_mutex();
+    if (!epoll_info) epoll_info = libidle_register_fd(epfd, NULL, NULL);
+    size_t i;
+    for (i = 0; i < epoll_info->watches_len && epoll_info->watches_ptr[i].fd != fd; i++) { }
+    if (i < epoll_info->watches_len)
     {
-        SemaphoreInfo *sem_info = &state.sem_info_ptr[i];
-        if (sem_info->sem == sem)
-        {
-            // swap with last entry and shrink
-            *sem_info = state.sem_info_ptr[state.sem_info_len - 1];
-            DROP(state.sem_info);
-            break;
-        }
+        // replaced or removed
+        libidle_put_channel(epoll_info->watches_ptr[i].channel);
+        epoll_info->watches_ptr[i] = epoll_info->watches_ptr[epoll_info->watches_len - 1];
+        DROP(epoll_info->watches);
+    }
+    if (channel && op != EPOLL_CTL_DEL && (event->events & (EPOLLIN | EPOLLPRI | EPOLLRDNORM | EPOLLRDBAND)))
+    {
+        channel->refs++;
+        PUSH(epoll_info->watches) = (EpollWatch) { .fd = fd, .channel = channel };
     }
-    // should assert we actually freed something rn... meh
-
     libidle_unlock_state_mutex();
+    return ret;
+}
 
-    return next_sem_destroy(sem);
+// call with the state mutex locked
+static void libidle_watch_epoll(ThreadInfo *thr_info, int epfd)
+{
+    FdInfo *epoll_info = libidle_find_fd_info(epfd);
+    for (size_t i = 0; epoll_info && i < epoll_info->watches_len; i++)
+    {
+        libidle_watch_channel(thr_info, epoll_info->watches_ptr[i].channel);
+    }
 }
 
-int sem_post_225(sem_t *sem)
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
 {
-    NON_NULL(next_sem_post);
+    LIBIDLE_EARLY(next_epoll_wait);
+    ThreadInfo *thr_info = find_thread_info();
+    if (!thr_info || thr_info->in_call || timeout == 0) return next_epoll_wait(epfd, events, maxevents, timeout);
+
+    int ret = next_epoll_wait(epfd, events, maxevents, 0);
+    if (ret != 0) return ret;
 
     libidle_lock_state_mutex();
+    libidle_watch_epoll(thr_info, epfd);
+    libidle_unlock_state_mutex();
+    libidle_wait_enter(thr_info, LIBIDLE_TRACE_EPOLL_WAIT, epfd, timeout_ms_deadline(timeout));
+    ret = next_epoll_wait(epfd, events, maxevents, timeout);
+    libidle_wait_leave(thr_info, LIBIDLE_TRACE_EPOLL_WAIT, epfd);
+    return ret;
+}
 
-    SemaphoreInfo *sem_info = libidle_find_sem_info(sem);
+int epoll_pwait(int epfd, struct epoll_event *events, int maxevents, int timeout, const sigset_t *sigmask)
+{
+    LIBIDLE_EARLY(next_epoll_pwait);
+    ThreadInfo *thr_info = find_thread_info();
+    if (!thr_info || thr_info->in_call || timeout == 0) return next_epoll_pwait(epfd, events, maxevents, timeout, sigmask);
 
-    assert(sem_info);
-    sem_info->pending_wakeups++;
+    int ret = next_epoll_pwait(epfd, events, maxevents, 0, sigmask);
+    if (ret != 0) return ret;
 
+    libidle_lock_state_mutex();
+    libidle_watch_epoll(thr_info, epfd);
     libidle_unlock_state_mutex();
+    libidle_wait_enter(thr_info, LIBIDLE_TRACE_EPOLL_WAIT, epfd, timeout_ms_deadline(timeout));
+    ret = next_epoll_pwait(epfd, events, maxevents, timeout, sigmask);
+    libidle_wait_leave(thr_info, LIBIDLE_TRACE_EPOLL_WAIT, epfd);
+    return ret;
+}
 
-    return next_sem_post(sem);
+/**
+ * Sleeps are waits on nothing but the time. By default they count as busy, as they always have:
+ * a sleeping thread will go on by itself. With LIBIDLE_SLEEP_IDLE=1, they count as idle, and
+ * their end is published as the deadline, so a harness that controls the clock (faketime)
+ * can skip ahead to it once the process is idle.
+ */
+static ThreadInfo *libidle_sleeping_thread()
+{
+    ThreadInfo *thr_info = find_thread_info();
+    return state.sleep_idle && thr_info && !thr_info->in_call ? thr_info : NULL;
 }
 
-static int libidle_sem_wait(bool timedwait, sem_t *sem, const struct timespec *abs_timeout, const clockid_t clock);
+static void libidle_mark_sleep(bool in_sleep)
+{
+    ThreadInfo *thr_info = find_thread_info();
+    if (thr_info) atomic_store_explicit(&thr_info->in_sleep, in_sleep, memory_order_relaxed);
+}
 
 /**
- * When we signal a semaphore, we don't know which sleeping semaphore will wake up.
- * Because of this, we must track additionally the number of *pending* wakeups.
- * The goal of this is to bridge the gap between the signalling thread going
- * idle and the sleeping thread waking up.
- * This is incremented in sem_post.
- * Conversely, sem_wait decrements.
+ * The sleeps themselves. The sampler skips threads that are in one, but it may have looked just before
+ * we got here; a sleep that its SIGPROF cut short goes on for the rest of its time.
+ * (That also swallows a signal of the program's own that arrives during the same sleep.)
  */
-int sem_wait_225(sem_t *sem)
+static int libidle_nanosleep(const struct timespec *req, struct timespec *rem)
 {
-    return libidle_sem_wait(false, sem, NULL, 0);
+    struct timespec left = *req, own_rem;
+    if (!rem) rem = &own_rem;
+    libidle_mark_sleep(true);
+    int ret;
+    while (true)
+    {
+        unsigned samples = samples_here;
+        ret = next_nanosleep(&left, rem);
+        if (ret == 0 || errno != EINTR || samples_here == samples) break;
+        left = *rem;
+    }
+    int sleep_errno = errno;
+    libidle_mark_sleep(false);
+    errno = sleep_errno;
+    return ret;
 }
 
-int sem_timedwait_225(sem_t *sem, const struct timespec *abs_timeout)
+static int libidle_clock_nanosleep(clockid_t clockid, int flags, const struct timespec *request, struct timespec *remain)
 {
-    // "The timeout shall be based on the CLOCK_REALTIME clock."
-    // -- POSIX spec, sem_timedwait
-    return libidle_sem_wait(true, sem, abs_timeout, CLOCK_REALTIME);
+    struct timespec left = *request, own_remain;
+    if (!remain) remain = &own_remain;
+    libidle_mark_sleep(true);
+    int ret;
+    while (true)
+    {
+        unsigned samples = samples_here;
+        // returns the error instead of setting errno
+        ret = next_clock_nanosleep(clockid, flags, &left, remain);
+        if (ret != EINTR || samples_here == samples) break;
+        if (!(flags & TIMER_ABSTIME)) left = *remain;
+    }
+    libidle_mark_sleep(false);
+    return ret;
 }
 
-static int libidle_sem_wait(bool timedwait, sem_t *sem, const struct timespec *abs_timeout, const clockid_t clock)
+int nanosleep(const struct timespec *req, struct timespec *rem)
 {
-    NON_NULL(next_sem_wait);
-    NON_NULL(next_sem_timedwait);
+    LIBIDLE_EARLY(next_nanosleep);
+    ThreadInfo *thr_info = libidle_sleeping_thread();
+    if (!thr_info) return libidle_nanosleep(req, rem);
+
+    uint64_t deadline = timespec_deadline(req);
+    libidle_wait_enter(thr_info, LIBIDLE_TRACE_SLEEP, deadline, deadline);
+    int ret = libidle_nanosleep(req, rem);
+    libidle_wait_leave(thr_info, LIBIDLE_TRACE_SLEEP, deadline);
+    return ret;
+}
 
-    libidle_lock_state_mutex();
+int clock_nanosleep(clockid_t clockid, int flags, const struct timespec *request, struct timespec *remain)
+{
+    LIBIDLE_EARLY(next_clock_nanosleep);
+    ThreadInfo *thr_info = libidle_sleeping_thread();
+    if (!thr_info) return libidle_clock_nanosleep(clockid, flags, request, remain);
+
+    uint64_t deadline = flags & TIMER_ABSTIME ? libidle_deadline(request, clockid) : timespec_deadline(request);
+    libidle_wait_enter(thr_info, LIBIDLE_TRACE_SLEEP, deadline, deadline);
+    int ret = libidle_clock_nanosleep(clockid, flags, request, remain);
+    libidle_wait_leave(thr_info, LIBIDLE_TRACE_SLEEP, deadline);
+    return ret;
+}
 
-    SemaphoreInfo *sem_info = libidle_find_sem_info(sem);
-    assert(sem_info);
+// glibc's sleep and usleep call nanosleep internally, bypassing us
+unsigned int sleep(unsigned int seconds)
+{
+    struct timespec remaining = { .tv_sec = seconds };
+    if (nanosleep(&remaining, &remaining) == 0) return 0;
+    return remaining.tv_sec + (remaining.tv_nsec > 0 ? 1 : 0);
+}
 
-    bool is_named_semaphore = sem_info->named_semaphore;
+int usleep(useconds_t usec)
+{
+    return nanosleep(&(struct timespec) { .tv_sec = usec / 1000000, .tv_nsec = (usec % 1000000) * 1000 }, NULL);
+}
 
-    ThreadInfo *thr_info = libidle_find_thr_info(pthread_self());
-    assert(thr_info);
+// the record of a futex word, created on first use if create is set
+static FutexInfo *libidle_futex_info(uint32_t *uaddr, bool create)
+{
+    // records are never removed, so a miss can only be a record that is being created
+    FutexInfo *futex_info = ptrmap_find(&state.futex_info, uaddr);
+    if (futex_info || !create) return futex_info;
 
-    if (thr_info->in_call)
+    libidle_lock_state_mutex();
+    futex_info = ptrmap_find(&state.futex_info, uaddr);
+    if (!futex_info)
     {
-        /**
-         * There's already a call going on.
-         * This means we're being called from a signal handler, like the D GC handler.
-         * Signal handlers should not participate in libidle operation, since they
-         * are not part of the normal thread behavior.
-         * So just ignore this one. sem_post may indicate pending wakeups, but we don't
-         * need to consider them.
-         */
-        libidle_unlock_state_mutex();
-
-        return next_sem_wait(sem);
+        // ptrmap_insert sets the key.
+        futex_info = slab_alloc(&state.futex_info_slab);
+        ptrmap_insert(&state.futex_info, futex_info, uaddr);
     }
+    libidle_unlock_state_mutex();
+    return futex_info;
+}
+
+/**
+ * The pending wakeups that waiters are owed, not counting those that arming waiters hold for themselves.
+ * Looked at after the counts, so a waiter that drops its wakeup in between changes them, and fails the CAS.
+ */
+static int futex_info_owed(FutexInfo *futex_info, SemaphoreCounts counts)
+{
+    return counts.pending_wakeups - atomic_load(&futex_info->arming);
+}
 
-    if (!is_named_semaphore)
+/**
+ * A waiter has left the word: consume a pending wakeup if it got one, and drop those that no waiter is left for.
+ * A waiter may have been woken by someone we don't track, or a wakeup may have been counted for a waiter
+ * that went back to sleep, so the counts can be off; they must not stay off.
+ */
+static void futex_info_waiter_left(FutexInfo *futex_info, bool woken)
+{
+    _Atomic uint64_t *word = &futex_info->sem_info.counts;
+    uint64_t old_word = atomic_load(word);
+    SemaphoreCounts old_counts, new_counts;
+    do
     {
-        thr_info->waiting_semaphore = sem;
-        thr_info->in_call = true;
+        old_counts = new_counts = sem_counts_unpack(old_word);
+        if (woken && futex_info_owed(futex_info, new_counts) > 0) new_counts.pending_wakeups--;
+        int excess = futex_info_owed(futex_info, new_counts) - new_counts.blocked_waiters;
+        if (excess > 0) new_counts.pending_wakeups -= excess;
+        if (new_counts.pending_wakeups == old_counts.pending_wakeups) return;
     }
+    while (!atomic_compare_exchange_weak(word, &old_word, sem_counts_pack(new_counts)));
 
-    libidle_unlock_state_mutex();
+    active_threads_add(sem_counts_active(new_counts) - sem_counts_active(old_counts));
+}
 
-    if (!is_named_semaphore)
-    {
-        entering_blocked_op("sem_wait()\n");
-    }
+// take back the wakeup that a waiter holds for itself while it looks at the word
+static void futex_info_disarm(FutexInfo *futex_info)
+{
+    sem_info_add_pending(&futex_info->sem_info, -1);
+    atomic_fetch_sub(&futex_info->arming, 1);
+}
 
-    int ret;
+/**
+ * FUTEX_WAIT and FUTEX_WAIT_BITSET, accounted like libidle_tracked_wait. The timeout is passed on
+ * as it is, since it's for the kernel anyway; we only work out the deadline from it.
+ * Unlike semaphores, futex waits return to the caller when interrupted.
+ *
+ * The caller has seen the word hold val, but it may have changed since, and a waker
+ * that changed it before we were counted as a waiter didn't count a wakeup for us.
+ * So we hold one for ourselves while we look again: once we're counted, any waker sees us.
+ */
+static long libidle_futex_wait(ThreadInfo *thr_info, uint32_t *uaddr, int op, uint32_t val,
+    const struct timespec *timeout, uint32_t bitset)
+{
+    FutexInfo *futex_info = libidle_futex_info(uaddr, true);
+    SemaphoreInfo *sem_info = &futex_info->sem_info;
+    SHARED_STAT_ADD(sem_info->stats.waits, 1);
+    if (sem_info_counts(sem_info).blocked_waiters > 0) SHARED_STAT_ADD(sem_info->stats.contended, 1);
 
-    // EINTR == interrupted by a system call, just retry with the same parameters
-    do
+    thr_info->in_call = true;
+    // see futex_info_owed
+    atomic_fetch_add(&futex_info->arming, 1);
+    sem_info_add_pending(sem_info, 1);
+    thr_info->waiting_semaphore = sem_info;
+    if (timeout)
     {
-        if (timedwait)
-        {
-            // we compensate for issues with faketime by
-            // manually checking the clock.
-            while (true)
-            {
-                ret = next_sem_timedwait(sem, abs_timeout);
-                if (ret == -1 && errno == ETIMEDOUT)
-                {
-                    struct timespec ts;
-                    clock_gettime(clock, &ts);
-                    if (ts.tv_sec < abs_timeout->tv_sec
-                        || (ts.tv_sec == abs_timeout->tv_sec
-                            && ts.tv_nsec < abs_timeout->tv_nsec))
-                    {
-                        // timeout hasn't actually elapsed yet
-                        continue;
-                    }
-                }
-                break;
-            }
-        }
-        else
+        // FUTEX_WAIT times out after a relative time, FUTEX_WAIT_BITSET at an absolute one
+        clockid_t clock = (op & FUTEX_CLOCK_REALTIME) ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+        int64_t remaining = timespec_ns(*timeout);
+        if ((op & FUTEX_CMD_MASK) == FUTEX_WAIT_BITSET)
         {
-            ret = next_sem_wait(sem);
+            struct timespec kernel_now;
+            next_syscall(SYS_clock_gettime, clock, &kernel_now);
+            remaining -= (int64_t) timespec_ns(kernel_now);
         }
+        libidle_add_deadline(thr_info, monotonic_ns() + (remaining > 0 ? remaining : 0));
     }
-    while (ret == -1 && errno == EINTR);
+    entering_blocked_op(LIBIDLE_TRACE_FUTEX_WAIT, (uintptr_t) uaddr);
 
-    /**
-     * order matters here!
-     * - unblock the op
-     * - unlink the semaphore
-     * - then decrement the wakeups.
-     * the point is that we must enter a known state of wakefulness before we
-     * untrack the semaphore. otherwise, libidle may miss the thread having woken.
-     */
-    if (!is_named_semaphore)
+    long ret = -1;
+    errno = EAGAIN;
+    bool unchanged = atomic_load((_Atomic uint32_t *) uaddr) == val;
+    if (unchanged)
     {
-        libidle_lock_state_mutex();
-
-        left_blocked_op("sem_wait()\n");
-
-        // refind due to realloc
-        thr_info = libidle_find_thr_info(pthread_self());
-        sem_info = libidle_find_sem_info(sem);
-
-        thr_info->waiting_semaphore = NULL;
-        thr_info->in_call = false;
-        sem_info->pending_wakeups--;
-
-        libidle_unlock_state_mutex();
+        futex_info_disarm(futex_info);
+        ret = next_syscall(SYS_futex, uaddr, op, val, timeout, NULL, bitset);
     }
+    int wait_errno = errno;
+
+    // as in libidle_tracked_wait: awake before we stop waiting on the word
+    left_blocked_op(LIBIDLE_TRACE_FUTEX_WAIT, (uintptr_t) uaddr);
+    thr_info->waiting_semaphore = NULL;
+    threadinfo_update_accounting(thr_info);
+    libidle_remove_deadline(thr_info);
+    // we've been active all along
+    if (!unchanged) futex_info_disarm(futex_info);
+    // once we'd looked, only a waker that saw us can have changed the word, and it counted a wakeup for us.
+    // if we saw it changed, we don't know that; maybe someone else has to take our wakeup.
+    futex_info_waiter_left(futex_info, ret == 0 || (unchanged && wait_errno == EAGAIN));
+    thr_info->in_call = false;
 
+    errno = wait_errno;
     return ret;
 }
 
-int pthread_cond_init_232(pthread_cond_t *restrict cond, const pthread_condattr_t *restrict attr)
+/**
+ * FUTEX_WAKE and FUTEX_WAKE_BITSET: count a pending wakeup for as many of our waiters as we may wake
+ * and aren't owed one yet, before we wake them, like sem_post.
+ * The wakeups are left pending even if the kernel wakes fewer: a waiter that is counted but not asleep yet
+ * is about to find the word changed, and must stay active until it does.
+ */
+static long libidle_futex_wake(uint32_t *uaddr, int op, int n, uint32_t bitset)
 {
-    libidle_lock_state_mutex();
-    // printf("  register %p\n", cond);
+    // pairs with the waiter counting itself before it looks at the word: we've changed the word by now
+    atomic_thread_fence(memory_order_seq_cst);
+    FutexInfo *futex_info = libidle_futex_info(uaddr, false);
+    if (!futex_info) return next_syscall(SYS_futex, uaddr, op, n, NULL, NULL, bitset);
+
+    SemaphoreInfo *sem_info = &futex_info->sem_info;
+    SHARED_STAT_ADD(sem_info->stats.posts, 1);
+    // arming first: a waiter holds its own wakeup for no longer than it's counted as arming,
+    // so we may miss one that arms after this, which will see the word changed, but never count one as ours.
+    int arming = atomic_load(&futex_info->arming);
+    SemaphoreCounts counts = sem_info_counts(sem_info);
+    int unwoken = counts.blocked_waiters - (counts.pending_wakeups - arming);
+    // if we race with another waker, we may count too many; the waiters drop those when they leave
+    if (unwoken > 0) sem_info_add_pending(sem_info, n < unwoken ? n : unwoken);
+    libidle_trace(find_thread_info(), LIBIDLE_TRACE_FUTEX_WAKE, LIBIDLE_TRACE_NONE, (uintptr_t) uaddr);
+
+    return next_syscall(SYS_futex, uaddr, op, n, NULL, NULL, bitset);
+}
 
-    clockid_t clock = CLOCK_REALTIME;
-    if (attr)
+/**
+ * Runtimes and lock-free queues park their threads with the futex syscall directly.
+ * With LIBIDLE_FUTEX=1, waits and wakes on a futex word are tracked like a semaphore;
+ * everything else is passed through. The arguments are taken as six longs, which is how
+ * the syscall ABI passes them anyway.
+ */
+long syscall(long number, ...)
+{
+    va_list args;
+    va_start(args, number);
+    long arg[6];
+    for (int i = 0; i < 6; i++) arg[i] = va_arg(args, long);
+    va_end(args);
+
+    LIBIDLE_EARLY(next_syscall);
+    ThreadInfo *thr_info = find_thread_info();
+    if (number != SYS_futex || !state.track_futex || !thr_info || thr_info->in_call)
     {
-        pthread_condattr_getclock(attr, &clock);
+        return next_syscall(number, arg[0], arg[1], arg[2], arg[3], arg[4], arg[5]);
     }
 
-    // register condition in ConditionInfo list
-    PUSH(state.cond_info) = (ConditionInfo) {
-        .cond = cond,
-        .in = malloc(sizeof(sem_t)),
-        .out = malloc(sizeof(sem_t)),
-        .signaled = malloc(sizeof(bool)),
-        .sleeping_threads = 0,
-        .clock = clock,
-    };
-    ConditionInfo *info = &state.cond_info_ptr[state.cond_info_len - 1];
-    // our own function - not next_!
-    sem_init_225(info->in, 0, 0);
-    sem_init_225(info->out, 0, 0);
-    *info->signaled = false;
-
-    libidle_unlock_state_mutex();
-
-    return 0;
+    uint32_t *uaddr = (uint32_t *) arg[0];
+    int op = (int) arg[1];
+    switch (op & FUTEX_CMD_MASK)
+    {
+        case FUTEX_WAIT:
+            return libidle_futex_wait(thr_info, uaddr, op, (uint32_t) arg[2], (const struct timespec *) arg[3],
+                FUTEX_BITSET_MATCH_ANY);
+        case FUTEX_WAIT_BITSET:
+            return libidle_futex_wait(thr_info, uaddr, op, (uint32_t) arg[2], (const struct timespec *) arg[3],
+                (uint32_t) arg[5]);
+        case FUTEX_WAKE:
+            return libidle_futex_wake(uaddr, op, (int) arg[2], FUTEX_BITSET_MATCH_ANY);
+        case FUTEX_WAKE_BITSET:
+            return libidle_futex_wake(uaddr, op, (int) arg[2], (uint32_t) arg[5]);
+        default:
+            // requeues and the like move waiters that we can't follow
+            return next_syscall(number, arg[0], arg[1], arg[2], arg[3], arg[4], arg[5]);
+    }
 }
 
-int pthread_cond_destroy_232(pthread_cond_t *cond)
+// the threads that were waiting on it are gone
+static void sem_info_forget_waiters(SemaphoreInfo *sem_info)
 {
-    NON_NULL(next_pthread_cond_destroy);
+    SemaphoreCounts counts = sem_info_counts(sem_info);
+    counts.blocked_waiters = 0;
+    atomic_store(&sem_info->counts, sem_counts_pack(counts));
+}
 
-    libidle_lock_state_mutex();
+/**
+ * In the child of fork: only the calling thread survived, and it holds our locks (see fork).
+ * Start over from what we inherited: the other threads are gone, so nobody waits on anything any more.
+ * The statefile, shm page, socket and trace are the parent's, so the child doesn't publish;
+ * in a domain it's counted as a member, otherwise it isn't counted at all.
+ */
+static void libidle_after_fork_child(DomainMember *slot)
+{
+    // locked by the parent's thread, and a recursive mutex would notice that we're another one
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&state.mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&state.idle_mutex, NULL);
+    pthread_mutex_init(&state.trace_mutex, NULL);
+    state_mutex_depth = 0;
+    state_mutex_since = 0;
 
-    // TODO iterate backwards- faster? more recently created condvars are likely to be at the back
-    for (int i = 0; i < state.cond_info_len; i++)
+    ThreadInfo *self = current_thread;
+    for (ThreadInfo *thr_info = state.thr_info_first, *next; thr_info; thr_info = next)
     {
-        ConditionInfo *cond_info = &state.cond_info_ptr[i];
-        if (cond_info->cond == cond)
-        {
-            // pthread_cond_destroy undefined if we're still waiting on this condition
-            assert(cond_info->sleeping_threads == 0);
-
-            sem_destroy_225(cond_info->in);
-            sem_destroy_225(cond_info->out);
-            free(cond_info->in);
-            free(cond_info->out);
-            free(cond_info->signaled);
-
-            // swap with last entry and shrink
-            *cond_info = state.cond_info_ptr[state.cond_info_len - 1];
-            DROP(state.cond_info);
-            break;
-        }
+        next = thr_info->next;
+        if (thr_info == self) continue;
+        if (thr_info->forced_state_ptr != thr_info->forced_state_inline) free(thr_info->forced_state_ptr);
+        free(thr_info->waiting_channels_ptr);
+        slab_free(&state.thr_info_slab, thr_info);
+    }
+    for (ThreadInfo *thr_info = state.zombies_first, *next; thr_info; thr_info = next)
+    {
+        next = thr_info->next;
+        slab_free(&state.thr_info_slab, thr_info);
+    }
+    state.zombies_first = NULL;
+    state.thr_info_first = state.thr_info_last = self;
+    if (self)
+    {
+        self->prev = self->next = NULL;
+        self->trace_ring = NULL;
+        sem_info_forget_waiters(&self->join_sem);
     }
-    // should assert we actually freed something rn... meh
-
-    libidle_unlock_state_mutex();
 
-    return next_pthread_cond_destroy(cond);
+    // the counts of shared semaphores are still right: the waiters in the parent are still there
+    PtrMapTable *table = atomic_load(&state.sem_info.table);
+    for (size_t i = 0; table && i <= table->mask; i++)
+    {
+        SemaphoreInfo *sem_info = atomic_load(&table->slots[i]);
+        if (sem_info && !sem_info->shared) sem_info_forget_waiters(sem_info);
+    }
+    table = atomic_load(&state.cond_info.table);
+    for (size_t i = 0; table && i <= table->mask; i++)
+    {
+        ConditionInfo *cond_info = atomic_load(&table->slots[i]);
+        if (!cond_info) continue;
+        // the frames are abandoned: their sleepers and tokens were the parent's
+        pthread_mutex_init(&cond_info->mutex, NULL);
+        cond_info->frame = cond_info->oldest_frame = libidle_get_cond_frame();
+        atomic_store(&cond_info->sleeping_threads, 0);
+    }
+    table = atomic_load(&state.fd_info.table);
+    for (size_t i = 0; table && i <= table->mask; i++)
+    {
+        FdInfo *fd_info = atomic_load(&table->slots[i]);
+        if (fd_info && fd_info->in) sem_info_forget_waiters(&fd_info->in->sem_info);
+        if (fd_info && fd_info->out) sem_info_forget_waiters(&fd_info->out->sem_info);
+    }
+    table = atomic_load(&state.futex_info.table);
+    for (size_t i = 0; table && i <= table->mask; i++)
+    {
+        FutexInfo *futex_info = atomic_load(&table->slots[i]);
+        if (futex_info) sem_info_forget_waiters(&futex_info->sem_info);
+    }
+    atomic_store(&state.active_threads, self && self->accounting == ACCOUNTED_ACTIVE ? 1 : 0);
+
+    for (size_t i = 0; i < state.subscribers_len; i++) next_close(state.subscribers_ptr[i]);
+    state.subscribers_len = 0;
+    if (state.filedes != -1) next_close(state.filedes);
+    state.filedes = -1;
+    state.shm = NULL;
+    if (state.trace_fd != -1) next_close(state.trace_fd);
+    state.trace_fd = -1;
+    if (state.sample_fd != -1) next_close(state.sample_fd);
+    state.sample_fd = -1;
+    state.stats_path = NULL;
+    state.idle_settle_ns = 0;
+    state.settle_due = 0;
+    state.settle_timer_parked = false;
+    state.domain_root = false;
+    state.domain_slot = slot;
+    if (slot) atomic_store(&slot->pid, getpid());
+
+    // state and idle mutex
+    for (int i = 0; i < 2; i++) libidle_unblock_signals();
+    // our slot was reserved as busy
+    libidle_sync_idle_state();
 }
 
-int pthread_cond_timedwait_232(pthread_cond_t *restrict cond, pthread_mutex_t *restrict mutex,
-    const struct timespec *restrict abstime)
+/**
+ * In a domain, the child is a member from the start, counted busy until it says otherwise,
+ * just like a new thread is counted active before it runs.
+ * No lock of ours may be held by another thread across the fork, since the child would never
+ * see it released; so we hold all of them ourselves.
+ */
+pid_t fork()
 {
-    libidle_lock_state_mutex();
-
-    // mutex is locked here per condition semantics. however, we can safely release it at this
-    // point because we hold state.mutex anyway.
-    pthread_mutex_unlock(mutex);
-
-    ConditionInfo *cond_info = libidle_find_cond_info(cond);
-    // assert(cond_info);
-
-    // printf("> sleep on %p: sem %p, %i\n", cond, cond_info->in, !!abstime);
+    LIBIDLE_EARLY(next_fork);
 
-    cond_info->sleeping_threads++;
-    sem_t *in = cond_info->in, *out = cond_info->out;
-    bool *signaled = cond_info->signaled;
-    clockid_t clock = cond_info->clock;
-
-    libidle_unlock_state_mutex(); // all state modifications are done.
-
-    int ret;
-    if (abstime)
+    DomainMember *child_slot = NULL;
+    libidle_lock_mutex(&state.idle_mutex);
+    if (state.domain_slot) child_slot = libidle_domain_take_slot(DOMAIN_RESERVED);
+    if (child_slot)
     {
-        ret = libidle_sem_wait(true, in, abstime, clock);
-        if (ret == -1 && errno == ETIMEDOUT)
-        {
-            // printf("! ! ! timeout case\n");
-            libidle_lock_state_mutex();
-            if (*signaled)
-            {
-                // printf("? ? ? already signaled\n");
-                // consume our semaphore (will always succeed)
-                // this situation happens if the condition was signaled after the timeout,
-                // but before we got the lock - for instance, if it timed out while _broadcast held the lock.
-                // In that case, _broadcast will not see our reduction in sleeping_threads,
-                // so we must wait and post for it.
-                sem_wait_225(in);
-                sem_post_225(out);
-            }
-            else
-            {
-                // refind cause array may have realloced
-                cond_info = libidle_find_cond_info(cond);
-                cond_info->sleeping_threads--;
-            }
-            libidle_unlock_state_mutex();
+        atomic_store(&child_slot->busy, true);
+        libidle_domain_add(1);
+    }
+    libidle_unlock_mutex(&state.idle_mutex);
 
-            pthread_mutex_lock(mutex);
+    libidle_lock_state_mutex();
+    libidle_lock_mutex(&state.idle_mutex);
+    pthread_mutex_lock(&state.trace_mutex);
+    pid_t pid = next_fork();
+    if (pid == 0)
+    {
+        libidle_after_fork_child(child_slot);
+        return 0;
+    }
+    int fork_errno = errno;
+    pthread_mutex_unlock(&state.trace_mutex);
+    libidle_unlock_mutex(&state.idle_mutex);
+    libidle_unlock_state_mutex();
 
-            // pthread_cond_timedwait reports errors differently from sem_timedwait
-            return ETIMEDOUT;
-        }
+    if (child_slot && pid == -1)
+    {
+        atomic_store(&child_slot->busy, false);
+        libidle_domain_add(-1);
+        atomic_store(&child_slot->pid, 0);
     }
-    else
+    // unless the child has already claimed the slot, and maybe left it again
+    pid_t reserved = DOMAIN_RESERVED;
+    if (child_slot && pid != -1) atomic_compare_exchange_strong(&child_slot->pid, &reserved, pid);
+    errno = fork_errno;
+    return pid;
+}
+
+// whether an image started with this environment will take over our slot in the domain
+static bool libidle_env_joins_domain(char *const envp[])
+{
+    bool page = false, preloaded = false;
+    for (char *const *var = envp; var && *var; var++)
     {
-        ret = sem_wait_225(in);
+        if (strncmp(*var, "LIBIDLE_DOMAIN_PAGE=", 20) == 0) page = true;
+        if (strncmp(*var, "LD_PRELOAD=", 11) == 0 && strstr(*var, "libidle")) preloaded = true;
     }
-    assert(ret == 0);
-    // printf("cond waiter woke up.\n");
-    sem_post_225(out);
+    return page && preloaded;
+}
 
-    // grab the mutex back
-    pthread_mutex_lock(mutex);
+// before exec: leave the domain, unless the new image is going to be a member in our place
+static bool libidle_exec_leave(char *const envp[])
+{
+    if (!state.domain_slot || libidle_env_joins_domain(envp)) return false;
+    libidle_leave_domain();
+    return true;
+}
 
-    return 0;
+// after exec: we're still here, so it failed
+static int libidle_exec_failed(bool left)
+{
+    int exec_errno = errno;
+    if (left) libidle_rejoin_domain();
+    errno = exec_errno;
+    return -1;
 }
 
-int pthread_cond_wait_232(pthread_cond_t *restrict cond, pthread_mutex_t *restrict mutex)
+int execve(const char *path, char *const argv[], char *const envp[])
 {
-    return pthread_cond_timedwait_232(cond, mutex, NULL);
+    LIBIDLE_EARLY(next_execve);
+    bool left = libidle_exec_leave(envp);
+    next_execve(path, argv, envp);
+    return libidle_exec_failed(left);
 }
 
-int pthread_cond_broadcast_232(pthread_cond_t *cond)
+int execvpe(const char *file, char *const argv[], char *const envp[])
 {
-    libidle_lock_state_mutex();
+    LIBIDLE_EARLY(next_execvpe);
+    bool left = libidle_exec_leave(envp);
+    next_execvpe(file, argv, envp);
+    return libidle_exec_failed(left);
+}
 
-    ConditionInfo *cond_info = libidle_find_cond_info(cond);
-    ThreadInfo *thr_info = libidle_find_thr_info(pthread_self());
+int execv(const char *path, char *const argv[])
+{
+    LIBIDLE_EARLY(next_execv);
+    bool left = libidle_exec_leave(environ);
+    next_execv(path, argv);
+    return libidle_exec_failed(left);
+}
 
-    assert(thr_info);
-    assert(cond_info);
+int execvp(const char *file, char *const argv[])
+{
+    LIBIDLE_EARLY(next_execvp);
+    bool left = libidle_exec_leave(environ);
+    next_execvp(file, argv);
+    return libidle_exec_failed(left);
+}
 
-    sem_t *in = cond_info->in, *out = cond_info->out;
-    bool *signaled = cond_info->signaled;
-    int were_sleeping = cond_info->sleeping_threads;
-    // printf("> broadcast to %i (%p)\n", were_sleeping, cond);
+/**
+ * Waiting for a child process is idle, like accept: the child is counted by itself if it is
+ * a member of our domain, and outside of a domain it's none of our business.
+ */
+pid_t waitpid(pid_t pid, int *wstatus, int options)
+{
+    LIBIDLE_EARLY(next_waitpid);
+    if (options & WNOHANG) return next_waitpid(pid, wstatus, options);
+    entering_blocked_op(LIBIDLE_TRACE_WAITPID, pid);
+    pid_t ret = next_waitpid(pid, wstatus, options);
+    left_blocked_op(LIBIDLE_TRACE_WAITPID, pid);
+    return ret;
+}
 
-    // reinit cond_info - create a new "cond_wait/cond_signal group".
-    cond_info->in = malloc(sizeof(sem_t));
-    cond_info->out = malloc(sizeof(sem_t));
-    cond_info->signaled = malloc(sizeof(bool));
-    sem_init_225(cond_info->in, 0, 0);
-    sem_init_225(cond_info->out, 0, 0);
-    *cond_info->signaled = false;
-    cond_info->sleeping_threads = 0;
+pid_t wait(int *wstatus)
+{
+    return waitpid(-1, wstatus, 0);
+}
 
-    // printf("> distribute tokens\n");
-    for (int i = 0; i < were_sleeping; i++)
-    {
-        // printf("post sem %p\n", in);
-        sem_post_225(in);
-    }
-    *signaled = true;
-    libidle_unlock_state_mutex(); // done with state mutation
+pid_t wait4(pid_t pid, int *wstatus, int options, struct rusage *rusage)
+{
+    LIBIDLE_EARLY(next_wait4);
+    if (options & WNOHANG) return next_wait4(pid, wstatus, options, rusage);
+    entering_blocked_op(LIBIDLE_TRACE_WAITPID, pid);
+    pid_t ret = next_wait4(pid, wstatus, options, rusage);
+    left_blocked_op(LIBIDLE_TRACE_WAITPID, pid);
+    return ret;
+}
 
-    // printf("> collect tokens\n");
-    for (int i = 0; i < were_sleeping; i++)
-    {
-        sem_wait_225(out);
-    }
-    // printf("> tokens collected\n");
-    // because we've waited for out, we can now clean up the semaphores.
-    sem_destroy_225(in);
-    sem_destroy_225(out);
-    free(in);
-    free(out);
-    free(signaled);
+int waitid(idtype_t idtype, id_t id, siginfo_t *infop, int options)
+{
+    LIBIDLE_EARLY(next_waitid);
+    if (options & WNOHANG) return next_waitid(idtype, id, infop, options);
+    entering_blocked_op(LIBIDLE_TRACE_WAITPID, id);
+    int ret = next_waitid(idtype, id, infop, options);
+    left_blocked_op(LIBIDLE_TRACE_WAITPID, id);
+    return ret;
+}
 
-    return 0;
+// glibc 2.34 moved the semaphores from libpthread to libc, with new versions of the same functions
+int sem_init_234(sem_t *sem, int pshared, unsigned int value)
+{
+    return sem_init_225(sem, pshared, value);
 }
 
-int pthread_cond_signal_232(pthread_cond_t *cond)
+int sem_destroy_234(sem_t *sem)
+{
+    return sem_destroy_225(sem);
+}
+
+int sem_post_234(sem_t *sem)
+{
+    return sem_post_225(sem);
+}
+
+int sem_wait_234(sem_t *sem)
+{
+    return sem_wait_225(sem);
+}
+
+int sem_timedwait_234(sem_t *sem, const struct timespec *abs_timeout)
 {
-    // allowed under condition semantics!
-    return pthread_cond_broadcast_232(cond);
+    return sem_timedwait_225(sem, abs_timeout);
 }
 
 // see http://blog.fesnel.com/blog/2009/08/25/preloading-with-multiple-symbol-versions/
@@ -1105,8 +4989,17 @@ __asm__(".symver pthread_cond_init_232, pthread_cond_init@@GLIBC_2.3.2");
 __asm__(".symver pthread_cond_timedwait_232, pthread_cond_timedwait@@GLIBC_2.3.2");
 __asm__(".symver pthread_cond_wait_232, pthread_cond_wait@@GLIBC_2.3.2");
 __asm__(".symver pthread_cond_signal_232, pthread_cond_signal@@GLIBC_2.3.2");
-__asm__(".symver sem_destroy_225, sem_destroy@@GLIBC_2.2.5");
-__asm__(".symver sem_init_225, sem_init@@GLIBC_2.2.5");
-__asm__(".symver sem_post_225, sem_post@@GLIBC_2.2.5");
-__asm__(".symver sem_wait_225, sem_wait@@GLIBC_2.2.5");
-__asm__(".symver sem_timedwait_225, sem_timedwait@@GLIBC_2.2.5");
+__asm__(".symver pthread_cond_clockwait_230, pthread_cond_clockwait@GLIBC_2.30");
+__asm__(".symver pthread_cond_clockwait_234, pthread_cond_clockwait@@GLIBC_2.34");
+__asm__(".symver sem_destroy_225, sem_destroy@GLIBC_2.2.5");
+__asm__(".symver sem_init_225, sem_init@GLIBC_2.2.5");
+__asm__(".symver sem_post_225, sem_post@GLIBC_2.2.5");
+__asm__(".symver sem_wait_225, sem_wait@GLIBC_2.2.5");
+__asm__(".symver sem_timedwait_225, sem_timedwait@GLIBC_2.2.5");
+__asm__(".symver sem_clockwait_230, sem_clockwait@GLIBC_2.30");
+__asm__(".symver sem_destroy_234, sem_destroy@@GLIBC_2.34");
+__asm__(".symver sem_init_234, sem_init@@GLIBC_2.34");
+__asm__(".symver sem_post_234, sem_post@@GLIBC_2.34");
+__asm__(".symver sem_wait_234, sem_wait@@GLIBC_2.34");
+__asm__(".symver sem_timedwait_234, sem_timedwait@@GLIBC_2.34");
+__asm__(".symver sem_clockwait_234, sem_clockwait@@GLIBC_2.34");
@@ -0,0 +1,217 @@
+#ifndef LIBIDLE_H
+#define LIBIDLE_H
+
+/**
+ * Interface for programs that watch a process running under libidle.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LIBIDLE_SHM_MAGIC 0x6c69646c // "lidl"
+#define LIBIDLE_SHM_VERSION 2
+
+/**
+ * Layout of the shared memory object published when LIBIDLE_SHM is set.
+ * (See shm_open(3). The name gets a leading '/' if it doesn't have one.)
+ *
+ * All fields must be accessed atomically.
+ * magic and version are written once the page is ready; check them before anything else.
+ *
+ * state is (times_idle << 1) | idle, where times_idle is the same serial the statefile holds.
+ * It is a futex word: to wait for a change, increment waiters, check state once more,
+ * then FUTEX_WAIT on state with the value you saw. Decrement waiters when you're done.
+ * libidle only issues FUTEX_WAKE when waiters is non-zero.
+ * The page is shared between processes, so don't use FUTEX_PRIVATE_FLAG.
+ *
+ * deadline is the earliest time at which a sleeping or timed-waiting thread will wake up by itself,
+ * as CLOCK_MONOTONIC nanoseconds of the process, or 0 if there is none. It is only meaningful
+ * while the process is idle: it's written before state on every transition to idle (and reset
+ * to 0 before going busy), so it is current once you've seen the idle state that goes with it.
+ * (Added in version 2.)
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t state;
+    uint32_t waiters;
+    uint64_t deadline;
+} LibidleShm;
+
+#define LIBIDLE_SHM_IDLE(state) ((state) & 1)
+#define LIBIDLE_SHM_SERIAL(state) ((state) >> 1)
+
+/**
+ * Event sent to every subscriber of the LIBIDLE_SOCKET unix socket (SOCK_SEQPACKET),
+ * one per packet, on every idle/busy transition.
+ * Right after connecting, a subscriber receives the current state.
+ * serial is times_idle as in the statefile; timestamp is CLOCK_MONOTONIC in nanoseconds.
+ * deadline is the next time a thread wakes up by itself, as in LibidleShm, or 0 (always 0 when busy).
+ * A subscriber that doesn't keep up with the events is disconnected, so seeing the socket
+ * close while the process is running means events were lost.
+ */
+typedef struct {
+    uint32_t serial;
+    uint32_t idle;
+    uint64_t timestamp;
+    uint64_t deadline;
+} LibidleEvent;
+
+#define LIBIDLE_TRACE_MAGIC 0x7464696c // "lidt"
+#define LIBIDLE_TRACE_VERSION 1
+
+/**
+ * The file written when LIBIDLE_TRACE is set starts with this header,
+ * followed by LibidleTraceEvents of event_size bytes each.
+ * Events are written in batches per thread, so they must be sorted by timestamp for a timeline.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t event_size;
+    uint32_t reserved;
+} LibidleTraceHeader;
+
+/**
+ * Ops that appear in a trace, with the name the block map shows for them.
+ */
+#define LIBIDLE_TRACE_OPS(X) \
+    X(LIBIDLE_TRACE_THREAD_START, "thread start") \
+    X(LIBIDLE_TRACE_THREAD_EXIT, "thread exit") \
+    X(LIBIDLE_TRACE_SEM_WAIT, "sem_wait()") \
+    X(LIBIDLE_TRACE_SEM_POST, "sem_post()") \
+    X(LIBIDLE_TRACE_COND_WAIT, "pthread_cond_wait()") \
+    X(LIBIDLE_TRACE_ACCEPT, "accept()") \
+    X(LIBIDLE_TRACE_JOIN, "pthread_join()") \
+    X(LIBIDLE_TRACE_FORCED_IDLE, "forced idle") \
+    X(LIBIDLE_TRACE_FORCED_BUSY, "forced busy") \
+    X(LIBIDLE_TRACE_BUSY, "lock") \
+    X(LIBIDLE_TRACE_IDLE, "unlock") \
+    X(LIBIDLE_TRACE_DROPPED, "events dropped") \
+    X(LIBIDLE_TRACE_READ, "read()") \
+    X(LIBIDLE_TRACE_RECV, "recv()") \
+    X(LIBIDLE_TRACE_POLL, "poll()") \
+    X(LIBIDLE_TRACE_SELECT, "select()") \
+    X(LIBIDLE_TRACE_EPOLL_WAIT, "epoll_wait()") \
+    X(LIBIDLE_TRACE_SLEEP, "nanosleep()") \
+    X(LIBIDLE_TRACE_WAITPID, "waitpid()") \
+    X(LIBIDLE_TRACE_FUTEX_WAIT, "futex_wait()") \
+    X(LIBIDLE_TRACE_FUTEX_WAKE, "futex_wake()")
+
+#define LIBIDLE_TRACE_OP_ENUM(op, name) op,
+enum LibidleTraceOp { LIBIDLE_TRACE_OPS(LIBIDLE_TRACE_OP_ENUM) };
+#undef LIBIDLE_TRACE_OP_ENUM
+
+enum LibidleTraceTransition {
+    LIBIDLE_TRACE_NONE,
+    LIBIDLE_TRACE_ENTER, // "+block": the thread starts blocking (or the forced state is pushed)
+    LIBIDLE_TRACE_LEAVE, // "-block"
+};
+
+/**
+ * One traced event.
+ * thread numbers threads in order of registration, starting at 0 for the main thread.
+ * object is the semaphore or condition frame address, fd or pthread_t the op is on (nfds for poll and select,
+ * the deadline for sleeps);
+ * for LIBIDLE_TRACE_BUSY/IDLE it is the times_idle serial after the transition,
+ * for LIBIDLE_TRACE_DROPPED the number of events of this thread that didn't fit in its ring.
+ * state is the block map letter of the thread right after the event (see README).
+ */
+typedef struct {
+    uint64_t timestamp; // CLOCK_MONOTONIC in nanoseconds
+    uint64_t object;
+    uint32_t thread;
+    uint8_t op; // enum LibidleTraceOp
+    uint8_t transition; // enum LibidleTraceTransition
+    char state;
+    uint8_t reserved;
+} LibidleTraceEvent;
+
+/**
+ * Counters of one thread, as returned by libidle_get_stats.
+ * Times are CLOCK_MONOTONIC nanoseconds since the thread started.
+ * busy_ns and blocked_ns split the thread's life by whether it was in a blocking call;
+ * forced_ns is the time spent inside forced idle/busy sections, which overlaps both.
+ * transitions counts blocking calls. The mutex_ counters are about libidle's own state mutex:
+ * how long this thread held it, how often it took it, and how often it had to wait for it.
+ * They're only kept if LIBIDLE_STATS is set, and 0 otherwise.
+ */
+typedef struct {
+    uint64_t thread; // pthread_t, 0 for the sum of all exited threads
+    uint32_t trace_id; // as in the trace
+    uint32_t reserved;
+    uint64_t busy_ns;
+    uint64_t blocked_ns;
+    uint64_t forced_ns;
+    uint64_t transitions;
+    uint64_t mutex_hold_ns;
+    uint64_t mutex_acquisitions;
+    uint64_t mutex_contended;
+} LibidleThreadStats;
+
+enum LibidlePrimitiveKind {
+    LIBIDLE_STATS_SEMAPHORE,
+    LIBIDLE_STATS_CONDITION,
+    LIBIDLE_STATS_FUTEX,
+};
+
+/**
+ * Counters of one semaphore, condition or futex word (LIBIDLE_FUTEX).
+ * posts counts sem_post, pthread_cond_signal or FUTEX_WAKE calls, broadcasts pthread_cond_broadcast calls.
+ * contended counts the waits that found other threads already waiting.
+ * These are shared between threads, and bumped with atomic increments by whoever uses the primitive.
+ */
+typedef struct {
+    uint64_t object; // sem_t, pthread_cond_t or futex word address
+    uint32_t kind; // enum LibidlePrimitiveKind
+    uint32_t reserved;
+    uint64_t posts;
+    uint64_t waits;
+    uint64_t broadcasts;
+    uint64_t contended;
+} LibidlePrimitiveStats;
+
+// pthread names are at most 15 characters
+#define LIBIDLE_THREAD_NAME_LEN 16
+
+/**
+ * A busy period: from going busy until going idle with the serial number `serial`.
+ * busy_ns is wall time, even if the process runs under a fake clock.
+ * The last thread is the one whose blocking made the process idle.
+ */
+typedef struct {
+    uint64_t serial; // as in the statefile
+    uint64_t busy_ns;
+    uint32_t last_trace_id; // as in the trace, or UINT32_MAX if it's not a thread we know
+    char last_name[LIBIDLE_THREAD_NAME_LEN]; // as set by pthread_setname_np, or empty
+} LibidleBusyPeriod;
+
+// busy periods are counted by the power of two of their length in ns
+#define LIBIDLE_BUSY_BUCKETS 64
+// number of busy periods that are kept
+#define LIBIDLE_BUSY_PERIODS 64
+
+/**
+ * Snapshot returned by `LibidleStats *libidle_get_stats()`; free it with `void libidle_free_stats(LibidleStats *)`.
+ * Both are found with dlsym(RTLD_DEFAULT, ...), like libidle_enable_forced_idle.
+ * The mutex_ counters are summed over all threads, including exited ones.
+ */
+typedef struct {
+    uint64_t idle_edges; // transitions to idle, ie. the serial
+    uint64_t busy_edges;
+    uint64_t mutex_hold_ns;
+    uint64_t mutex_acquisitions;
+    uint64_t mutex_contended;
+    LibidleThreadStats exited;
+    size_t threads_len;
+    LibidleThreadStats *threads;
+    size_t primitives_len;
+    LibidlePrimitiveStats *primitives;
+    // busy_histogram[i] counts the busy periods of [2^i, 2^(i+1)) ns (bucket 0 includes 0 ns)
+    uint64_t busy_histogram[LIBIDLE_BUSY_BUCKETS];
+    // the last busy periods, oldest first
+    size_t busy_periods_len;
+    LibidleBusyPeriod busy_periods[LIBIDLE_BUSY_PERIODS];
+} LibidleStats;
+
+#endif
@@ -0,0 +1,19 @@
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Test: spin for 300ms without any blocking call, then exit.
+ * We're busy the whole time, so LIBIDLE_SAMPLE should catch the main thread in here.
+ */
+static uint64_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int main()
+{
+    uint64_t end = now_ms() + 300;
+    while (now_ms() < end) { }
+}
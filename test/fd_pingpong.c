@@ -0,0 +1,60 @@
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/*
+ * Test: bounce the ball between both threads 100 times, over a pipe and an eventfd.
+ * The main thread polls the pipe, the other thread epoll_waits on the eventfd.
+ * During this, libidle should never unlock.
+ * With the argument "wait", just read from a pipe that is never written: libidle should go idle.
+ */
+int pipefd[2], event;
+
+void *wait_on_eventfd(void *arg)
+{
+    int epfd = epoll_create1(0);
+    struct epoll_event watch = { .events = EPOLLIN };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, event, &watch);
+    for (int i = 0; i < 100; i++)
+    {
+        struct epoll_event ready;
+        epoll_wait(epfd, &ready, 1, -1);
+        uint64_t value;
+        read(event, &value, sizeof(value));
+        write(pipefd[1], "x", 1);
+    }
+    close(epfd);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pipe(pipefd);
+    if (argc > 1 && strcmp(argv[1], "wait") == 0)
+    {
+        char c;
+        read(pipefd[0], &c, 1);
+        return 0;
+    }
+    event = eventfd(0, 0);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, &wait_on_eventfd, NULL);
+
+    for (int i = 0; i < 100; i++)
+    {
+        uint64_t value = 1;
+        write(event, &value, sizeof(value));
+        struct pollfd fd = { .fd = pipefd[0], .events = POLLIN };
+        poll(&fd, 1, -1);
+        char c;
+        read(pipefd[0], &c, 1);
+    }
+    void *ret;
+    pthread_join(thread, &ret);
+    sleep(2);
+}
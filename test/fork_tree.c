@@ -0,0 +1,55 @@
+#include <semaphore.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <unistd.h>
+
+/*
+ * Test (LIBIDLE_DOMAIN=1): the main process forks a child, then waits forever.
+ * - spin: the child spins forever. The tree is never idle.
+ * - pingpong: the processes bounce a token over two pshared semaphores forever. The tree is never idle,
+ *   though each of them is idle on its own half of the time.
+ * - exec: the child execs build/sem_wait, which waits forever. The tree goes idle once, when both wait.
+ */
+int main(int argc, char **argv)
+{
+    const char *mode = argc > 1 ? argv[1] : "spin";
+    sem_t *sems = mmap(NULL, 2 * sizeof(sem_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    sem_init(&sems[0], 1, 0);
+    sem_init(&sems[1], 1, 0);
+
+    if (fork() == 0)
+    {
+        // die with the test's kill of the parent
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (strcmp(mode, "exec") == 0)
+        {
+            char *args[] = { "build/sem_wait", NULL };
+            execv(args[0], args);
+            return 1;
+        }
+        if (strcmp(mode, "pingpong") == 0)
+        {
+            while (1)
+            {
+                sem_wait(&sems[0]);
+                sem_post(&sems[1]);
+            }
+        }
+        while (1) { }
+    }
+
+    if (strcmp(mode, "pingpong") == 0)
+    {
+        while (1)
+        {
+            sem_post(&sems[0]);
+            sem_wait(&sems[1]);
+        }
+    }
+    sem_t semaphore;
+    sem_init(&semaphore, 0, 0);
+    sem_wait(&semaphore);
+}
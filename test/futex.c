@@ -0,0 +1,85 @@
+#define _GNU_SOURCE // for pthread_cond_clockwait
+#include <linux/futex.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Test: threads that park with the futex syscall directly, like a language runtime would (LIBIDLE_FUTEX=1).
+ * - wait: wait on a futex word that is never woken. libidle should go idle.
+ * - pingpong: bounce a token between two threads over a futex word forever. libidle should never go idle.
+ * - clockwait: one thread in sem_clockwait, the other in pthread_cond_clockwait, both on CLOCK_MONOTONIC
+ *   an hour from now. libidle should go idle.
+ */
+static uint32_t word;
+
+static void futex_wait(uint32_t val)
+{
+    syscall(SYS_futex, &word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake()
+{
+    syscall(SYS_futex, &word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// the word is 0 while it's the main thread's turn, 1 while it's ours
+static void *pong(void *arg)
+{
+    while (1)
+    {
+        while (__atomic_load_n(&word, __ATOMIC_SEQ_CST) == 0) futex_wait(0);
+        __atomic_store_n(&word, 0, __ATOMIC_SEQ_CST);
+        futex_wake();
+    }
+    return NULL;
+}
+
+static struct timespec in_an_hour()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += 3600;
+    return ts;
+}
+
+static void *sem_clockwait_thread(void *arg)
+{
+    sem_t sem;
+    sem_init(&sem, 0, 0);
+    struct timespec timeout = in_an_hour();
+    sem_clockwait(&sem, CLOCK_MONOTONIC, &timeout);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = argc > 1 ? argv[1] : "wait";
+    pthread_t thread;
+    if (strcmp(mode, "pingpong") == 0)
+    {
+        pthread_create(&thread, NULL, &pong, NULL);
+        while (1)
+        {
+            __atomic_store_n(&word, 1, __ATOMIC_SEQ_CST);
+            futex_wake();
+            while (__atomic_load_n(&word, __ATOMIC_SEQ_CST) == 1) futex_wait(1);
+        }
+    }
+    if (strcmp(mode, "clockwait") == 0)
+    {
+        pthread_create(&thread, NULL, &sem_clockwait_thread, NULL);
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        pthread_cond_t cond;
+        pthread_cond_init(&cond, NULL);
+        pthread_mutex_lock(&mutex);
+        struct timespec timeout = in_an_hour();
+        pthread_cond_clockwait(&cond, &mutex, CLOCK_MONOTONIC, &timeout);
+        return 0;
+    }
+    while (1) futex_wait(0);
+}
@@ -0,0 +1,25 @@
+#include <semaphore.h>
+#include <time.h>
+
+/*
+ * Test: go idle for a millisecond at a time, 100 times, then for good.
+ * With LIBIDLE_IDLE_SETTLE_US well above a millisecond, only the last idle period counts.
+ */
+int main()
+{
+    sem_t semaphore;
+    sem_init(&semaphore, 0, 0);
+    for (int i = 0; i < 100; i++)
+    {
+        struct timespec timeout;
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_nsec += 1000000;
+        if (timeout.tv_nsec >= 1000000000)
+        {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= 1000000000;
+        }
+        sem_timedwait(&semaphore, &timeout);
+    }
+    sem_wait(&semaphore);
+}
@@ -0,0 +1,36 @@
+#define _GNU_SOURCE // needed for pthread_setname_np
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <string.h>
+
+/*
+ * Test: a background thread names itself and spins forever, never making a blocking call,
+ * while the main thread waits forever. We're only idle if the spinner is ignored by name.
+ * - named: the main thread names the spinner "gc-worker" once it's running, rather than the spinner itself.
+ */
+static sem_t running;
+
+void *spin(void *arg)
+{
+    if (arg) sem_post(&running);
+    else pthread_setname_np(pthread_self(), "spinner");
+    while (1) { }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int named = argc > 1 && strcmp(argv[1], "named") == 0;
+    sem_init(&running, 0, 0);
+    pthread_t thread;
+    pthread_create(&thread, NULL, &spin, named ? &running : NULL);
+    if (named)
+    {
+        sem_wait(&running);
+        pthread_setname_np(thread, "gc-worker");
+    }
+    sem_t semaphore;
+    sem_init(&semaphore, 0, 0);
+    sem_wait(&semaphore);
+}
@@ -0,0 +1,48 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int i = -1;
+
+/*
+ * Test: like pthread_cond_signal, but the condition was never passed to pthread_cond_init.
+ * Bounce the ball between both threads 100 times. During this, libidle should never unlock.
+ */
+void *sleep_on_cond(void *arg)
+{
+    pthread_mutex_lock(&mutex);
+    for (int k = 0; k < 100; k++)
+    {
+        while (i != 2 * k)
+        {
+            pthread_cond_wait(&cond, &mutex);
+        }
+        i++;
+        pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&mutex);
+    return NULL;
+}
+
+int main()
+{
+    pthread_t thread;
+    pthread_create(&thread, NULL, &sleep_on_cond, NULL);
+
+    pthread_mutex_lock(&mutex);
+    for (int k = 0; k < 100; k++)
+    {
+        i = 2 * k;
+        pthread_cond_signal(&cond);
+        while (i != 2 * k + 1)
+        {
+            pthread_cond_wait(&cond, &mutex);
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    void *ret;
+    pthread_join(thread, &ret);
+    sleep(2);
+}
@@ -0,0 +1,27 @@
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+
+/*
+ * Test: start 50 threads one after the other, joining each while it's still running.
+ * Every thread hands over to its joiner as it exits, so we should not go idle in between:
+ * the one idle transition is at the end, when we wait forever.
+ */
+void *work(void *arg)
+{
+    usleep(1000);
+    return NULL;
+}
+
+int main()
+{
+    for (int i = 0; i < 50; i++)
+    {
+        pthread_t thread;
+        pthread_create(&thread, NULL, &work, NULL);
+        pthread_join(thread, NULL);
+    }
+    sem_t semaphore;
+    sem_init(&semaphore, 0, 0);
+    sem_wait(&semaphore);
+}
@@ -0,0 +1,95 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/libidle.h"
+
+// usage: shm_wait NAME SERIAL TIMEOUT_MS
+// succeeds once the process publishing to NAME is idle with a serial of at least SERIAL.
+// prints the serial, and how long until the next deadline if there is one.
+int main(int argc, char **argv)
+{
+    if (argc != 4)
+    {
+        fprintf(stderr, "usage: %s NAME SERIAL TIMEOUT_MS\n", argv[0]);
+        return 2;
+    }
+    int fd = shm_open(argv[1], O_RDWR, 0);
+    if (fd == -1)
+    {
+        perror("shm_open");
+        return 2;
+    }
+    LibidleShm *shm = mmap(NULL, sizeof(LibidleShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED)
+    {
+        perror("mmap");
+        return 2;
+    }
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != LIBIDLE_SHM_MAGIC)
+    {
+        fprintf(stderr, "not a libidle page\n");
+        return 2;
+    }
+    uint32_t serial = atoi(argv[2]);
+    long timeout_ms = atol(argv[3]);
+
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    __atomic_add_fetch(&shm->waiters, 1, __ATOMIC_SEQ_CST);
+    while (true)
+    {
+        uint32_t state = __atomic_load_n(&shm->state, __ATOMIC_SEQ_CST);
+        if (LIBIDLE_SHM_IDLE(state) && LIBIDLE_SHM_SERIAL(state) >= serial)
+        {
+            uint64_t next_deadline = __atomic_load_n(&shm->deadline, __ATOMIC_RELAXED);
+            if (next_deadline)
+            {
+                // the process's CLOCK_MONOTONIC is ours
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                int64_t remaining_ns = (int64_t) next_deadline - (int64_t) now.tv_sec * 1000000000 - now.tv_nsec;
+                printf("idle %u, next deadline in %ld ms\n", LIBIDLE_SHM_SERIAL(state), (long) (remaining_ns / 1000000));
+            }
+            else printf("idle %u\n", LIBIDLE_SHM_SERIAL(state));
+            return 0;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        struct timespec remaining = {
+            .tv_sec = deadline.tv_sec - now.tv_sec,
+            .tv_nsec = deadline.tv_nsec - now.tv_nsec,
+        };
+        if (remaining.tv_nsec < 0)
+        {
+            remaining.tv_sec--;
+            remaining.tv_nsec += 1000000000;
+        }
+        if (remaining.tv_sec < 0)
+        {
+            fprintf(stderr, "timeout\n");
+            return 1;
+        }
+        // FUTEX_WAIT takes a relative timeout
+        if (syscall(SYS_futex, &shm->state, FUTEX_WAIT, state, &remaining, NULL, 0) == -1
+            && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+        {
+            perror("futex");
+            return 2;
+        }
+    }
+}
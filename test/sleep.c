@@ -0,0 +1,43 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Test: sleep for a long time.
+ * This is busy, unless LIBIDLE_SLEEP_IDLE=1, in which case it is idle with a deadline 30s out.
+ * - short: sleep for a second at a time with sleep, nanosleep and usleep, while LIBIDLE_SAMPLE is sampling.
+ *   Exits with 1 if any of them comes back early.
+ */
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int check(const char *what, int ret, double since)
+{
+    double slept = now() - since;
+    if (ret == 0 && slept >= 0.99) return 0;
+    fprintf(stderr, "%s returned %d (%s) after %.3fs\n", what, ret, strerror(errno), slept);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "short") == 0)
+    {
+        int failed = 0;
+        double since = now();
+        failed |= check("sleep", sleep(1), since);
+        since = now();
+        struct timespec second = { .tv_sec = 1 };
+        failed |= check("nanosleep", nanosleep(&second, NULL), since);
+        since = now();
+        failed |= check("usleep", usleep(999999) == 0 && usleep(1) == 0 ? 0 : -1, since);
+        return failed;
+    }
+    sleep(30);
+}
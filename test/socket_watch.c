@@ -0,0 +1,48 @@
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../src/libidle.h"
+
+// usage: socket_watch PATH SERIAL TIMEOUT_MS
+// succeeds once the process listening on PATH reports going idle with a serial of at least SERIAL.
+int main(int argc, char **argv)
+{
+    if (argc != 4)
+    {
+        fprintf(stderr, "usage: %s PATH SERIAL TIMEOUT_MS\n", argv[0]);
+        return 2;
+    }
+    uint32_t serial = atoi(argv[2]);
+    int timeout_ms = atoi(argv[3]);
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+    {
+        perror("connect");
+        return 2;
+    }
+
+    // for simplicity, the timeout applies to every event, not to the whole run
+    struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+    while (poll(&pollfd, 1, timeout_ms) == 1)
+    {
+        LibidleEvent event;
+        if (recv(fd, &event, sizeof(event), 0) != sizeof(event))
+        {
+            fprintf(stderr, "disconnected\n");
+            return 2;
+        }
+        printf("%s %u\n", event.idle ? "idle" : "busy", event.serial);
+        if (event.idle && event.serial >= serial) return 0;
+    }
+    fprintf(stderr, "timeout\n");
+    return 1;
+}
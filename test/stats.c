@@ -0,0 +1,108 @@
+#define _GNU_SOURCE // needed for RTLD_DEFAULT
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/libidle.h"
+
+/*
+ * Test: let a named second thread be the last to go idle, after 50ms of work,
+ * then play sem ping-pong with it; check the counters from libidle_get_stats.
+ * Exits with 1 if they're off.
+ */
+#define ROUNDS 100
+
+static sem_t start, ping, pong;
+
+void *partner(void *arg)
+{
+    pthread_setname_np(pthread_self(), "partner");
+    usleep(50000);
+    sem_wait(&start);
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        sem_wait(&ping);
+        sem_post(&pong);
+    }
+    return NULL;
+}
+
+static LibidlePrimitiveStats *find_primitive(LibidleStats *stats, void *object)
+{
+    for (size_t i = 0; i < stats->primitives_len; i++)
+    {
+        if (stats->primitives[i].object == (uintptr_t) object) return &stats->primitives[i];
+    }
+    return NULL;
+}
+
+int main()
+{
+    LibidleStats *(*get_stats)() = dlsym(RTLD_DEFAULT, "libidle_get_stats");
+    void (*free_stats)(LibidleStats *) = dlsym(RTLD_DEFAULT, "libidle_free_stats");
+    if (!get_stats || !free_stats)
+    {
+        fprintf(stderr, "libidle not preloaded\n");
+        return 1;
+    }
+
+    sem_init(&start, 0, 0);
+    sem_init(&ping, 0, 0);
+    sem_init(&pong, 0, 0);
+    pthread_t thread;
+    pthread_create(&thread, NULL, &partner, NULL);
+    // idle once the partner waits for start
+    struct timespec timeout;
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_nsec += 200000000;
+    if (timeout.tv_nsec >= 1000000000)
+    {
+        timeout.tv_sec++;
+        timeout.tv_nsec -= 1000000000;
+    }
+    sem_timedwait(&start, &timeout);
+    sem_post(&start);
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        sem_post(&ping);
+        sem_wait(&pong);
+    }
+    pthread_join(thread, NULL);
+
+    LibidleStats *stats = get_stats();
+    LibidlePrimitiveStats *ping_stats = find_primitive(stats, &ping);
+    int ret = 0;
+    if (!ping_stats || ping_stats->kind != LIBIDLE_STATS_SEMAPHORE
+        || ping_stats->posts != ROUNDS || ping_stats->waits != ROUNDS)
+    {
+        fprintf(stderr, "wrong semaphore stats\n");
+        ret = 1;
+    }
+    // the main thread waited for start, on pong every round, and once to join
+    if (stats->threads_len != 1 || stats->threads[0].transitions != ROUNDS + 2 || stats->threads[0].busy_ns == 0)
+    {
+        fprintf(stderr, "wrong thread stats\n");
+        ret = 1;
+    }
+    if (stats->exited.transitions != ROUNDS + 1 || stats->mutex_acquisitions == 0)
+    {
+        fprintf(stderr, "wrong totals\n");
+        ret = 1;
+    }
+    // the first busy period ends with the partner waiting for start; it's the only one we can be sure of
+    LibidleBusyPeriod *period = &stats->busy_periods[0];
+    if (stats->busy_periods_len < 1 || period->serial != 1 || period->busy_ns < 50000000
+        || strcmp(period->last_name, "partner") != 0)
+    {
+        fprintf(stderr, "wrong busy period\n");
+        ret = 1;
+    }
+    free_stats(stats);
+    return ret;
+}
@@ -5,6 +5,7 @@ IDLE_SO="../src/libidle.so"
 
 make
 make -C ../src libidle.so
+make -C ../tools
 trap 'echo -e "\n# \e[41mTest failed.\e[0m"' ERR
 
 function expect_locked() {
@@ -31,12 +32,155 @@ function expect_not_locked() {
   ! flock --timeout 1 -x .libidle_state echo "Locked."
 }
 
+# LIBIDLE_SHM: wait on the futex word instead of the statefile
+function expect_shm_idle() {
+  CMD="$1"
+  EXPECTED_SERIAL="$2"
+  rm /dev/shm/libidle_test || true
+  LIBIDLE_SHM=libidle_test LD_PRELOAD=${LD_PRELOAD:+${LD_PRELOAD}:}${IDLE_SO} eval "$CMD &"
+  PROC=$!
+  trap "kill $PROC" RETURN
+  sleep 0.5 # ensure the process has created the page
+  build/shm_wait /libidle_test "$EXPECTED_SERIAL" 5000
+}
+
+function expect_shm_not_idle() {
+  CMD="$1"
+  rm /dev/shm/libidle_test || true
+  LIBIDLE_SHM=libidle_test LD_PRELOAD=${LD_PRELOAD:+${LD_PRELOAD}:}${IDLE_SO} eval "$CMD &"
+  PROC=$!
+  trap "kill $PROC" RETURN
+  sleep 0.5
+  # shouldn't go idle within 1s
+  ! build/shm_wait /libidle_test 1 1000
+}
+
+# the deadline published with the idle state must be within MAX_MS
+function expect_shm_deadline() {
+  CMD="$1"
+  MAX_MS="$2"
+  rm /dev/shm/libidle_test || true
+  LIBIDLE_SHM=libidle_test LD_PRELOAD=${LD_PRELOAD:+${LD_PRELOAD}:}${IDLE_SO} eval "$CMD &"
+  PROC=$!
+  trap "kill $PROC" RETURN
+  sleep 0.5
+  OUTPUT="$(build/shm_wait /libidle_test 1 5000)"
+  [[ "$OUTPUT" =~ next\ deadline\ in\ ([0-9]+)\ ms ]]
+  test "${BASH_REMATCH[1]}" -gt 0 -a "${BASH_REMATCH[1]}" -le "$MAX_MS"
+}
+
+# LIBIDLE_SOCKET: receive transition events
+function expect_socket_idle() {
+  CMD="$1"
+  EXPECTED_SERIAL="$2"
+  LIBIDLE_SOCKET=.libidle_socket LD_PRELOAD=${LD_PRELOAD:+${LD_PRELOAD}:}${IDLE_SO} eval "$CMD &"
+  PROC=$!
+  trap "kill $PROC" RETURN
+  sleep 0.5 # ensure the process is listening
+  build/socket_watch .libidle_socket "$EXPECTED_SERIAL" 5000
+}
+
+# tools/libidle-wait: no fixed sleep. TARGET is the statefile, shm name or socket the process publishes to.
+function expect_wait_idle() {
+  CMD="$1"
+  TARGET="$2"
+  EXPECTED_SERIAL="$3"
+  rm .libidle_state .libidle_socket /dev/shm/libidle_test || true
+  LD_PRELOAD=${LD_PRELOAD:+${LD_PRELOAD}:}${IDLE_SO} eval "$CMD &"
+  PROC=$!
+  trap "kill $PROC" RETURN
+  test "$(../tools/build/libidle-wait -t 5000 "$TARGET")" == "idle $EXPECTED_SERIAL"
+}
+
+function expect_wait_not_idle() {
+  CMD="$1"
+  TARGET="$2"
+  rm .libidle_state .libidle_socket /dev/shm/libidle_test || true
+  LD_PRELOAD=${LD_PRELOAD:+${LD_PRELOAD}:}${IDLE_SO} eval "$CMD &"
+  PROC=$!
+  trap "kill $PROC" RETURN
+  # shouldn't go idle within 1s
+  ! ../tools/build/libidle-wait -t 1000 "$TARGET"
+}
+
+# LIBIDLE_TRACE: the decoded trace must show the op. the flusher runs every 100ms.
+function expect_trace() {
+  CMD="$1"
+  EXPECTED_LINE="$2"
+  rm .libidle_trace || true
+  LIBIDLE_TRACE=.libidle_trace LD_PRELOAD=${LD_PRELOAD:+${LD_PRELOAD}:}${IDLE_SO} eval "$CMD &"
+  PROC=$!
+  trap "kill $PROC" RETURN
+  sleep 0.5
+  ../tools/build/libidle-trace .libidle_trace | grep -F -- "$EXPECTED_LINE"
+}
+
 # one call: accept
 expect_locked 'build/accept' '1'
 expect_locked 'build/sem_wait' '1'
+expect_locked 'build/fd_pingpong wait' '1'
+# join chains go idle once, at the end
+expect_locked 'build/pthread_join' '1'
+# short idle periods are debounced
+expect_locked 'LIBIDLE_IDLE_SETTLE_US=100000 build/idle_settle' '1'
+# the statefile holds only the serial, even with a deadline pending
+expect_locked 'LIBIDLE_SLEEP_IDLE=1 build/sleep' '1'
+# a thread that never blocks doesn't count if it's ignored by name
+expect_locked 'LIBIDLE_IGNORE_THREADS=gc-*,spin* build/ignore_threads' '1'
+# also when it's named by another thread while it spins
+expect_locked 'LIBIDLE_IGNORE_THREADS=gc-* build/ignore_threads named' '1'
+# a process tree is idle once every process in it is; the exec'd child doesn't touch the statefile
+expect_locked 'LIBIDLE_DOMAIN=1 build/fork_tree exec' '1'
+# threads that park with the futex syscall
+expect_locked 'LIBIDLE_FUTEX=1 build/futex wait' '1'
 # this cluster of tests bounces a signal between two threads. the check is that we should not
 # go idle at any point during it.
 expect_not_locked 'build/sem_post'
 expect_not_locked 'build/pthread_cond_signal'
+expect_not_locked 'build/pthread_cond_static'
+expect_not_locked 'build/fd_pingpong'
+expect_not_locked 'build/ignore_threads'
+expect_not_locked 'build/ignore_threads named'
+expect_not_locked 'LIBIDLE_DOMAIN=1 build/fork_tree spin'
+expect_not_locked 'LIBIDLE_DOMAIN=1 build/fork_tree pingpong'
+# killing the root leaves its domain behind, until the next root comes along
+KILLED_ROOT=$PROC
+wait $KILLED_ROOT || true
+test -e /dev/shm/libidle-domain-$KILLED_ROOT
+expect_locked 'LIBIDLE_DOMAIN=1 build/fork_tree exec' '1'
+test ! -e /dev/shm/libidle-domain-$KILLED_ROOT
+expect_not_locked 'LIBIDLE_COND_SIGNAL_ONE=1 build/pthread_cond_signal'
+expect_not_locked 'LIBIDLE_COND_SIGNAL_ONE=1 build/pthread_cond_static'
+expect_not_locked 'LIBIDLE_FUTEX=1 build/futex pingpong'
+
+expect_shm_idle 'build/accept' '1'
+expect_shm_not_idle 'build/sem_post'
+expect_shm_not_idle 'build/sleep'
+expect_shm_deadline 'LIBIDLE_SLEEP_IDLE=1 build/sleep' 30000
+# sem_clockwait and pthread_cond_clockwait, an hour out on CLOCK_MONOTONIC
+expect_shm_deadline 'build/futex clockwait' 3600000
+
+expect_socket_idle 'build/accept' '1'
+
+expect_wait_idle 'build/accept' .libidle_state '1'
+expect_wait_idle 'LIBIDLE_SHM=libidle_test build/accept' libidle_test '1'
+expect_wait_idle 'LIBIDLE_SOCKET=.libidle_socket build/accept' .libidle_socket '1'
+expect_wait_not_idle 'build/sem_post' .libidle_state
+
+expect_trace 'build/accept' 'b: 0: +block: accept()'
+expect_trace 'build/fd_pingpong wait' 's: 0: +block: read()'
+
+# counters from libidle_get_stats, and their dump at exit
+rm .libidle_stats || true
+LIBIDLE_STATS=.libidle_stats LD_PRELOAD=${LD_PRELOAD:+${LD_PRELOAD}:}${IDLE_SO} build/stats
+grep -E '^semaphore 0x[0-9a-f]+ posts=100 waits=100 ' .libidle_stats
+
+# a thread that keeps us busy by running is sampled, with its stack
+rm .libidle_samples || true
+LIBIDLE_SAMPLE=.libidle_samples LD_PRELOAD=${LD_PRELOAD:+${LD_PRELOAD}:}${IDLE_SO} build/busy_loop
+grep -F 'build/busy_loop(+0x' .libidle_samples
+
+# sampling leaves a thread that is asleep alone; its sleeps are not cut short
+LIBIDLE_SAMPLE=.libidle_samples LIBIDLE_SAMPLE_MS=1 LD_PRELOAD=${LD_PRELOAD:+${LD_PRELOAD}:}${IDLE_SO} build/sleep short
 
 echo -e "\n# \e[30;42mTest successful.\e[0m"
@@ -0,0 +1,265 @@
+#define _GNU_SOURCE // for O_CLOEXEC in older headers
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/libidle.h"
+#include "libidle-client.h"
+
+// how soon we look again for a process that isn't there, or at a statefile that nobody has written to
+#define RETRY_MIN_MS 1
+#define RETRY_MAX_MS 64
+
+static int64_t now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Milliseconds left until deadline (-1 for none), but at most cap (-1 for none).
+ * Returns -1 if both are none, as poll takes it.
+ */
+static int remaining_ms(int64_t deadline, int cap)
+{
+    if (deadline < 0) return cap;
+    int64_t remaining = deadline - now_ms();
+    if (remaining < 0) remaining = 0;
+    return cap >= 0 && cap < remaining ? cap : (int) remaining;
+}
+
+/**
+ * Each way of waiting returns the serial, or -1 with errno set.
+ * ENOENT means that the process isn't publishing there (yet, or anymore), and we should look again.
+ */
+
+static long wait_shm(const char *name, uint32_t after_serial, int64_t deadline)
+{
+    int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    // can't be a shm name, so it must be a statefile that doesn't exist yet
+    if (fd == -1 && (errno == EINVAL || errno == ENAMETOOLONG)) errno = ENOENT;
+    if (fd == -1) return -1;
+
+    // the process may have created the page, but not sized it yet; a short page would SIGBUS
+    struct stat st;
+    LibidleShm *shm = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(LibidleShm))
+    {
+        shm = mmap(NULL, sizeof(LibidleShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (shm == MAP_FAILED || __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != LIBIDLE_SHM_MAGIC)
+    {
+        if (shm != MAP_FAILED) munmap(shm, sizeof(LibidleShm));
+        errno = ENOENT;
+        return -1;
+    }
+
+    long result;
+    __atomic_add_fetch(&shm->waiters, 1, __ATOMIC_SEQ_CST);
+    while (true)
+    {
+        uint32_t state = __atomic_load_n(&shm->state, __ATOMIC_SEQ_CST);
+        if (LIBIDLE_SHM_IDLE(state) && LIBIDLE_SHM_SERIAL(state) > after_serial)
+        {
+            result = LIBIDLE_SHM_SERIAL(state);
+            break;
+        }
+        int wait_ms = remaining_ms(deadline, -1);
+        if (wait_ms == 0)
+        {
+            errno = ETIMEDOUT;
+            result = -1;
+            break;
+        }
+        // FUTEX_WAIT takes a relative timeout
+        struct timespec timeout = { .tv_sec = wait_ms / 1000, .tv_nsec = (wait_ms % 1000) * 1000000L };
+        if (syscall(SYS_futex, &shm->state, FUTEX_WAIT, state, wait_ms < 0 ? NULL : &timeout, NULL, 0) == -1
+            && errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+        {
+            result = -1;
+            break;
+        }
+    }
+    int wait_errno = errno;
+    __atomic_sub_fetch(&shm->waiters, 1, __ATOMIC_SEQ_CST);
+    munmap(shm, sizeof(LibidleShm));
+    errno = wait_errno;
+    return result;
+}
+
+static long wait_socket(const char *path, uint32_t after_serial, int64_t deadline)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+    {
+        // a socket that nobody listens on is left over from a process that's gone
+        if (errno == ECONNREFUSED) errno = ENOENT;
+        close(fd);
+        return -1;
+    }
+
+    // right after connecting, we get the current state
+    long result;
+    while (true)
+    {
+        struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pollfd, 1, remaining_ms(deadline, -1));
+        if (ready == 0) errno = ETIMEDOUT;
+        if (ready == -1 && errno == EINTR) continue;
+        if (ready != 1)
+        {
+            result = -1;
+            break;
+        }
+        LibidleEvent event;
+        if (recv(fd, &event, sizeof(event), 0) != sizeof(event))
+        {
+            // the process exited, or dropped us for falling behind: connect again
+            errno = ENOENT;
+            result = -1;
+            break;
+        }
+        if (event.idle && event.serial > after_serial)
+        {
+            result = event.serial;
+            break;
+        }
+    }
+    int wait_errno = errno;
+    close(fd);
+    errno = wait_errno;
+    return result;
+}
+
+/**
+ * libidle holds an exclusive flock on the statefile while the process is busy, and writes the serial
+ * just before it unlocks. flock can't time out, so we try it without blocking whenever the file is written,
+ * and ever more rarely while it isn't.
+ */
+static long wait_statefile(const char *path, uint32_t after_serial, int64_t deadline)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    int notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify == -1 || inotify_add_watch(notify, path, IN_MODIFY) == -1)
+    {
+        int watch_errno = errno;
+        if (notify != -1) close(notify);
+        close(fd);
+        errno = watch_errno;
+        return -1;
+    }
+
+    long result;
+    int retry_ms = RETRY_MIN_MS;
+    while (true)
+    {
+        // shared, so that waiters don't hold each other up
+        if (flock(fd, LOCK_SH | LOCK_NB) == 0)
+        {
+            char contents[64];
+            ssize_t len = pread(fd, contents, sizeof(contents) - 1, 0);
+            flock(fd, LOCK_UN);
+            // empty until the process has gone idle for the first time
+            if (len > 0)
+            {
+                contents[len] = '\0';
+                char *end;
+                unsigned long serial = strtoul(contents, &end, 10);
+                if (end != contents && serial > after_serial)
+                {
+                    result = serial;
+                    break;
+                }
+            }
+        }
+        else if (errno != EWOULDBLOCK)
+        {
+            result = -1;
+            break;
+        }
+        // a process that was started again may have made a new file
+        struct stat opened, current;
+        if (fstat(fd, &opened) == -1 || stat(path, &current) == -1
+            || opened.st_dev != current.st_dev || opened.st_ino != current.st_ino)
+        {
+            errno = ENOENT;
+            result = -1;
+            break;
+        }
+
+        int wait_ms = remaining_ms(deadline, retry_ms);
+        if (wait_ms == 0)
+        {
+            errno = ETIMEDOUT;
+            result = -1;
+            break;
+        }
+        struct pollfd pollfd = { .fd = notify, .events = POLLIN };
+        if (poll(&pollfd, 1, wait_ms) == 1)
+        {
+            char events[4096];
+            while (read(notify, events, sizeof(events)) > 0) { }
+            // the unlock comes right after the write
+            retry_ms = RETRY_MIN_MS;
+        }
+        else if (retry_ms < RETRY_MAX_MS)
+        {
+            retry_ms *= 2;
+        }
+    }
+    int wait_errno = errno;
+    close(notify);
+    close(fd);
+    errno = wait_errno;
+    return result;
+}
+
+long libidle_wait_idle(const char *path, uint32_t after_serial, int timeout_ms)
+{
+    int64_t deadline = timeout_ms < 0 ? -1 : now_ms() + timeout_ms;
+    int retry_ms = RETRY_MIN_MS;
+    while (true)
+    {
+        struct stat st;
+        bool exists = stat(path, &st) == 0;
+        long serial =
+            exists && S_ISSOCK(st.st_mode) ? wait_socket(path, after_serial, deadline) :
+            exists && S_ISREG(st.st_mode) ? wait_statefile(path, after_serial, deadline) :
+            wait_shm(path, after_serial, deadline);
+        if (serial != -1 || errno != ENOENT) return serial;
+
+        int wait_ms = remaining_ms(deadline, retry_ms);
+        if (wait_ms == 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        poll(NULL, 0, wait_ms);
+        if (retry_ms < RETRY_MAX_MS) retry_ms *= 2;
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef LIBIDLE_CLIENT_H
+#define LIBIDLE_CLIENT_H
+
+/**
+ * Client side of libidle, for harnesses that wait for a process to go idle.
+ * Link with build/libidle-client.a (and -lrt on glibc before 2.34).
+ */
+
+#include <stdint.h>
+
+/**
+ * Wait until the process publishing at path is idle with a serial greater than after_serial,
+ * for at most timeout_ms milliseconds, or forever if timeout_ms is negative.
+ *
+ * path is what the process was given as LIBIDLE_SHM, LIBIDLE_SOCKET or LIBIDLE_STATEFILE,
+ * and the way it publishes is the way we wait: a socket is subscribed to, a regular file is the statefile,
+ * and anything else is tried as a shared memory name. The shm page is the cheapest, since we just sleep on
+ * its futex word; the statefile is the most expensive, since we have to keep trying its lock.
+ * If the path doesn't exist yet, because the process is still starting up, we wait for it to appear.
+ * Since a statefile or page left over from an earlier run looks just like a current one, remove it before
+ * starting the process, or pass the last serial you saw.
+ *
+ * Returns the serial, or -1 with errno set: ETIMEDOUT, or whatever kept us from watching the process.
+ */
+long libidle_wait_idle(const char *path, uint32_t after_serial, int timeout_ms);
+
+#endif
@@ -0,0 +1,134 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/libidle.h"
+
+#define LIBIDLE_TRACE_OP_NAME(op, name) [op] = name,
+static const char *op_names[] = { LIBIDLE_TRACE_OPS(LIBIDLE_TRACE_OP_NAME) };
+#undef LIBIDLE_TRACE_OP_NAME
+
+typedef struct {
+    LibidleTraceEvent event;
+    size_t index; // position in the file, to keep the order of events with the same timestamp
+} Entry;
+
+// a thread in the block map
+typedef struct {
+    uint32_t thread;
+    char state;
+} Column;
+
+static int compare_entries(const void *a, const void *b)
+{
+    const Entry *x = a, *y = b;
+    if (x->event.timestamp != y->event.timestamp) return x->event.timestamp < y->event.timestamp ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static void print_block_map(Column *columns, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        if (i > 0) printf("|");
+        printf("%c", columns[i].state);
+    }
+}
+
+/**
+ * usage: libidle-trace FILE
+ * Prints the events of a LIBIDLE_TRACE file in the format of LIBIDLE_VERBOSE,
+ * prefixed with the time in seconds since the first event.
+ * The block map shows every thread as of its own last event.
+ */
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s FILE\n", argv[0]);
+        return 2;
+    }
+    FILE *file = fopen(argv[1], "rb");
+    if (!file)
+    {
+        perror(argv[1]);
+        return 2;
+    }
+    LibidleTraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != LIBIDLE_TRACE_MAGIC)
+    {
+        fprintf(stderr, "%s: not a libidle trace\n", argv[1]);
+        return 2;
+    }
+    if (header.version != LIBIDLE_TRACE_VERSION || header.event_size != sizeof(LibidleTraceEvent))
+    {
+        fprintf(stderr, "%s: unsupported trace version %u\n", argv[1], header.version);
+        return 2;
+    }
+
+    Entry *entries = NULL;
+    size_t len = 0, cap = 0;
+    LibidleTraceEvent event;
+    while (fread(&event, sizeof(event), 1, file) == 1)
+    {
+        if (len == cap)
+        {
+            cap = cap ? cap * 2 : 1024;
+            entries = realloc(entries, sizeof(Entry) * cap);
+        }
+        entries[len] = (Entry) { .event = event, .index = len };
+        len++;
+    }
+    fclose(file);
+    qsort(entries, len, sizeof(Entry), compare_entries);
+
+    Column *columns = NULL;
+    size_t columns_len = 0, columns_cap = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        LibidleTraceEvent *event = &entries[i].event;
+        size_t column;
+        for (column = 0; column < columns_len && columns[column].thread != event->thread; column++) { }
+        if (column == columns_len)
+        {
+            if (columns_len == columns_cap)
+            {
+                columns_cap = columns_cap ? columns_cap * 2 : 16;
+                columns = realloc(columns, sizeof(Column) * columns_cap);
+            }
+            columns[columns_len++] = (Column) { .thread = event->thread };
+        }
+        columns[column].state = event->state;
+
+        printf("%12.6f ", (event->timestamp - entries[0].event.timestamp) / 1e9);
+        const char *name = event->op < sizeof(op_names) / sizeof(*op_names) ? op_names[event->op] : "?";
+        switch (event->op)
+        {
+            case LIBIDLE_TRACE_BUSY:
+            case LIBIDLE_TRACE_IDLE:
+                printf("  %s %lu\n", name, (unsigned long) event->object);
+                break;
+            case LIBIDLE_TRACE_DROPPED:
+                printf("  %u: %lu %s\n", event->thread, (unsigned long) event->object, name);
+                break;
+            default:
+                print_block_map(columns, columns_len);
+                printf(": %u: ", event->thread);
+                if (event->transition == LIBIDLE_TRACE_ENTER) printf("+block: ");
+                if (event->transition == LIBIDLE_TRACE_LEAVE) printf("-block: ");
+                printf("%s 0x%lx\n", name, (unsigned long) event->object);
+                break;
+        }
+
+        if (event->op == LIBIDLE_TRACE_THREAD_EXIT)
+        {
+            memmove(&columns[column], &columns[column + 1], sizeof(Column) * (columns_len - column - 1));
+            columns_len--;
+        }
+    }
+    free(columns);
+    free(entries);
+    return 0;
+}
@@ -0,0 +1,50 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "libidle-client.h"
+
+static int usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s SERIAL] [-t TIMEOUT_MS] PATH\n", name);
+    return 2;
+}
+
+/**
+ * usage: libidle-wait [-s SERIAL] [-t TIMEOUT_MS] PATH
+ * Waits until the process publishing at PATH (its LIBIDLE_SHM, LIBIDLE_SOCKET or LIBIDLE_STATEFILE)
+ * is idle with a serial greater than SERIAL (by default 0: idle at all), then prints "idle" and the serial.
+ * Without -t, waits forever. Exits with 1 on timeout, 2 on other errors.
+ */
+int main(int argc, char **argv)
+{
+    uint32_t after_serial = 0;
+    int timeout_ms = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                after_serial = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                timeout_ms = atoi(optarg);
+                break;
+            default:
+                return usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) return usage(argv[0]);
+
+    long serial = libidle_wait_idle(argv[optind], after_serial, timeout_ms);
+    if (serial == -1)
+    {
+        int wait_errno = errno;
+        perror(argv[optind]);
+        return wait_errno == ETIMEDOUT ? 1 : 2;
+    }
+    printf("idle %ld\n", serial);
+    return 0;
+}